@@ -46,6 +46,12 @@ static void usage(const char * const name, const uint32_t nbufs)
     printf("\t[-n buffers]            packet buffers to allocate "
            "(default %u)\n",
            nbufs);
+    printf("\t[-B batch]              datagrams per socket system call "
+           "(default: backend default)\n");
+    printf("\t[-p usec]               kernel busy-poll time per receive "
+           "(default 0, off)\n");
+    printf("\t[-H]                    optional, buffers on huge pages\n");
+    printf("\t[-L]                    optional, lock buffers into memory\n");
 #ifndef NDEBUG
     printf("\t[-v verbosity]          verbosity level (0-%d, default %d)\n",
            DLEVEL, util_dlevel);
@@ -85,13 +91,14 @@ int
     bool busywait = false;
     struct w_sockopt opt = {0};
     uint32_t nbufs = 500000;
+    struct w_engopt eopt = {0};
 
     // handle arguments
     int ch;
 #ifndef NDEBUG
-    while ((ch = getopt(argc, argv, "hi:bzn:v:")) != -1) {
+    while ((ch = getopt(argc, argv, "hi:bzn:B:p:HLv:")) != -1) {
 #else
-    while ((ch = getopt(argc, argv, "hi:bzn:")) != -1) {
+    while ((ch = getopt(argc, argv, "hi:bzn:B:p:HL")) != -1) {
 #endif
         switch (ch) {
         case 'i':
@@ -106,6 +113,18 @@ int
         case 'n':
             nbufs = (uint32_t)MAX(1, strtoul(optarg, 0, 10));
             break;
+        case 'B':
+            eopt.batch = (uint32_t)MIN(UINT32_MAX, strtoul(optarg, 0, 10));
+            break;
+        case 'p':
+            eopt.busy_poll = (uint32_t)MIN(UINT32_MAX, strtoul(optarg, 0, 10));
+            break;
+        case 'H':
+            eopt.hugepages = true;
+            break;
+        case 'L':
+            eopt.mlock = true;
+            break;
         case 'v':
             util_dlevel = (short)MIN(DLEVEL, strtoul(optarg, 0, 10));
             break;
@@ -123,7 +142,7 @@ int
     }
 
     // initialize a warpcore engine on the given network interface
-    struct w_engine * w = w_init(ifname, 0, nbufs);
+    struct w_engine * w = w_init_opt(ifname, 0, nbufs, &eopt);
 
     // install a signal handler to clean up after interrupt
     ensure(signal(SIGTERM, &terminate) != SIG_ERR, "signal");
@@ -209,6 +209,71 @@ struct eth_addr {
 #endif
 
 
+/// Engine options.
+///
+struct w_engopt {
+    /// Number of datagrams the socket backend sends or receives per system
+    /// call. Zero selects the default.
+    uint32_t batch;
+    /// Microseconds for which the socket backend lets the kernel busy-poll the
+    /// NIC for new data before sleeping, via SO_BUSY_POLL and
+    /// SO_PREFER_BUSY_POLL on bound sockets and, with epoll, the busy-poll
+    /// parameters of the epoll instance. Values above the net.core.busy_read
+    /// sysctl need CAP_NET_ADMIN. Zero disables busy polling.
+    uint32_t busy_poll;
+    /// Number of engines that may share the interface, e.g., one per worker
+    /// thread, if all of them set the same value. The socket backend then
+    /// binds sockets to non-zero ports with SO_REUSEPORT, so each engine can
+    /// bind the same port, and the kernel spreads flows over the engines by
+    /// 4-tuple hash. Zero or one allows a single engine. Not supported by the
+    /// netmap backend. Engines must still be created from one thread.
+    uint32_t shards;
+    /// With w_engopt::shards, instead steer each packet to the socket of the
+    /// engine that bound the port (k + 1)-th, where k is the receiving CPU
+    /// modulo w_engopt::shards. Needs SO_ATTACH_REUSEPORT_CBPF.
+    bool shard_by_cpu;
+    /// Let the socket backend keep one unconnected kernel socket per local
+    /// address and port, and demultiplex received datagrams to the w_socks
+    /// bound to it in userspace, by four-tuple. w_bind() to a port that is
+    /// already bound and w_connect() then need no system calls, and w_rx_ready()
+    /// only returns w_socks with data. Datagrams are received by w_nic_rx() and
+    /// w_rx_ready(). Each w_sock keeps its own ECN and pacing options, but UDP
+    /// zero checksums are shared by the w_socks of a kernel socket; UDP GRO
+    /// and zero-copy transmit are not supported. Needs epoll or kqueue; ignored
+    /// by the other backends and variants.
+    bool demux;
+    /// Back the packet buffers of the socket backend with huge pages: 1 GiB
+    /// pages for pools of at least that size and 2 MiB pages otherwise, both
+    /// from the hugetlbfs pool (see vm.nr_hugepages), or transparent huge
+    /// pages if that pool is too small. The memory prefers the NUMA node of
+    /// the interface, or of the calling thread for virtual interfaces, and is
+    /// prefaulted. Needs MAP_HUGETLB; the netmap backend uses netmap memory.
+    bool hugepages;
+    /// Lock the packet buffers of the socket backend into memory with mlock(),
+    /// which also prefaults them. Needs a sufficient RLIMIT_MEMLOCK.
+    bool mlock;
+    /// Ask the NIC to timestamp all received packets (see w_iov::hwts), which
+    /// the socket backend does with SIOCSHWTSTAMP. This needs CAP_NET_ADMIN
+    /// and changes the interface for all processes on the host, until
+    /// w_cleanup() restores the previous setting.
+    bool hw_timestamps;
+    /// The socket backend only reserves address space for the nbufs packet
+    /// buffers at w_init(), and initializes them as needed. Once more than
+    /// this many are free, it returns the memory of groups of idle buffers to
+    /// the OS, unless they are on huge pages or locked. Zero selects the
+    /// default of 8192.
+    uint32_t pool_hiwat;
+    /// Give the socket backend a second pool of nbufs small (128-byte) packet
+    /// buffers, which w_alloc_iov() and w_alloc_len() use for short payloads.
+    /// A w_iov in a small buffer cannot be grown beyond that size.
+    bool small_bufs;
+    /// Copy short datagrams received by w_rx() into small buffers, so that
+    /// their full-size receive buffers return to the pool right away. Needs
+    /// small_bufs.
+    bool rx_compact;
+};
+
+
 /// A warpcore backend engine.
 ///
 struct w_engine {
@@ -222,11 +287,16 @@ struct w_engine {
 
     struct w_iov_sq iov; ///< Tail queue of w_iov buffers available.
 
+    /// Stack of w_iov buffers returned by other threads via w_free_remote(),
+    /// linked through w_iov::next. Only accessed atomically.
+    struct w_iov * remote;
+
     sl_entry(w_engine) next;      ///< Pointer to next engine.
     char ifname[IFNAMSIZ];        ///< Name of the interface of this engine.
     char drvname[IFNAMSIZ];       ///< Name of the driver of this interface.
     const char * backend_name;    ///< Name of the backend in @p b.
     const char * backend_variant; ///< Name of the backend variant in @p b.
+    struct w_engopt opt;          ///< Engine options.
 
     /// Pointer to generic user data (not used by warpcore.)
     void * data;
@@ -263,7 +333,26 @@ struct w_sockopt {
     uint32_t enable_udp_zero_checksums : 1;
     /// Enable ECN, by setting ECT(0) on all packets.
     uint32_t enable_ecn : 1;
-    uint32_t : 27;
+    /// Coalesce runs of equal-length w_iovs into UDP GSO sends. Only supported
+    /// by the socket backend on Linux; turned off again if the kernel refuses.
+    uint32_t enable_udp_gso : 1;
+    /// Receive coalesced UDP GRO datagrams and split them into w_iovs. Only
+    /// supported by the socket backend on Linux.
+    uint32_t enable_udp_gro : 1;
+    /// Transmit without copying payloads into the kernel. Sent w_iovs stay in
+    /// flight until the kernel releases them; see w_iov_in_flight(). Only
+    /// supported by the socket backend on Linux.
+    uint32_t enable_zero_copy : 1;
+    /// Hold w_iovs back until their w_iov::txtime. The socket backend passes
+    /// the departure time to the kernel via SO_TXTIME, which needs the fq
+    /// qdisc on the interface to take effect. Where the kernel does not
+    /// support SO_TXTIME, and with the other backends, w_tx() keeps copies of
+    /// the w_iovs that are not due yet and w_nic_tx() sends them later. Later
+    /// w_tx() calls queue behind those copies, so the order is kept. The copies
+    /// come from the pool of the engine; without enough spare w_iovs, the
+    /// remaining ones are dropped.
+    uint32_t enable_txtime : 1;
+    uint32_t : 23;
     uint32_t user_1 : 1; ///< User flag 1 (not used by warpcore.)
     uint32_t user_2 : 1; ///< User flag 2 (not used by warpcore.)
     uint32_t user_3 : 1; ///< User flag 3 (not used by warpcore.)
@@ -287,9 +376,34 @@ struct w_sock {
 
     sl_entry(w_sock) next; ///< Next socket.
 
-#if !defined(HAVE_KQUEUE) && !defined(HAVE_EPOLL)
+    struct w_iov_sq __paced;  ///< Internal use.
+    sl_entry(w_sock) __pnext; ///< Internal use.
+    struct w_tmpl * __tmpl;   ///< Internal use.
+    sl_entry(w_sock) __rdy;   ///< Internal use.
+    bool __pace;              ///< Internal use.
+    bool __ready;             ///< Internal use.
+
+#if (!defined(HAVE_KQUEUE) && !defined(HAVE_EPOLL)) || defined(HAVE_IO_URING)
     sl_entry(w_sock) __next; ///< Internal use.
 #endif
+
+#if defined(HAVE_MSG_ZEROCOPY) && !defined(HAVE_IO_URING)
+    struct w_zc * __zc; ///< Internal use.
+#endif
+
+#if !defined(HAVE_IO_URING) && (defined(HAVE_EPOLL) || defined(HAVE_KQUEUE))
+    struct w_ksock * __ks; ///< Internal use.
+#endif
+
+#ifdef HAVE_IO_URING
+    uint32_t __armed : 1;   ///< Internal use.
+    uint32_t __starved : 1; ///< Internal use.
+    uint32_t __closing : 1; ///< Internal use.
+    uint32_t : 29;
+    /// @cond
+    uint8_t _unused[4]; ///< @internal Padding.
+                        /// @endcond
+#endif
 };
 
 
@@ -315,19 +429,18 @@ struct w_sock {
 /// can be used to chain together longer data items for use with w_rx() and
 /// w_tx().
 ///
+/// The fields touched for every packet on RX, TX and when returning a w_iov to
+/// the pool come first and fit into 32 bytes.
+///
 struct w_iov {
+    uint8_t * buf;        ///< Start of payload data.
+    sq_entry(w_iov) next; ///< Next w_iov in a w_iov_sq.
+
     /// Pointer back to the warpcore instance associated with this w_iov.
     struct w_engine * w;
 
-    /// Sender IP address and port on RX. Destination IP address and port on TX
-    /// on a disconnected w_sock. Ignored on TX on a connected w_sock.
-    struct w_sockaddr saddr;
-
-    uint8_t * base;       ///< Absolute start of buffer.
-    uint8_t * buf;        ///< Start of payload data.
-    sq_entry(w_iov) next; ///< Next w_iov in a w_iov_sq.
-    uint32_t idx;         ///< Index of netmap buffer.
-    uint16_t len;         ///< Length of payload data.
+    uint32_t idx; ///< Index of netmap buffer.
+    uint16_t len; ///< Length of payload data.
 
     /// DSCP + ECN of the received IP packet on RX, DSCP + ECN to use for the
     /// to-be-transmitted IP packet on TX.
@@ -336,9 +449,32 @@ struct w_iov {
     /// TTL of received IP packets.
     uint8_t ttl;
 
+    uint8_t * base;  ///< Absolute start of buffer.
+    uint16_t __csum; ///< Internal use.
+
     /// Can be used by application to maintain arbitrary data. Not used by
     /// warpcore.
     uint16_t user_data;
+
+    /// Sender IP address and port on RX. Destination IP address and port on TX
+    /// on a disconnected w_sock. Ignored on TX on a connected w_sock.
+    struct w_sockaddr saddr;
+
+    /// Arrival time of received packets in nanoseconds of
+    /// w_now(CLOCK_REALTIME), or zero. The socket backend uses kernel
+    /// timestamps, the netmap backend the RX ring timestamp.
+    uint64_t ts;
+
+    /// Earliest departure time of the packet on TX, in nanoseconds of
+    /// w_now(CLOCK_MONOTONIC), if w_sockopt::enable_txtime is set on the
+    /// w_sock. Zero sends right away.
+    uint64_t txtime;
+
+    /// Arrival time of received packets in nanoseconds of the clock of the NIC,
+    /// or zero if the NIC did not timestamp them; see
+    /// w_engopt::hw_timestamps. That clock is not necessarily synchronized to
+    /// the system clock, so only compare these to each other.
+    uint64_t hwts;
 };
 
 
@@ -468,6 +604,12 @@ w_is_private(const struct w_addr * const a)
 extern struct w_engine * __attribute__((nonnull))
 w_init(const char * const ifname, const uint32_t rip, const uint_t nbufs);
 
+extern struct w_engine * __attribute__((nonnull(1)))
+w_init_opt(const char * const ifname,
+           const uint32_t rip,
+           const uint_t nbufs,
+           const struct w_engopt * const opt);
+
 extern void __attribute__((nonnull)) w_cleanup(struct w_engine * const w);
 
 extern struct w_sock * __attribute__((nonnull(1)))
@@ -520,10 +662,23 @@ w_rx_ready(struct w_engine * const w, struct w_sock_slist * sl);
 extern uint16_t __attribute__((nonnull))
 w_max_iov_len(const struct w_iov * const v, const uint16_t af);
 
+extern uint16_t __attribute__((nonnull))
+w_copy_cksum(struct w_iov * const v,
+             const void * const src,
+             const uint16_t len);
+
 extern void __attribute__((nonnull)) w_free(struct w_iov_sq * const q);
 
 extern void __attribute__((nonnull)) w_free_iov(struct w_iov * const v);
 
+extern void __attribute__((nonnull)) w_free_remote(struct w_iov_sq * const q);
+
+extern void __attribute__((nonnull))
+w_free_iov_remote(struct w_iov * const v);
+
+extern bool __attribute__((nonnull))
+w_iov_in_flight(const struct w_iov * const v);
+
 extern const char * __attribute__((nonnull))
 w_ntop(const struct w_addr * const addr, char * const dst);
 
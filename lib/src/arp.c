@@ -96,7 +96,7 @@ arp_is_at(struct w_engine * const w, uint8_t * const buf, const uint32_t ip)
     eth->type = ETH_TYPE_ARP;
 
     v->len = sizeof(*reply);
-    eth_tx_and_free(v);
+    eth_tx_ctl(v);
 }
 
 
@@ -138,7 +138,7 @@ void
          inet_ntop(AF_INET, &arp->spa, ip4_tmp, IP4_STRLEN));
 
     v->len = sizeof(*arp);
-    eth_tx_and_free(v);
+    eth_tx_ctl(v);
 }
 
 
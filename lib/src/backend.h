@@ -40,7 +40,11 @@
 
 #include <warpcore/warpcore.h>
 
-#if defined(HAVE_KQUEUE)
+#if defined(HAVE_IO_URING) && !defined(WITH_NETMAP)
+#include <sys/socket.h>
+
+#include "uring.h"
+#elif defined(HAVE_KQUEUE)
 #include <sys/event.h>
 #include <time.h>
 #elif defined(HAVE_EPOLL)
@@ -52,35 +56,175 @@
 #ifdef WITH_NETMAP
 #include "arp.h"
 #include "eth.h"
+#include "icmp.h"
 #include "neighbor.h"
 #include "udp.h"
+#endif
+
+// The socket backend can demultiplex datagrams to w_socks in userspace when it
+// waits for them with epoll or kqueue; see w_engopt::demux.
+#if !defined(WITH_NETMAP) && !defined(HAVE_IO_URING) &&                        \
+    (defined(HAVE_EPOLL) || defined(HAVE_KQUEUE))
+#define SOCK_DEMUX
+#endif
+
+// The socket backend only reserves address space for the packet buffers at
+// w_init(), initializes them in chunks when the pool runs dry, and returns the
+// memory of chunks whose buffers are all idle to the OS; see pool_grow() and
+// pool_idle(). With w_engopt::small_bufs, it also has a second size class of
+// SMALL_BUF_LEN-byte buffers, with indices from w_backend::small_idx.
+#if !defined(WITH_NETMAP) && !defined(PARTICLE) && !defined(RIOT_VERSION)
+#define POOL_ELASTIC
+#define POOL_CHUNK 1024              ///< Packet buffers per pool chunk.
+#define POOL_HIWAT (8 * POOL_CHUNK) ///< Default w_engopt::pool_hiwat.
+#define SMALL_BUF_LEN 128            ///< Length of a small buffer.
+#endif
+
+#if defined(WITH_NETMAP) || defined(SOCK_DEMUX)
+#include "flow.h"
+#endif
+
+
+#ifdef SOCK_DEMUX
+/// A kernel socket of the socket backend in w_engopt::demux mode, shared by
+/// all w_socks bound to its local address and port.
+///
+struct w_ksock {
+    sl_entry(w_ksock) next;  ///< Next w_ksock of the engine.
+    struct w_sockaddr local; ///< Local address and port.
+    struct w_sockopt opt;    ///< Options applied to @p fd as a whole.
+    intptr_t fd;             ///< Socket descriptor.
+    uint32_t refs;           ///< Number of w_socks using @p fd.
+    bool eph;                ///< Bound to an ephemeral port.
+    bool pace;               ///< Emulate SO_TXTIME on @p fd.
+    /// @cond
+    uint8_t _unused[2]; ///< @internal Padding.
+                        /// @endcond
+};
+
+sl_head(w_ksock_slist, w_ksock);
+#endif
+
+
+#if defined(HAVE_IO_URING) && !defined(WITH_NETMAP)
+/// A TX message queued on the io_uring by w_tx(), until w_nic_tx() submits
+/// it. Holds a TOS, a UDP GSO and a SO_TXTIME cmsg.
+///
+struct w_uring_tx {
+    struct msghdr msg;          ///< The message.
+    struct sockaddr_storage sa; ///< Destination address.
+    struct w_sock * s;          ///< The w_sock the message is sent on.
+    struct w_iov * v;           ///< First w_iov in the message.
+    __extension__ uint8_t ctrl[CMSG_SPACE(sizeof(int)) +
+                               CMSG_SPACE(sizeof(uint16_t)) +
+                               CMSG_SPACE(sizeof(uint64_t))];
+    bool retry; ///< The message needs to be resent.
+    bool zc;    ///< The message is sent with IORING_OP_SENDMSG_ZC.
+    /// @cond
+    uint8_t _unused[6]; ///< @internal Padding.
+                        /// @endcond
+};
+
+
+/// A TX message that w_nic_tx() needs to queue again.
+///
+struct w_uring_retry {
+    struct w_sock * s; ///< The w_sock the message is sent on.
+    struct w_iov * v;  ///< First w_iov in the message.
+    size_t n;          ///< Number of w_iovs in the message.
+};
+#endif
+
+
+#if defined(HAVE_MSG_ZEROCOPY) && !defined(WITH_NETMAP)
+/// A buffer sent with MSG_ZEROCOPY, together with the sequence number the
+/// kernel assigned to the send.
+///
+struct w_zc_ent {
+    uint32_t seq;      ///< Zero-copy sequence number of the send.
+    uint32_t idx : 31; ///< Index of the buffer.
+    uint32_t done : 1; ///< The kernel has released the buffer.
+};
+
+
+/// Zero-copy transmit state of a w_sock. Sends are numbered by the kernel in
+/// order, and released in (possibly coalesced) ranges via the error queue.
+/// With io_uring, there is one for the engine, numbered by w_tx(), and
+/// each notification completion releases one send.
+///
+struct w_zc {
+    sl_entry(w_zc) next;    ///< Next w_zc of the engine.
+    struct w_sock * s;      ///< The w_sock.
+    struct w_zc_ent * ent;  ///< FIFO of buffers not yet released.
+    uint32_t head;          ///< Head of @p ent.
+    uint32_t tail;          ///< Tail of @p ent.
+    uint32_t mask;          ///< Index mask of @p ent.
+    uint32_t seq;           ///< Sequence number of the next send.
+};
 
-KHASH_INIT(sock,
-           struct w_socktuple *,
-           struct w_sock *,
-           1,
-           w_socktuple_hash,
-           w_socktuple_cmp)
+sl_head(w_zc_slist, w_zc);
+#endif
+
+
+#ifdef WITH_NETMAP
+/// Transmit header template of a connected w_sock, built by udp_mk_tmpl(). The
+/// headers have all fields that vary per packet (IP TOS, lengths, IPv4 ID and
+/// checksums) zeroed; the IPv4 header checksum covers the remaining fields.
+///
+struct w_tmpl {
+    /// Ethernet, IP and UDP headers.
+    uint8_t hdr[sizeof(struct eth_hdr) + 40 + sizeof(struct udp_hdr)];
+    uint16_t id;  ///< IPv4 ID of the next packet.
+    uint32_t sum; ///< Partial UDP pseudo-header checksum; see pseudo_cksum().
+    uint32_t gen; ///< w_neighbors::gen when the destination MAC was checked.
+};
 #endif
 
 
 struct w_backend {
+    struct w_sock_slist paced; ///< Sockets with w_iovs held back for pacing.
+    struct w_iov_sq pace_sent; ///< Paced w_iovs sent by the last pace_flush().
 #ifdef WITH_NETMAP
-    int fd;                     ///< Netmap file descriptor.
-    uint32_t cur_txr;           ///< Index of the TX ring currently active.
-    struct netmap_if * nif;     ///< Netmap interface.
-    struct nmreq * req;         ///< Netmap request structure.
-    khash_t(neighbor) neighbor; ///< The ARP cache.
-    uint32_t * tail;            ///< TX ring tails after last NIOCTXSYNC call.
-    struct w_iov *** slot_buf;  ///< For each ring slot, a pointer to its w_iov.
-    khash_t(sock) sock;         ///< List of open (bound) w_sock sockets.
+    int fd;                      ///< Netmap file descriptor.
+    uint32_t cur_txr;            ///< Index of the TX ring currently active.
+    struct netmap_if * nif;      ///< Netmap interface.
+    struct nmreq * req;          ///< Netmap request structure.
+    struct w_neighbors neighbor; ///< The ARP cache.
+    uint32_t * tail;             ///< TX ring tails after last NIOCTXSYNC call.
+    struct w_iov *** slot_buf;   ///< For each ring slot, its w_iov.
+    struct w_flows flows;        ///< Open (bound) w_sock sockets, by tuple.
+    struct w_sock_slist rdy;     ///< Sockets with pending RX data.
+    uint64_t rx_ts;              ///< Timestamp of the RX ring being processed.
+    struct w_icmp_limit icmp;    ///< Rate limits for generated ICMP messages.
 #else
-#if defined(HAVE_KQUEUE)
+#if defined(HAVE_IO_URING)
+    struct uring ring;                ///< The io_uring.
+    struct io_uring_buf_ring * rx_br; ///< Provided-buffer ring for RX.
+    struct w_iov ** rx_iov;           ///< For each RX buffer ID, its w_iov.
+    struct w_uring_tx * tx;           ///< Queued TX messages.
+    struct iovec * tx_iov;            ///< iovecs for queued TX messages.
+    struct w_uring_retry * tx_retry;  ///< TX messages to queue again.
+    struct io_uring_sqe * tx_link;    ///< Last unsubmitted TX SQE.
+    struct w_sock * tx_link_s;        ///< The w_sock of @p tx_link.
+    struct msghdr rx_msg;             ///< Template for multishot recvmsg.
+    struct w_sock_slist socks;        ///< List of bound sockets.
+    struct w_sock_slist rdy;          ///< Sockets with pending RX data.
+    uint32_t rx_mask;                 ///< Index mask of @p rx_br.
+    uint32_t rx_tail;                 ///< Tail of @p rx_br.
+    uint32_t rx_posted;               ///< Buffers currently in @p rx_br.
+    uint32_t n_starved;               ///< Sockets lacking RX buffers.
+    uint32_t tx_n;                    ///< Number of queued TX messages.
+    uint32_t tx_iov_n;                ///< Number of used @p tx_iov.
+    uint32_t tx_inflight;             ///< TX messages not yet sent.
+#elif defined(HAVE_KQUEUE)
     struct kevent ev[64]; // XXX arbitrary value
     int kq;
 #elif defined(HAVE_EPOLL)
     int ep;
     struct epoll_event ev[64]; // XXX arbitrary value
+#ifdef HAVE_EPOLL_PWAIT2
+    bool pwait2; ///< Whether the kernel has epoll_pwait2().
+#endif
 #else
 #ifndef RIOT_VERSION
     struct pollfd * fds;
@@ -89,6 +233,64 @@ struct w_backend {
     gnrc_netif_t * nif;
 #endif
     struct w_sock_slist socks;
+#endif
+    size_t mem_len; ///< Length of w_engine::mem.
+    bool mem_huge;  ///< Whether w_engine::mem was mapped by huge_alloc().
+#ifdef HAVE_SO_TIMESTAMPING
+    bool hwts_set;   ///< Whether hwts_init() changed the NIC configuration.
+    int hwts_tx;     ///< NIC TX timestamp type before hwts_init().
+    int hwts_filter; ///< NIC RX timestamp filter before hwts_init().
+#endif
+#ifdef POOL_ELASTIC
+    uint32_t pool_max;     ///< MTU-sized buffers reserved.
+    uint32_t pool_len;     ///< MTU-sized buffers initialized by pool_grow().
+    uint32_t small_idx;    ///< Index of the first small buffer.
+    uint32_t small_max;    ///< Small buffers reserved.
+    uint32_t small_len;    ///< Small buffers initialized by pool_grow().
+    uint8_t * small_mem;   ///< Memory of the small buffers.
+    struct w_iov_sq small; ///< Free small buffers.
+    uint16_t * pool_free;  ///< For each chunk, the number of its free buffers.
+#endif
+#ifdef SOCK_DEMUX
+    struct w_flows flows;        ///< Demultiplexed w_socks, by four-tuple.
+    struct w_ksock_slist ksocks; ///< Shared kernel sockets.
+    struct w_sock_slist rdy;     ///< Sockets with demultiplexed RX data.
+#endif
+#ifdef HAVE_UDP_GRO
+    uint8_t * gro_buf; ///< Staging area for UDP GRO receives, or zero.
+#endif
+#if !defined(HAVE_IO_URING) && !defined(RIOT_VERSION)
+    // Message arrays for w_tx() and w_rx(), prepared once per engine and
+    // patched per datagram.
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr * tx_msg; ///< TX messages.
+#else
+    struct msghdr * tx_msg; ///< TX messages.
+#endif
+    struct iovec * tx_iov;          ///< iovecs of @p tx_msg.
+    struct sockaddr_storage * tx_sa; ///< Destination addresses.
+    uint8_t * tx_ctrl;               ///< Control data of @p tx_msg.
+    struct w_iov ** tx_first;        ///< First w_iov of each TX message.
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr * rx_msg; ///< RX messages.
+#else
+    struct msghdr * rx_msg; ///< RX messages.
+#endif
+    struct iovec * rx_iov;           ///< iovecs of @p rx_msg.
+    struct sockaddr_storage * rx_sa; ///< Source addresses.
+    uint8_t * rx_ctrl;               ///< Control data of @p rx_msg.
+    struct w_iov ** rx_v;            ///< Prepared RX buffers.
+    uint32_t rx_n;                   ///< Number of prepared RX buffers.
+    uint32_t batch;                  ///< Datagrams per send or receive call.
+#endif
+#ifdef HAVE_MSG_ZEROCOPY
+    uint16_t * zc_state; ///< Per-buffer zero-copy references and ZC_PARKED.
+#ifdef HAVE_IO_URING
+    struct w_zc zc; ///< Zero-copy state of the io_uring.
+#else
+    struct w_zc_slist zc; ///< Zero-copy state of sockets.
+#endif
+    uint32_t zc_held; ///< Number of buffers with zero-copy references.
 #endif
     int n;
 #ifndef HAVE_KQUEUE
@@ -100,6 +302,24 @@ struct w_backend {
 };
 
 
+#if defined(HAVE_IO_URING) && !defined(WITH_NETMAP)
+// Source address and control data space for received datagrams. The address
+// space is rounded up so the headroom stays 8-byte aligned. The control data
+// holds the TOS, TTL and timestamp cmsgs.
+#define URING_RX_NAME 32
+#define URING_RX_CTRL 128
+
+/// Space in front of each socket-backend buffer for the io_uring_recvmsg_out
+/// header, source address and control data that the kernel stores ahead of
+/// the payload of a multishot recvmsg. This makes the payload start at
+/// w_iov::base.
+#define BUF_HEADROOM                                                           \
+    (sizeof(struct io_uring_recvmsg_out) + URING_RX_NAME + URING_RX_CTRL)
+#else
+#define BUF_HEADROOM 0
+#endif
+
+
 #ifdef WITH_NETMAP
 #define max_buf_len(w) (uint16_t)((w)->mtu)
 #define iov_off(w, af)                                                         \
@@ -110,6 +330,13 @@ struct w_backend {
 #define iov_off(w, af) 0
 #endif
 
+#if defined(HAVE_IO_URING) && !defined(WITH_NETMAP)
+// Distance between buffers in w_engine::mem, kept 8-byte aligned.
+#define buf_stride(w) (((size_t)max_buf_len(w) + BUF_HEADROOM + 7) & ~(size_t)7)
+#else
+#define buf_stride(w) ((size_t)max_buf_len(w))
+#endif
+
 
 static inline bool __attribute__((nonnull))
 is_pipe(const struct w_engine * const w
@@ -143,9 +370,195 @@ idx_to_buf(const struct w_engine * const w, const uint32_t i)
 #ifdef WITH_NETMAP
     return (uint8_t *)NETMAP_BUF(NETMAP_TXRING(w->b->nif, 0), i);
 #else
-    return (uint8_t *)w->mem + ((intptr_t)i * max_buf_len(w));
+#ifdef POOL_ELASTIC
+    if (unlikely(i >= w->b->small_idx))
+        return w->b->small_mem + (size_t)(i - w->b->small_idx) * SMALL_BUF_LEN;
+#endif
+    return (uint8_t *)w->mem + ((intptr_t)i * buf_stride(w)) + BUF_HEADROOM;
+#endif
+}
+
+
+/// Return whether w_iov @p v is a small buffer; see w_engopt::small_bufs.
+///
+/// @param[in]  v     A w_iov.
+///
+/// @return     True if @p v is a small buffer.
+///
+static inline bool __attribute__((nonnull))
+iov_small(const struct w_iov * const v
+#ifndef POOL_ELASTIC
+          __attribute__((unused))
+#endif
+)
+{
+#ifdef POOL_ELASTIC
+    return unlikely(v->idx >= v->w->b->small_idx);
+#else
+    return false;
+#endif
+}
+
+
+/// Return the buffer length of w_iov @p v.
+///
+/// @param[in]  v     A w_iov.
+///
+/// @return     SMALL_BUF_LEN for a small buffer, max_buf_len() otherwise.
+///
+static inline uint16_t __attribute__((nonnull))
+iov_max_len(const struct w_iov * const v)
+{
+#ifdef POOL_ELASTIC
+    if (iov_small(v))
+        return SMALL_BUF_LEN;
+#endif
+    return max_buf_len(v->w);
+}
+
+
+#if defined(HAVE_IO_URING) && !defined(WITH_NETMAP)
+/// For a pointer into a socket-backend buffer, get the buffer index.
+///
+/// @param      w     Backend engine.
+/// @param      p     Pointer into a buffer.
+///
+/// @return     Index of the buffer containing @p p.
+///
+static inline uint32_t __attribute__((nonnull))
+buf_to_idx(const struct w_engine * const w, const void * const p)
+{
+    const struct w_backend * const b = w->b;
+    if (unlikely((const uint8_t *)p >= b->small_mem &&
+                 (const uint8_t *)p <
+                     b->small_mem + (size_t)b->small_max * SMALL_BUF_LEN))
+        return b->small_idx +
+               (uint32_t)((size_t)((const uint8_t *)p - b->small_mem) /
+                          SMALL_BUF_LEN);
+    return (uint32_t)((size_t)((const uint8_t *)p - (const uint8_t *)w->mem) /
+                      buf_stride(w));
+}
+#endif
+
+
+#ifdef POOL_ELASTIC
+extern bool __attribute__((nonnull))
+pool_grow(struct w_engine * const w, const bool small);
+
+extern void __attribute__((nonnull))
+pool_idle(struct w_engine * const w, const uint32_t chunk);
+
+
+/// Account for the w_iov with index @p idx being taken from the pool of
+/// engine @p w.
+///
+/// @param      w     Backend engine.
+/// @param[in]  idx   Index of the w_iov.
+///
+static inline void __attribute__((nonnull))
+pool_get(struct w_engine * const w, const uint32_t idx)
+{
+    w->b->pool_free[idx / POOL_CHUNK]--;
+}
+
+
+/// Account for the w_iov with index @p idx being returned to the pool of
+/// engine @p w, and let pool_idle() handle its chunk if that became idle.
+///
+/// @param      w     Backend engine.
+/// @param[in]  idx   Index of the w_iov.
+///
+static inline void __attribute__((nonnull))
+pool_put(struct w_engine * const w, const uint32_t idx)
+{
+    if (unlikely(++w->b->pool_free[idx / POOL_CHUNK] == POOL_CHUNK))
+        pool_idle(w, idx / POOL_CHUNK);
+}
+#else
+#define pool_get(...)
+#define pool_put(...)
+#endif
+
+
+/// Return the free list of the size class of the w_iov with index @p idx.
+///
+/// @param      w     Backend engine.
+/// @param[in]  idx   Index of the w_iov.
+///
+/// @return     The free list to return the w_iov to.
+///
+static inline struct w_iov_sq * __attribute__((nonnull))
+pool_list(struct w_engine * const w,
+          const uint32_t idx
+#ifndef POOL_ELASTIC
+          __attribute__((unused))
 #endif
+)
+{
+#ifdef POOL_ELASTIC
+    if (unlikely(idx >= w->b->small_idx))
+        return &w->b->small;
+#endif
+    return &w->iov;
+}
+
+
+#if defined(HAVE_MSG_ZEROCOPY) && !defined(WITH_NETMAP)
+// Set in w_backend::zc_state when the app has freed a w_iov that the kernel
+// still references.
+#define ZC_PARKED 0x8000
+
+/// Take a zero-copy TX reference on w_iov @p v.
+///
+/// @param      v     The w_iov being sent.
+///
+static inline void __attribute__((nonnull)) zc_hold(const struct w_iov * const v)
+{
+    struct w_backend * const b = v->w->b;
+    if ((b->zc_state[v->idx]++ & ~ZC_PARKED) == 0)
+        b->zc_held++;
+}
+
+
+/// Drop a zero-copy TX reference on the w_iov with index @p idx. If it was the
+/// last one and the app has already freed the w_iov, return it to the pool.
+///
+/// @param      w     Backend engine.
+/// @param[in]  idx   Index of the w_iov.
+///
+static inline void __attribute__((nonnull))
+zc_release(struct w_engine * const w, const uint32_t idx)
+{
+    struct w_backend * const b = w->b;
+    if ((--b->zc_state[idx] & ~ZC_PARKED) != 0)
+        return;
+    b->zc_held--;
+    if (b->zc_state[idx] & ZC_PARKED) {
+        b->zc_state[idx] = 0;
+        struct w_iov * const v = w_iov(w, idx);
+        sq_insert_head(pool_list(w, idx), v, next);
+        ASAN_POISON_MEMORY_REGION(v->base, iov_max_len(v));
+        pool_put(w, idx);
+    }
+}
+
+
+/// If the kernel still references w_iov @p v, mark it to be returned to the
+/// pool by zc_release() instead of now.
+///
+/// @param      v     The w_iov being freed.
+///
+/// @return     True if @p v was parked, false if it can be freed now.
+///
+static inline bool __attribute__((nonnull)) zc_park(const struct w_iov * const v)
+{
+    uint16_t * const st = &v->w->b->zc_state[v->idx];
+    if (likely(*st == 0))
+        return false;
+    *st |= ZC_PARKED;
+    return true;
 }
+#endif
 
 
 static inline uint16_t __attribute__((always_inline)) pick_local_port(void)
@@ -181,6 +594,35 @@ init_iov(struct w_engine * const w, struct w_iov * const v, const uint32_t idx);
 extern struct w_iov * __attribute__((nonnull))
 w_alloc_iov_base(struct w_engine * const w);
 
+extern struct w_iov * __attribute__((nonnull))
+pool_alloc(struct w_engine * const w, const bool small);
+
+extern void __attribute__((nonnull)) pool_reclaim(struct w_engine * const w);
+
+extern void __attribute__((nonnull))
+pace_defer(struct w_sock * const s, const struct w_iov * v);
+
+extern void __attribute__((nonnull)) pace_flush(struct w_engine * const w);
+
+
+/// Return whether w_tx() must hold back w_iov @p v on w_sock @p s for pacing,
+/// either because it is not due yet, or because earlier w_iovs still are.
+///
+/// @param[in]  s     The w_sock to send on.
+/// @param[in]  v     The w_iov to send.
+/// @param[in]  now   The current time, in nanoseconds of CLOCK_MONOTONIC.
+///
+/// @return     True if @p v and all w_iovs after it must go to pace_defer().
+///
+static inline bool __attribute__((nonnull))
+pace_hold(const struct w_sock * const s,
+          const struct w_iov * const v,
+          const uint64_t now)
+{
+    return unlikely(s->__pace) &&
+           (v->txtime > now || unlikely(!sq_empty(&s->__paced)));
+}
+
 extern int __attribute__((nonnull(1)))
 backend_bind(struct w_sock * const s, const struct w_sockopt * const opt);
 
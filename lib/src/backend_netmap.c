@@ -30,6 +30,7 @@
 #endif
 
 #include <fcntl.h>
+#include <inttypes.h>
 #include <net/if.h>
 #include <net/netmap_user.h>
 #include <poll.h>
@@ -53,24 +54,22 @@
 #include "backend.h"
 #include "eth.h"
 #include "ifaddr.h"
+#include "in_cksum.h"
 #include "neighbor.h"
 #include "udp.h"
 
 
 static void __attribute__((nonnull)) ins_sock(struct w_sock * const s)
 {
-    int ret;
-    const khiter_t k = kh_put(sock, &s->w->b->sock, &s->tup, &ret);
-    assure(ret >= 1, "inserted is %d", ret);
-    kh_val(&s->w->b->sock, k) = s;
+    const bool ret = flow_ins(&s->w->b->flows, s);
+    assure(ret, "inserted");
 }
 
 
 static void __attribute__((nonnull)) rem_sock(struct w_sock * const s)
 {
-    const khiter_t k = kh_get(sock, &s->w->b->sock, &s->tup);
-    assure(k != kh_end(&s->w->b->sock), "found");
-    kh_del(sock, &s->w->b->sock, k);
+    const bool ret = flow_rem(&s->w->b->flows, s);
+    assure(ret, "found");
 }
 
 
@@ -82,6 +81,8 @@ static void __attribute__((nonnull)) rem_sock(struct w_sock * const s)
 void w_set_sockopt(struct w_sock * const s, const struct w_sockopt * const opt)
 {
     s->opt = *opt;
+    // there is no kernel support for pacing, so always emulate it
+    s->__pace = opt->enable_txtime;
 }
 
 
@@ -96,7 +97,10 @@ void backend_init(struct w_engine * const w, const uint32_t nbufs)
 {
     struct w_backend * const b = w->b;
 
+    ensure(w->opt.shards <= 1, "netmap backend cannot shard %s", w->ifname);
+
     backend_addr_config(w);
+    cksum_init();
 
     // open /dev/netmap
     ensure((b->fd = open("/dev/netmap", O_RDWR | O_CLOEXEC)) != -1,
@@ -129,8 +133,9 @@ void backend_init(struct w_engine * const w, const uint32_t nbufs)
         b->req->nr_ringid = 1 & NETMAP_RING_MASK;
 
         // preload ARP cache
+        neighbor_tick(w);
         for (uint16_t idx = 0; idx < w->addr_cnt; idx++)
-            neighbor_update(w, &w->ifaddr[idx].addr,
+            neighbor_static(w, &w->ifaddr[idx].addr,
                             (struct eth_addr){ETH_ADDR_NONE});
     } else {
         strncpy(b->req->nr_name, w->ifname, sizeof b->req->nr_name);
@@ -169,13 +174,13 @@ void backend_init(struct w_engine * const w, const uint32_t nbufs)
              r->slot[0].buf_idx, r->slot[r->num_slots - 1].buf_idx);
     }
 
-#ifndef NDEBUG
     for (uint32_t ri = 0; likely(ri < b->nif->ni_rx_rings); ri++) {
-        const struct netmap_ring * const r = NETMAP_RXRING(b->nif, ri);
+        struct netmap_ring * const r = NETMAP_RXRING(b->nif, ri);
+        // have netmap update the ring timestamp on every RX sync
+        r->flags |= NR_TIMESTAMP;
         warn(INF, "rx ring %d has %d slots (%d-%d)", ri, r->num_slots,
              r->slot[0].buf_idx, r->slot[r->num_slots - 1].buf_idx);
     }
-#endif
 
     // save the indices of the extra buffers in the warpcore structure
     w->bufs = calloc(b->req->nr_arg3, sizeof(*w->bufs));
@@ -206,14 +211,22 @@ void backend_init(struct w_engine * const w, const uint32_t nbufs)
 ///
 void backend_cleanup(struct w_engine * const w)
 {
-    // close all sockets
-    struct w_sock * s;
-    kh_foreach_value(&w->b->sock, s, { w_close(s); });
-    kh_release(sock, &w->b->sock);
+    // close all sockets (removals never resize the flow table)
+    const struct w_flows * const f = &w->b->flows;
+    for (uint32_t slot = 0; slot < f->grps * FLOW_GRP; slot++)
+        if (f->sock[slot])
+            w_close(f->sock[slot]);
+    flow_free(&w->b->flows);
 
     // free ARP cache
     free_neighbor(w);
 
+    const struct w_icmp_limit * const icmp = &w->b->icmp;
+    if (icmp->drops[ICMP_ECHO] || icmp->drops[ICMP_UNREACH])
+        warn(INF, "ICMP rate limit dropped %" PRIu64 " echo replies, %" PRIu64
+                  " unreachables",
+             icmp->drops[ICMP_ECHO], icmp->drops[ICMP_UNREACH]);
+
     // re-construct the extra bufs list, so netmap can free the memory
     for (uint32_t n = 0; likely(n < sq_len(&w->iov)); n++) {
         uint32_t * const buf = (void *)idx_to_buf(w, w->bufs[n].idx);
@@ -266,7 +279,8 @@ int backend_bind(struct w_sock * const s, const struct w_sockopt * const opt)
 }
 
 
-/// The netmap backend performs no operation here.
+/// Netmap-specific code to close a warpcore socket. Removes it from the
+/// socket hash and frees its header template, if any.
 ///
 /// @param      s     The w_sock to close.
 ///
@@ -274,6 +288,9 @@ void backend_close(struct w_sock * const s)
 {
     // remove the socket from list of sockets
     rem_sock(s);
+    if (s->__ready)
+        sl_remove(&s->w->b->rdy, s, w_sock, __rdy);
+    free(s->__tmpl);
 }
 
 
@@ -284,9 +301,34 @@ void backend_preconnect(struct w_sock * const s)
 }
 
 
+/// Bring the destination MAC address and header template of connected w_sock
+/// @p s in line with the neighbor cache. If the peer is not resolved (any
+/// more), @p s has no template, and udp_tx() holds frames for it.
+///
+/// @param      s     The w_sock to check.
+///
+static void __attribute__((nonnull)) refresh_dmac(struct w_sock * const s)
+{
+    struct eth_addr mac;
+    if (who_has(s->w, &s->ws_raddr, &mac) == false) {
+        free(s->__tmpl);
+        s->__tmpl = 0;
+        return;
+    }
+    if (s->__tmpl == 0 || memcmp(&mac, &s->dmac, sizeof(mac)) != 0) {
+        s->dmac = mac;
+        udp_mk_tmpl(s);
+    }
+    s->__tmpl->gen = s->w->b->neighbor.gen;
+}
+
+
 /// Connect the given w_sock, using the netmap backend. If the Ethernet MAC
 /// address of the destination (or the default router towards it) is not
-/// known, it will block trying to look it up via ARP.
+/// known, this starts resolving it without waiting; udp_tx() holds frames for
+/// the w_sock until then, and w_tx() builds its header template afterwards.
+/// w_tx() also re-checks the neighbor cache whenever its contents may have
+/// changed, so that the template follows MAC address changes.
 ///
 /// @param      s     w_sock to connect.
 ///
@@ -301,8 +343,6 @@ int backend_connect(struct w_sock * const s)
     //                                   mk_net(s->tup.sip, s->w->mask))
     //                         ? s->w->rip
     //                         : s->tup.dip;
-    s->dmac = who_has(s->w, &s->ws_raddr);
-
     // see if we need to update the sport
     uint8_t n = 200;
     while (n--) {
@@ -312,8 +352,13 @@ int backend_connect(struct w_sock * const s)
         s->ws_lport = pick_local_port();
     }
 
-    if (likely(n))
+    if (likely(n)) {
         ins_sock(s);
+        // drop any template for a previous peer
+        free(s->__tmpl);
+        s->__tmpl = 0;
+        refresh_dmac(s);
+    }
 
     return n == 0;
 }
@@ -342,13 +387,28 @@ void w_rx(struct w_sock * const s, struct w_iov_sq * const i)
 /// that an application has control over exactly when to schedule packet
 /// I/O.
 ///
+/// With w_sockopt::enable_txtime set, the w_iovs from the first one that is not
+/// due yet onwards are held back, and sent by a later w_nic_tx(). Copies of
+/// packets to neighbors whose MAC address is still being resolved are held via
+/// neighbor_hold(), and sent once the address is known.
+///
 /// @param      s     w_sock socket to transmit over.
 /// @param      o     w_iov_sq to send.
 ///
 void w_tx(struct w_sock * const s, struct w_iov_sq * const o)
 {
+    if (unlikely(w_connected(s) &&
+                 (s->__tmpl == 0 ||
+                  s->__tmpl->gen != s->w->b->neighbor.gen)))
+        refresh_dmac(s);
+
+    const uint64_t now = unlikely(s->__pace) ? w_now(CLOCK_MONOTONIC) : 0;
     struct w_iov * v;
     sq_foreach (v, o, next) {
+        if (pace_hold(s, v, now)) {
+            pace_defer(s, v);
+            break;
+        }
         const uint16_t len = v->len;
         while (unlikely(udp_tx(s, v) == false)) {
             w_nic_tx(s->w);
@@ -370,6 +430,7 @@ void w_tx(struct w_sock * const s, struct w_iov_sq * const o)
 bool w_nic_rx(struct w_engine * const w, const int64_t nsec)
 {
     struct pollfd fds = {.fd = w->b->fd, .events = POLLIN};
+    pool_reclaim(w);
 again:
     if (poll(&fds, 1, nsec < 0 ? -1 : (int)(nsec / NS_PER_MS)) == 0)
         return false;
@@ -378,16 +439,12 @@ again:
     bool rx = false;
     for (uint32_t i = 0; likely(i < w->b->nif->ni_rx_rings); i++) {
         struct netmap_ring * const r = NETMAP_RXRING(w->b->nif, i);
-        while (likely(!nm_ring_empty(r))) {
-#if 0
-            warn(DBG, "rx idx %u from ring %u slot %u", r->slot[r->cur].buf_idx,
-                 i, r->cur);
-#endif
-            // process the current slot
-            rx = eth_rx(w, &r->slot[r->cur],
-                        (uint8_t *)NETMAP_BUF(r, r->slot[r->cur].buf_idx));
-            r->head = r->cur = nm_ring_next(r, r->cur);
-        }
+        // all packets of a ring sync share its timestamp
+        w->b->rx_ts = (uint64_t)r->ts.tv_sec * NS_PER_S +
+                      (uint64_t)r->ts.tv_usec * NS_PER_US;
+        while (likely(!nm_ring_empty(r)))
+            // process the ring in bursts of slots
+            rx = eth_rx_burst(w, r) || rx;
     }
 
     if (rx == false && nsec == -1)
@@ -398,13 +455,15 @@ again:
 
 
 /// Push data placed in the TX rings via udp_tx() and similar methods out
-/// onto the link. Also move any transmitted data back into the original
-/// w_iovs.
+/// onto the link, after placing any w_iovs held back for pacing that are now
+/// due. Also move any transmitted data back into the original w_iovs.
 ///
 /// @param[in]  w     Backend engine.
 ///
 void w_nic_tx(struct w_engine * const w)
 {
+    neighbor_tick(w);
+    pace_flush(w);
     ensure(ioctl(w->b->fd, NIOCTXSYNC, 0) != -1, "cannot kick tx ring");
 
     if (unlikely(is_pipe(w)))
@@ -425,6 +484,9 @@ void w_nic_tx(struct w_engine * const w)
              likely(j != nm_ring_next(r, r->tail)); j = nm_ring_next(r, j)) {
             struct netmap_slot * const s = &r->slot[j];
             struct w_iov * const v = w->b->slot_buf[r->ringid][j];
+            if (v == 0)
+                // eth_tx_ctl() copied a frame into the slot buffer
+                continue;
 #if 0
             warn(DBG, "move idx %u from ring %u slot %u to w_iov (swap w/%u)",
                  s->buf_idx, i, j, v->idx);
@@ -456,15 +518,19 @@ void w_nic_tx(struct w_engine * const w)
 ///
 uint32_t w_rx_ready(struct w_engine * const w, struct w_sock_slist * const sl)
 {
-    // insert all sockets with pending inbound data
-    struct w_sock * s;
+    // insert all sockets that udp_deliver() queued data for, skipping those
+    // already drained by w_rx() since
+    struct w_backend * const b = w->b;
     uint32_t n = 0;
-    kh_foreach_value(&w->b->sock, s, {
+    while (!sl_empty(&b->rdy)) {
+        struct w_sock * const s = sl_first(&b->rdy);
+        sl_remove_head(&b->rdy, __rdy);
+        s->__ready = false;
         if (!sq_empty(&s->iv)) {
             sl_insert_head(sl, s, next);
             n++;
         }
-    });
+    }
     return n;
 }
 
@@ -485,6 +551,5 @@ struct w_sock * w_get_sock(struct w_engine * const w,
     struct w_socktuple tup = {.local = *local};
     if (remote)
         tup.remote = *remote;
-    const khiter_t k = kh_get(sock, &w->b->sock, &tup);
-    return unlikely(k == kh_end(&w->b->sock)) ? 0 : kh_val(&w->b->sock, k);
+    return flow_get(&w->b->flows, &tup);
 }
@@ -36,6 +36,8 @@
 void w_set_sockopt(struct w_sock * const s, const struct w_sockopt * const opt)
 {
     s->opt = *opt;
+    // there is no kernel support for pacing, so always emulate it
+    s->__pace = opt->enable_txtime;
 }
 
 
@@ -234,9 +236,16 @@ void w_rx(struct w_sock * const s, struct w_iov_sq * const i)
 void w_tx(struct w_sock * const s, struct w_iov_sq * const o)
 {
     const bool is_connected = w_connected(s);
+    const uint64_t now = unlikely(s->__pace) ? w_now(CLOCK_MONOTONIC) : 0;
 
     struct w_iov * v = sq_first(o);
     while (v) {
+        if (pace_hold(s, v, now)) {
+            // held back for pacing, w_nic_tx() sends it when due
+            pace_defer(s, v);
+            break;
+        }
+
         struct sockaddr_storage ss;
         if (is_connected == false)
             to_sockaddr((struct sockaddr *)&ss, &v->wv_addr, v->wv_port,
@@ -262,6 +271,7 @@ void w_tx(struct w_sock * const s, struct w_iov_sq * const o)
 bool w_nic_rx(struct w_engine * const w, const int64_t nsec)
 {
     struct w_backend * const b = w->b;
+    pool_reclaim(w);
     FD_ZERO(&b->fds);
     struct w_sock * s;
     sl_foreach (s, &b->socks, __next)
@@ -277,13 +287,15 @@ bool w_nic_rx(struct w_engine * const w, const int64_t nsec)
 }
 
 
-/// Push data placed in the TX rings via udp_tx() and similar methods out
-/// onto the link. Also move any transmitted data back into the original
-/// w_iovs.
+/// Send any w_iovs held back for pacing that are now due. The RIOT backend
+/// sends everything else in w_tx() already.
 ///
 /// @param[in]  w     Backend engine.
 ///
-void w_nic_tx(struct w_engine * const w) {}
+void w_nic_tx(struct w_engine * const w)
+{
+    pace_flush(w);
+}
 
 
 /// Fill a w_sock_slist with pointers to some sockets with pending inbound
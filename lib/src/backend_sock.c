@@ -40,16 +40,52 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <sys/param.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
-#ifndef NDEBUG
-#include <string.h>
+#include <warpcore/warpcore.h>
+
+#if defined(HAVE_UDP_SEGMENT) || defined(HAVE_UDP_GRO)
+#include <netinet/udp.h>
 #endif
 
-#include <warpcore/warpcore.h>
+#if defined(HAVE_MSG_ZEROCOPY) && !defined(HAVE_IO_URING)
+#include <linux/errqueue.h>
+#include <poll.h>
+#endif
+
+#ifdef HAVE_SO_TIMESTAMPING
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#endif
+
+#ifdef HAVE_SO_TXTIME
+#include <linux/net_tstamp.h>
+#endif
+
+#ifdef HAVE_REUSEPORT_CBPF
+#include <linux/filter.h>
+#endif
+
+#ifdef HAVE_MAP_HUGETLB
+#include <linux/mempolicy.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+#endif
 
 #ifndef PARTICLE
+#include <sys/mman.h>
 #include <sys/uio.h>
 #else
 #define IPV6_TCLASS IP_TOS         // unclear if this works
@@ -63,11 +99,16 @@
 #include <sanitizer/asan_interface.h>
 #endif
 
-#if defined(HAVE_KQUEUE)
+#if defined(HAVE_IO_URING)
+#include <sys/mman.h>
+#elif defined(HAVE_KQUEUE)
 #include <sys/event.h>
 #include <time.h>
 #elif defined(HAVE_EPOLL)
 #include <sys/epoll.h>
+#ifdef HAVE_EPOLL_PARAMS
+#include <sys/ioctl.h>
+#endif
 #elif !defined(PARTICLE)
 #include <poll.h>
 #endif
@@ -88,8 +129,376 @@
 #include "ifaddr.h"
 
 
+#ifdef HAVE_IO_URING
+// Number of submission queue entries; the completion queue is larger.
+#define URING_SQ_ENTRIES 1024
+
+// Number of TX messages and iovecs that can be queued until w_nic_tx(). As
+// many messages as iovecs, so that messages queued again always fit.
+#define URING_TX_MSGS 1024
+#define URING_TX_IOVS 1024
+
+// Upper bound on the number of buffers lent to the kernel for receiving.
+#define URING_RX_BUFS 4096
+
+// Provided-buffer group ID for RX.
+#define URING_BGID 0
+
+// Tags in the low bits of io_uring user_data. RX completions carry the w_sock
+// pointer (tag zero), TX completions the index of their w_uring_tx and, in the
+// high 32 bits, the w_zc sequence number of a zero-copy send.
+#define URING_TX 1
+#define URING_IGN 2
+#define URING_TAG_MASK 3
+
+static void __attribute__((nonnull)) uring_rx_post(struct w_engine * const w);
+static void __attribute__((nonnull)) uring_rx_arm(struct w_sock * const s);
+static void __attribute__((nonnull)) uring_reap(struct w_engine * const w);
+static void __attribute__((nonnull)) uring_submit(struct w_backend * const b,
+                                                  const bool wait,
+                                                  const int64_t nsec);
+static void __attribute__((nonnull)) uring_tx_flush(struct w_engine * const w);
+#endif
+
+#ifndef HAVE_IO_URING
+// Default number of datagrams per sendmmsg()/recvmmsg() call. There is a
+// tradeoff here in terms of how many messages we should try and send or
+// receive at once: too few means more system calls, too many means that the
+// engine holds on to buffers it may not need. Can be overridden via
+// w_engopt::batch.
+#define SOCK_BATCH 64
+
+#ifdef HAVE_EPOLL_PARAMS
+// Packets the kernel processes per NAPI busy-poll from epoll_wait(). Larger
+// values need CAP_NET_ADMIN.
+#define SOCK_BUSY_POLL_BUDGET 8
+#endif
+
+#ifdef HAVE_SENDMMSG
+#define tx_batch(b) ((b)->batch)
+#define tx_hdr(b, i) (&(b)->tx_msg[(i)].msg_hdr)
+#else
+#define tx_batch(b) 1
+#define tx_hdr(b, i) (&(b)->tx_msg[(i)])
+#endif
+
+#ifdef HAVE_RECVMMSG
+#define rx_batch(b) ((b)->batch)
+#define rx_hdr(b, i) (&(b)->rx_msg[(i)].msg_hdr)
+#else
+#define rx_batch(b) 1
+#define rx_hdr(b, i) (&(b)->rx_msg[(i)])
+#endif
+
+static void __attribute__((nonnull)) msgs_init(struct w_engine * const w);
+static void __attribute__((nonnull)) msgs_cleanup(struct w_engine * const w);
+#endif
+
+#ifdef HAVE_MSG_ZEROCOPY
+// Initial number of entries in a zero-copy FIFO.
+#define ZC_ENTRIES 64
+
+// How often (in ms) backend_close() or, with io_uring, backend_cleanup() checks
+// for buffers still in flight.
+#define ZC_CLOSE_TRIES 100
+
+/// Remember that the @p n w_iovs starting at @p v were sent by the next
+/// zero-copy send on @p zc, and take a reference on each.
+///
+/// @param      zc    The zero-copy state.
+/// @param      v     First w_iov of the send.
+/// @param[in]  n     Number of w_iovs in the send.
+///
+static void __attribute__((nonnull))
+zc_record(struct w_zc * const zc, const struct w_iov * v, size_t n)
+{
+    for (; n; n--, v = sq_next(v, next)) {
+        if (unlikely(zc->tail - zc->head > zc->mask)) {
+            // FIFO is full, double it
+            const uint32_t cap = (zc->mask + 1) * 2;
+            struct w_zc_ent * const ent = calloc(cap, sizeof(*ent));
+            ensure(ent, "cannot grow w_zc FIFO");
+            for (uint32_t i = 0; i <= zc->mask; i++)
+                ent[i] = zc->ent[(zc->head + i) & zc->mask];
+            free(zc->ent);
+            zc->ent = ent;
+            zc->tail -= zc->head;
+            zc->head = 0;
+            zc->mask = cap - 1;
+        }
+        zc->ent[zc->tail++ & zc->mask] =
+            (struct w_zc_ent){.seq = zc->seq, .idx = v->idx};
+        zc_hold(v);
+    }
+    zc->seq++;
+}
+
+
+/// Mark the buffers of zero-copy sends @p lo to @p hi (inclusive) on @p zc as
+/// released by the kernel, and return those at the head of the FIFO.
+///
+/// @param      w     Backend engine.
+/// @param      zc    The zero-copy state.
+/// @param[in]  lo    First completed send.
+/// @param[in]  hi    Last completed send.
+///
+static void __attribute__((nonnull)) zc_done(struct w_engine * const w,
+                                             struct w_zc * const zc,
+                                             const uint32_t lo,
+                                             const uint32_t hi)
+{
+    for (uint32_t i = zc->head; i != zc->tail; i++) {
+        struct w_zc_ent * const e = &zc->ent[i & zc->mask];
+        if ((int32_t)(e->seq - hi) > 0)
+            break;
+        if ((int32_t)(e->seq - lo) >= 0)
+            e->done = true;
+    }
+
+    while (zc->head != zc->tail && zc->ent[zc->head & zc->mask].done) {
+        zc_release(w, zc->ent[zc->head & zc->mask].idx);
+        zc->head++;
+    }
+}
+#endif
+
+
+#if defined(HAVE_MSG_ZEROCOPY) && !defined(HAVE_IO_URING)
+/// Enable MSG_ZEROCOPY on w_sock @p s, and set up its zero-copy state.
+///
+/// @param      s     The w_sock.
+///
+/// @return     True on success, false if the kernel refused.
+///
+static bool __attribute__((nonnull)) zc_open(struct w_sock * const s)
+{
+    if (s->__zc)
+        return true;
+
+    if (unlikely(setsockopt((int)s->fd, SOL_SOCKET, SO_ZEROCOPY, &(int){1},
+                            sizeof(int)) < 0)) {
+        warn(WRN, "cannot setsockopt SO_ZEROCOPY (%s)", strerror(errno));
+        return false;
+    }
+
+    struct w_zc * const zc = calloc(1, sizeof(*zc));
+    ensure(zc, "cannot alloc w_zc");
+    ensure((zc->ent = calloc(ZC_ENTRIES, sizeof(*zc->ent))) != 0,
+           "cannot alloc w_zc FIFO");
+    zc->mask = ZC_ENTRIES - 1;
+    zc->s = s;
+    s->__zc = zc;
+    sl_insert_head(&s->w->b->zc, zc, next);
+    return true;
+}
+
+
+/// Process the zero-copy completions queued on the error queue of a w_sock,
+/// releasing the w_iovs of all sends the kernel is done with.
+///
+/// @param      w     Backend engine.
+/// @param      zc    The zero-copy state of the w_sock.
+///
+static void __attribute__((nonnull))
+zc_reap(struct w_engine * const w, struct w_zc * const zc)
+{
+    while (zc->head != zc->tail) {
+        __extension__ uint8_t ctrl[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                                              sizeof(struct sockaddr_in6))];
+        struct msghdr msg = {.msg_control = ctrl,
+                             .msg_controllen = sizeof(ctrl)};
+        if (recvmsg((int)zc->s->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (unlikely(errno != EAGAIN))
+                warn(ERR, "recvmsg MSG_ERRQUEUE returned %d (%s)", errno,
+                     strerror(errno));
+            return;
+        }
+
+        for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if ((cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) &&
+                (cmsg->cmsg_level != SOL_IPV6 ||
+                 cmsg->cmsg_type != IPV6_RECVERR))
+                continue;
+            const struct sock_extended_err * const ee =
+                (const struct sock_extended_err *)(void *)CMSG_DATA(cmsg);
+            if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            // sends ee_info to ee_data (inclusive) are done
+            zc_done(w, zc, ee->ee_info, ee->ee_data);
+        }
+    }
+}
+
+
+/// Tear down the zero-copy state of w_sock @p s. Waits a little for the kernel
+/// to release buffers still in flight.
+///
+/// @param      s     The w_sock.
+///
+static void __attribute__((nonnull)) zc_close(struct w_sock * const s)
+{
+    struct w_zc * const zc = s->__zc;
+    for (int i = 0; zc->head != zc->tail && i < ZC_CLOSE_TRIES; i++) {
+        zc_reap(s->w, zc);
+        if (zc->head != zc->tail)
+            poll(&(struct pollfd){.fd = (int)s->fd}, 1, 1);
+    }
+
+    if (unlikely(zc->head != zc->tail)) {
+        warn(WRN, "%" PRIu32 " zero-copy buf%s still in flight at close",
+             zc->tail - zc->head, plural(zc->tail - zc->head));
+        for (; zc->head != zc->tail; zc->head++)
+            zc_release(s->w, zc->ent[zc->head & zc->mask].idx);
+    }
+
+    sl_remove(&s->w->b->zc, zc, w_zc, next);
+    free(zc->ent);
+    free(zc);
+    s->__zc = 0;
+}
+#endif
+
+
+#ifdef SOCK_DEMUX
+#define demuxed(s) ((s)->__ks != 0)
+
+// Events for shared kernel sockets carry the w_ksock instead of the w_sock.
+#define ev_data(s) ((s)->__ks ? (void *)(s)->__ks : (void *)(s))
+
+static void __attribute__((nonnull)) ins_sock(struct w_sock * const s)
+{
+    const bool ret = flow_ins(&s->w->b->flows, s);
+    assure(ret, "inserted");
+}
+
+
+static void __attribute__((nonnull)) rem_sock(struct w_sock * const s)
+{
+    // s may share its four-tuple with a w_sock that was bound first
+    flow_rem(&s->w->b->flows, s);
+}
+
+
+/// Get the socket bound to the given four-tuple <source IP, source port,
+/// destination IP, destination port>. Only used in w_engopt::demux mode.
+///
+/// @param      w       Backend engine.
+/// @param[in]  local   The local IP address and port.
+/// @param[in]  remote  The remote IP address and port.
+///
+/// @return     The w_sock bound to the given four-tuple.
+///
+struct w_sock * w_get_sock(struct w_engine * const w,
+                           const struct w_sockaddr * const local,
+                           const struct w_sockaddr * const remote)
+{
+    struct w_socktuple tup = {.local = *local};
+    if (remote)
+        tup.remote = *remote;
+    return flow_get(&w->b->flows, &tup);
+}
+
+
+/// Find the kernel socket that w_sock @p s can share. If @p s is bound to port
+/// zero, that is the most recently opened kernel socket with an ephemeral port
+/// on the local address of @p s.
+///
+/// @param[in]  s     The w_sock to bind.
+///
+/// @return     The w_ksock to share, or zero.
+///
+static struct w_ksock * __attribute__((nonnull))
+ksock_find(const struct w_sock * const s)
+{
+    struct w_ksock * ks;
+    sl_foreach (ks, &s->w->b->ksocks, next)
+        if (s->ws_lport ? w_sockaddr_cmp(&ks->local, &s->ws_loc)
+                        : ks->eph && w_addr_cmp(&ks->local.addr, &s->ws_laddr))
+            return ks;
+    return 0;
+}
+
+
+/// Let w_sock @p s use kernel socket @p ks. UDP zero checksums are the only
+/// option that can't be chosen per w_sock, so @p s takes the one of @p ks.
+/// ECN and departure times are set per message; see w_set_sockopt().
+///
+/// @param      s     The w_sock.
+/// @param      ks    The w_ksock to share.
+///
+static void __attribute__((nonnull))
+ksock_attach(struct w_sock * const s, struct w_ksock * const ks)
+{
+    s->__ks = ks;
+    ks->refs++;
+    s->fd = ks->fd;
+    s->ws_lport = ks->local.port;
+    s->opt.enable_udp_zero_checksums = ks->opt.enable_udp_zero_checksums;
+}
+
+
+/// Make the kernel socket just opened for w_sock @p s shareable.
+///
+/// @param      s     The w_sock.
+/// @param[in]  eph   Whether the kernel socket is bound to an ephemeral port.
+///
+static void __attribute__((nonnull))
+ksock_new(struct w_sock * const s, const bool eph)
+{
+    struct w_ksock * const ks = calloc(1, sizeof(*ks));
+    ensure(ks, "cannot alloc w_ksock");
+    ks->local = s->ws_loc;
+    ks->fd = s->fd;
+    ks->eph = eph;
+    sl_insert_head(&s->w->b->ksocks, ks, next);
+    ksock_attach(s, ks);
+}
+
+
+/// Stop w_sock @p s from using its kernel socket.
+///
+/// @param      s     The w_sock.
+///
+/// @return     True if @p s was the last user, and the kernel socket should be
+///             closed.
+///
+static bool __attribute__((nonnull)) ksock_detach(struct w_sock * const s)
+{
+    struct w_ksock * const ks = s->__ks;
+    s->__ks = 0;
+    if (--ks->refs)
+        return false;
+    sl_remove(&s->w->b->ksocks, ks, w_ksock, next);
+    free(ks);
+    return true;
+}
+
+// Whether SO_TXTIME is already on for the shared kernel socket of w_sock s, and
+// whether it needs emulating there.
+#define ksock_txtime(s) ((s)->__ks && (s)->__ks->opt.enable_txtime)
+#define ksock_pace(s) ((s)->__ks->pace)
+
+// Whether other w_socks also use the kernel socket of w_sock s.
+#define ksock_shared(s) ((s)->__ks && (s)->__ks->refs > 1)
+#else
+#define demuxed(s) false
+#define ev_data(s) (s)
+#define ksock_txtime(s) false
+#define ksock_pace(s) false
+#define ksock_shared(s) false
+#endif
+
+
 /// Set the socket options.
 ///
+/// In w_engopt::demux mode, changing an option must not affect the other
+/// w_socks sharing the kernel socket of @p s. ECN is hence set per message by
+/// w_tx(), and SO_TXTIME is only ever turned on, with w_tx() only passing
+/// departure times for w_socks that enable it. UDP zero checksums can only
+/// change while @p s is the only user of its kernel socket.
+///
 /// @param      s     The w_sock to change options for.
 /// @param[in]  opt   Socket options for this socket.
 ///
@@ -97,135 +506,702 @@ void w_set_sockopt(struct w_sock * const s, const struct w_sockopt * const opt)
 {
     if (s->ws_af == AF_INET &&
         s->opt.enable_udp_zero_checksums != opt->enable_udp_zero_checksums) {
-        s->opt.enable_udp_zero_checksums = opt->enable_udp_zero_checksums;
+        if (unlikely(ksock_shared(s)))
+            // this would change the other w_socks of the kernel socket, too
+            warn(NTE, "cannot change UDP zero checksums of shared socket");
+        else {
+            s->opt.enable_udp_zero_checksums = opt->enable_udp_zero_checksums;
 #if defined(__linux__)
-        ensure(setsockopt((int)s->fd, SOL_SOCKET, SO_NO_CHECK,
-                          &(int){s->opt.enable_udp_zero_checksums},
-                          sizeof(int)) >= 0,
-               "cannot setsockopt SO_NO_CHECK");
+            ensure(setsockopt((int)s->fd, SOL_SOCKET, SO_NO_CHECK,
+                              &(int){s->opt.enable_udp_zero_checksums},
+                              sizeof(int)) >= 0,
+                   "cannot setsockopt SO_NO_CHECK");
 #elif defined(__APPLE__)
-        ensure(setsockopt((int)s->fd, IPPROTO_UDP, UDP_NOCKSUM,
-                          &(int){s->opt.enable_udp_zero_checksums},
-                          sizeof(int)) >= 0,
-               "cannot setsockopt UDP_NOCKSUM");
+            ensure(setsockopt((int)s->fd, IPPROTO_UDP, UDP_NOCKSUM,
+                              &(int){s->opt.enable_udp_zero_checksums},
+                              sizeof(int)) >= 0,
+                   "cannot setsockopt UDP_NOCKSUM");
 #endif
+        }
     }
 
     if (s->opt.enable_ecn != opt->enable_ecn) {
         s->opt.enable_ecn = opt->enable_ecn;
-        const int ret = setsockopt(
-            (int)s->fd, s->ws_af == AF_INET ? IPPROTO_IP : IPPROTO_IPV6,
-            s->ws_af == AF_INET ? IP_TOS : IPV6_TCLASS,
-            // cppcheck-suppress internalAstError
-            &(int){s->opt.enable_ecn ? ECN_ECT0 : ECN_NOT}, sizeof(int));
-        if (unlikely(ret < 0))
-            warn(WRN, "cannot setsockopt IP_TOS/IPV6_TCLASS; running on WSL?");
+        // w_tx() marks the messages of a demultiplexed w_sock instead
+        if (demuxed(s) == false) {
+            const int ret = setsockopt(
+                (int)s->fd, s->ws_af == AF_INET ? IPPROTO_IP : IPPROTO_IPV6,
+                s->ws_af == AF_INET ? IP_TOS : IPV6_TCLASS,
+                // cppcheck-suppress internalAstError
+                &(int){s->opt.enable_ecn ? ECN_ECT0 : ECN_NOT}, sizeof(int));
+            if (unlikely(ret < 0))
+                warn(WRN,
+                     "cannot setsockopt IP_TOS/IPV6_TCLASS; running on WSL?");
+        }
+    }
+
+    // this is applied per send by w_tx()
+    s->opt.enable_udp_gso = opt->enable_udp_gso;
+
+#ifdef HAVE_IO_URING
+    // multishot receives land directly in w_iov buffers, which are too small
+    // for coalesced datagrams
+    if (unlikely(opt->enable_udp_gro))
+        warn(NTE, "UDP GRO not supported by io_uring backend variant");
+#elif defined(HAVE_UDP_GRO)
+    if (unlikely(opt->enable_udp_gro && demuxed(s)))
+        // coalesced datagrams would need splitting before demultiplexing
+        warn(NTE, "UDP GRO not supported in demux mode");
+    else if (s->opt.enable_udp_gro != opt->enable_udp_gro) {
+        s->opt.enable_udp_gro = opt->enable_udp_gro;
+        const int ret = setsockopt((int)s->fd, SOL_UDP, UDP_GRO,
+                                   &(int){s->opt.enable_udp_gro}, sizeof(int));
+        if (unlikely(ret < 0)) {
+            warn(WRN, "cannot setsockopt UDP_GRO (%s)", strerror(errno));
+            s->opt.enable_udp_gro = false;
+        }
+    }
+#endif
+
+    if (s->opt.enable_txtime != opt->enable_txtime) {
+        s->opt.enable_txtime = opt->enable_txtime;
+#ifdef HAVE_SO_TXTIME
+        if (ksock_txtime(s))
+            // SO_TXTIME is on for the shared kernel socket already
+            s->__pace = s->opt.enable_txtime && ksock_pace(s);
+        else {
+            // fq expects departure times on the monotonic clock
+            s->__pace =
+                s->opt.enable_txtime &&
+                setsockopt((int)s->fd, SOL_SOCKET, SO_TXTIME,
+                           &(struct sock_txtime){.clockid = CLOCK_MONOTONIC},
+                           sizeof(struct sock_txtime)) < 0;
+            if (unlikely(s->__pace))
+                warn(NTE, "cannot setsockopt SO_TXTIME (%s), emulating",
+                     strerror(errno));
+        }
+#else
+        s->__pace = s->opt.enable_txtime;
+#endif
     }
 
+#if defined(HAVE_IO_URING)
+    // this is applied per send by w_tx()
+    s->opt.enable_zero_copy = opt->enable_zero_copy;
+#elif defined(HAVE_MSG_ZEROCOPY)
+    // the kernel numbers zero-copy sends per socket, so they can't be shared
+    s->opt.enable_zero_copy =
+        opt->enable_zero_copy && demuxed(s) == false && zc_open(s);
+#endif
+
     s->opt.user_1 = opt->user_1;
     s->opt.user_2 = opt->user_2;
     s->opt.user_3 = opt->user_3;
+
+#ifdef SOCK_DEMUX
+    if (s->__ks) {
+        // only record what was applied to the kernel socket itself
+        s->__ks->opt.enable_udp_zero_checksums =
+            s->opt.enable_udp_zero_checksums;
+        if (s->opt.enable_txtime && s->__ks->opt.enable_txtime == false) {
+            s->__ks->opt.enable_txtime = true;
+            s->__ks->pace = s->__pace;
+        }
+    }
+#endif
 }
 
 
-/// Initialize the warpcore socket backend for engine @p w. Sets up the extra
-/// buffers.
+#ifdef HAVE_SO_TIMESTAMPING
+/// Get or set the hardware timestamping configuration of the NIC of engine
+/// @p w.
 ///
-/// @param      w      Backend engine.
-/// @param[in]  nbufs  Number of packet buffers to allocate.
+/// @param      w     Backend engine.
+/// @param[in]  req   SIOCGHWTSTAMP or SIOCSHWTSTAMP.
+/// @param      cfg   The configuration to get or set.
 ///
-void backend_init(struct w_engine * const w, const uint32_t nbufs)
+/// @return     True on success, false otherwise.
+///
+static bool __attribute__((nonnull))
+hwts_ioctl(const struct w_engine * const w,
+           const unsigned long req,
+           struct hwtstamp_config * const cfg)
 {
-    backend_addr_config(w); // do this first so w->mtu is set for max_buf_len
-#ifndef PARTICLE
-    // some interfaces can have huge MTUs, so cap to something more sensible
-    w->mtu = MIN(w->mtu, (uint16_t)getpagesize() / 2);
-#endif
-
-    ensure((w->mem = calloc(nbufs, max_buf_len(w))) != 0,
-           "cannot alloc %" PRIu32 " * %u buf mem", nbufs, max_buf_len(w));
-    ensure((w->bufs = calloc(nbufs, sizeof(*w->bufs))) != 0,
-           "cannot alloc bufs");
-    w->backend_name = "socket";
-
-    for (uint32_t i = 0; i < nbufs; i++) {
-        init_iov(w, &w->bufs[i], i);
-        sq_insert_head(&w->iov, &w->bufs[i], next);
-        ASAN_POISON_MEMORY_REGION(w->bufs[i].buf, max_buf_len(w));
-    }
+    const int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (unlikely(fd < 0))
+        return false;
+    struct ifreq ifr = {.ifr_data = (void *)cfg};
+    strncpy(ifr.ifr_name, w->ifname, sizeof(ifr.ifr_name) - 1);
+    const bool ok = ioctl(fd, req, &ifr) == 0;
+    if (unlikely(ok == false) && req == SIOCSHWTSTAMP)
+        warn(DBG, "cannot configure hardware timestamps on %s (%s)", w->ifname,
+             strerror(errno));
+    close(fd);
+    return ok;
+}
 
-#if defined(HAVE_KQUEUE)
-    w->b->kq = kqueue();
-    w->backend_variant = "kqueue/" SENDFUNC "/" RECVFUNC;
-#elif defined(HAVE_EPOLL)
-    w->b->ep = epoll_create1(0);
-    w->backend_variant = "epoll/" SENDFUNC "/" RECVFUNC;
-#else
-    w->backend_variant = "poll/" SENDFUNC "/" RECVFUNC;
-#endif
 
-    warn(DBG, "%s backend using %s", w->backend_name, w->backend_variant);
+/// With w_engopt::hw_timestamps, ask the NIC of engine @p w to timestamp all
+/// received packets, unless it already does (e.g., for PTP). The previous
+/// configuration is saved for hwts_cleanup(). This needs CAP_NET_ADMIN and
+/// driver support; without either, there are no NIC timestamps.
+///
+/// @param      w     Backend engine.
+///
+static void __attribute__((nonnull)) hwts_init(struct w_engine * const w)
+{
+    if (w->opt.hw_timestamps == false || w->is_loopback)
+        return;
+
+    struct hwtstamp_config cfg = {.tx_type = HWTSTAMP_TX_OFF,
+                                  .rx_filter = HWTSTAMP_FILTER_NONE};
+    hwts_ioctl(w, SIOCGHWTSTAMP, &cfg);
+    if (cfg.rx_filter != HWTSTAMP_FILTER_NONE)
+        return;
+
+    w->b->hwts_tx = cfg.tx_type;
+    w->b->hwts_filter = cfg.rx_filter;
+    cfg.rx_filter = HWTSTAMP_FILTER_ALL;
+    w->b->hwts_set = hwts_ioctl(w, SIOCSHWTSTAMP, &cfg);
 }
 
 
-/// Shut a warpcore socket engine down cleanly. Does nothing, at the moment.
+/// Restore the NIC timestamping configuration that hwts_init() changed.
 ///
 /// @param      w     Backend engine.
 ///
-void backend_cleanup(struct w_engine * const w)
+static void __attribute__((nonnull)) hwts_cleanup(struct w_engine * const w)
 {
-#if !defined(HAVE_KQUEUE) && !defined(HAVE_EPOLL)
-    free(w->b->fds);
-    w->b->fds = 0;
-    struct w_sock * s;
-    sl_foreach (s, &w->b->socks, __next)
-        w_close(s);
+    if (w->b->hwts_set == false)
+        return;
+    hwts_ioctl(w, SIOCSHWTSTAMP,
+               &(struct hwtstamp_config){.tx_type = w->b->hwts_tx,
+                                         .rx_filter = w->b->hwts_filter});
+    w->b->hwts_set = false;
+}
 #endif
-    free(w->mem);
-    free(w->bufs);
-    w->b->n = 0;
+
+
+#ifdef HAVE_MAP_HUGETLB
+/// Return the NUMA node of the interface of engine @p w, or, for virtual
+/// interfaces, that of the CPU the calling thread runs on.
+///
+/// @param[in]  w     Backend engine.
+///
+/// @return     NUMA node, or -1 if unknown.
+///
+static int numa_node(const struct w_engine * const w)
+{
+    char path[64 + sizeof(w->ifname)];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+             w->ifname);
+    int node = -1;
+    FILE * const f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%d", &node) != 1)
+            node = -1;
+        fclose(f);
+    }
+
+    unsigned int cpu;
+    unsigned int cpu_node;
+    if (node < 0 && syscall(SYS_getcpu, &cpu, &cpu_node, 0) == 0)
+        node = (int)cpu_node;
+    return node;
 }
 
 
-/// Bind a warpcore socket-backend socket. Calls the underlying Socket API.
+/// Map zeroed packet buffer memory for engine @p w from huge pages, trying 1
+/// GiB and then 2 MiB pages from the hugetlbfs pool, and then transparent huge
+/// pages. The memory prefers the NUMA node given by numa_node(), and is
+/// prefaulted, so the hot path takes no page faults on it.
 ///
-/// @param      s     The w_sock to bind.
-/// @param[in]  opt   Socket options for this socket. Can be zero.
+/// @param[in]  w     Backend engine.
+/// @param      len   Length to map; rounded up to the huge page size.
 ///
-/// @return     Zero on success, @p errno otherwise.
+/// @return     Pointer to the memory, or zero on failure.
 ///
-int backend_bind(struct w_sock * const s, const struct w_sockopt * const opt)
+static void * huge_alloc(const struct w_engine * const w, size_t * const len)
 {
-    s->fd = socket(s->ws_af, SOCK_DGRAM | SOCK_CLOEXEC, 0);
-    if (unlikely(s->fd < 0))
-        return errno;
+    static const struct {
+        int flags;
+        size_t size;
+        const char * name;
+    } pg[] = {{MAP_HUGETLB | MAP_HUGE_1GB, 1UL << 30, "1 GiB"},
+              {MAP_HUGETLB | MAP_HUGE_2MB, 2UL << 20, "2 MiB"},
+              {0, 2UL << 20, "transparent huge"}};
+
+    for (size_t i = 0; i < sizeof(pg) / sizeof(pg[0]); i++) {
+        if (pg[i].size == 1UL << 30 && *len < pg[i].size)
+            // don't waste most of a 1 GiB page on a small pool
+            continue;
+
+        // transparent huge pages need an aligned region, so map one extra
+        const size_t l = roundup(*len, pg[i].size);
+        const size_t extra = pg[i].flags ? 0 : pg[i].size;
+        uint8_t * mem = mmap(0, l + extra, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | pg[i].flags, -1, 0);
+        if (mem == MAP_FAILED) {
+            warn(DBG, "cannot mmap %zu bytes of %s pages (%s)", l, pg[i].name,
+                 strerror(errno));
+            continue;
+        }
+        if (extra) {
+            uint8_t * const a = (uint8_t *)roundup((uintptr_t)mem, extra);
+            if (a > mem)
+                munmap(mem, (size_t)(a - mem));
+            if (a < mem + extra)
+                munmap(a + l, (size_t)(mem + extra - a));
+            mem = a;
+            if (madvise(mem, l, MADV_HUGEPAGE) != 0)
+                warn(WRN, "cannot madvise MADV_HUGEPAGE (%s)", strerror(errno));
+        }
 
-    struct sockaddr_storage ss;
-    to_sockaddr((struct sockaddr *)&ss, &s->ws_laddr, s->ws_lport, s->ws_scope);
-    if (unlikely(bind((int)s->fd, (struct sockaddr *)&ss, sa_len(s->ws_af)) !=
-                 0))
-        return errno;
+        const int node = numa_node(w);
+        unsigned long mask[16] = {0}; // up to 1024 nodes
+        const size_t bits = sizeof(mask[0]) * CHAR_BIT;
+        if (node >= 0 && (size_t)node < sizeof(mask) * CHAR_BIT) {
+            mask[(size_t)node / bits] = 1UL << ((size_t)node % bits);
+            if (syscall(SYS_mbind, mem, l, MPOL_PREFERRED, mask,
+                        sizeof(mask) * CHAR_BIT + 1, 0) != 0)
+                warn(WRN, "cannot mbind to NUMA node %d (%s)", node,
+                     strerror(errno));
+        }
 
-    // enable always receiving TOS information
-    ensure(setsockopt((int)s->fd,
-                      s->ws_af == AF_INET ? IPPROTO_IP : IPPROTO_IPV6,
-                      s->ws_af == AF_INET ? IP_RECVTOS : IPV6_RECVTCLASS,
-                      &(int){1}, sizeof(int)) >= 0,
-           "cannot setsockopt IP_RECVTOS/IPV6_RECVTCLASS");
+        // touch every page, so it is allocated (on the preferred node) now
+        for (size_t off = 0; off < l; off += (size_t)getpagesize())
+            mem[off] = 0;
 
-    // enable always receiving TTL information
-#ifdef __APPLE__
-    ensure(setsockopt((int)s->fd,
-                      s->ws_af == AF_INET ? IPPROTO_IP : IPPROTO_IPV6,
-                      IP_RECVTTL, &(int){1}, sizeof(int)) >= 0,
-           "cannot setsockopt IP_RECVTTL");
-#elif !defined(PARTICLE)
-    ensure(setsockopt((int)s->fd, IPPROTO_IP, IP_RECVTTL, &(int){1},
-                      sizeof(int)) >= 0,
-           "cannot setsockopt IP_RECVTTL");
+        warn(INF, "%zu MiB of buf mem on %s pages, NUMA node %d", l >> 20,
+             pg[i].name, node);
+        *len = l;
+        return mem;
+    }
+    return 0;
+}
 #endif
 
-#if !defined(__APPLE__) && !defined(PARTICLE)
+
+#ifdef POOL_ELASTIC
+#ifdef __linux__
+#define MADV_IDLE MADV_DONTNEED
+#else
+#define MADV_IDLE MADV_FREE
+#endif
+
+
+/// Add the next chunk of up to POOL_CHUNK buffers of the given size class to
+/// the pool of engine @p w, unless all buffers of that class reserved by
+/// backend_init() are in use already. Called by pool_alloc() when the free
+/// list of the class runs dry.
+///
+/// @param      w      Backend engine.
+/// @param[in]  small  Whether to grow the small buffers.
+///
+/// @return     True if the pool grew, false otherwise.
+///
+bool pool_grow(struct w_engine * const w, const bool small)
+{
+    struct w_backend * const b = w->b;
+    uint32_t * const len = small ? &b->small_len : &b->pool_len;
+    const uint32_t max = small ? b->small_max : b->pool_max;
+    if (unlikely(*len == max))
+        return false;
+
+    // insert in reverse, so the chunk is handed out in index order
+    struct w_iov_sq * const q = small ? &b->small : &w->iov;
+    const uint32_t first = (small ? b->small_idx : 0) + *len;
+    const uint32_t n = MIN(POOL_CHUNK, max - *len);
+    for (uint32_t i = first + n; i-- > first;) {
+        init_iov(w, &w->bufs[i], i);
+        sq_insert_head(q, &w->bufs[i], next);
+        ASAN_POISON_MEMORY_REGION(w->bufs[i].buf, w->bufs[i].len);
+    }
+    b->pool_free[first / POOL_CHUNK] = (uint16_t)n;
+    *len += n;
+    warn(DBG, "grew %s pool to %" PRIu32 " of %" PRIu32 " bufs",
+         small ? "small" : "MTU", *len, max);
+    return true;
+}
+
+
+/// Return the memory of chunk @p chunk of the pool of engine @p w to the OS,
+/// if more than w_engopt::pool_hiwat buffers are free. Called by pool_put()
+/// when all buffers of the chunk are free. The chunk stays in the pool, and
+/// its buffers are faulted back in (zeroed) when they are used again. Memory
+/// on huge pages or locked by w_engopt::mlock is never returned.
+///
+/// @param      w      Backend engine.
+/// @param[in]  chunk  Index of the idle chunk.
+///
+void pool_idle(struct w_engine * const w, const uint32_t chunk)
+{
+    struct w_backend * const b = w->b;
+    const bool small = chunk * POOL_CHUNK >= b->small_idx;
+    if (sq_len(small ? &b->small : &w->iov) <= w->opt.pool_hiwat ||
+        (b->mem_huge && small == false) || w->opt.mlock)
+        return;
+
+    // only whole pages can be returned
+    const uintptr_t mem =
+        small ? (uintptr_t)b->small_mem : (uintptr_t)w->mem;
+    const uint32_t c = small ? chunk - b->small_idx / POOL_CHUNK : chunk;
+    const uintptr_t len =
+        POOL_CHUNK * (small ? SMALL_BUF_LEN : buf_stride(w));
+    const uintptr_t pg = (uintptr_t)getpagesize();
+    const uintptr_t beg = roundup(mem + c * len, pg);
+    const uintptr_t end = (mem + (c + 1) * len) & ~(pg - 1);
+    if (likely(beg < end) &&
+        unlikely(madvise((void *)beg, end - beg, MADV_IDLE) != 0))
+        warn(WRN, "cannot madvise idle buf mem (%s)", strerror(errno));
+}
+#endif
+
+
+/// Initialize the warpcore socket backend for engine @p w. Sets up the extra
+/// buffers, on huge pages and locked into memory if w_engopt::hugepages and
+/// w_engopt::mlock say so.
+///
+/// @param      w      Backend engine.
+/// @param[in]  nbufs  Number of packet buffers to allocate.
+///
+void backend_init(struct w_engine * const w, const uint32_t nbufs)
+{
+    backend_addr_config(w); // do this first so w->mtu is set for max_buf_len
+#ifndef PARTICLE
+    // some interfaces can have huge MTUs, so cap to something more sensible
+    w->mtu = MIN(w->mtu, (uint16_t)getpagesize() / 2);
+#endif
+
+    struct w_backend * const b = w->b;
+    b->mem_len = (size_t)nbufs * buf_stride(w);
+#ifdef HAVE_MAP_HUGETLB
+    if (w->opt.hugepages) {
+        size_t len = b->mem_len;
+        b->mem_huge = (w->mem = huge_alloc(w, &len)) != 0;
+        if (b->mem_huge)
+            b->mem_len = len;
+        else
+            warn(WRN, "cannot alloc huge pages, using regular ones");
+    }
+#else
+    if (w->opt.hugepages)
+        warn(WRN, "huge pages not supported, using regular ones");
+#endif
+#ifdef POOL_ELASTIC
+    if (w->mem == 0) {
+        // only reserve address space, pool_grow() touches it as needed
+        w->mem = mmap(0, b->mem_len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        ensure(w->mem != MAP_FAILED, "cannot mmap %" PRIu32 " * %zu buf mem",
+               nbufs, buf_stride(w));
+    }
+    b->pool_max = nbufs;
+
+    // small buffers, if any, get the indices after the chunks of MTU ones
+    sq_init(&b->small);
+    b->small_idx = roundup(nbufs, POOL_CHUNK);
+    if (w->opt.small_bufs) {
+        b->small_max = nbufs;
+        b->small_mem = mmap(0, (size_t)nbufs * SMALL_BUF_LEN,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        ensure(b->small_mem != MAP_FAILED, "cannot mmap small buf mem");
+    }
+    const uint32_t nidx = b->small_idx + b->small_max;
+
+    w->bufs = mmap(0, nidx * sizeof(*w->bufs), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    ensure(w->bufs != MAP_FAILED, "cannot mmap bufs");
+    ensure((b->pool_free = calloc((nidx + POOL_CHUNK - 1) / POOL_CHUNK,
+                                  sizeof(*b->pool_free))) != 0,
+           "cannot alloc pool_free");
+    if (w->opt.pool_hiwat == 0)
+        w->opt.pool_hiwat = POOL_HIWAT;
+#else
+    ensure((w->mem = calloc(nbufs, buf_stride(w))) != 0,
+           "cannot alloc %" PRIu32 " * %zu buf mem", nbufs, buf_stride(w));
+    ensure((w->bufs = calloc(nbufs, sizeof(*w->bufs))) != 0,
+           "cannot alloc bufs");
+    for (uint32_t i = 0; i < nbufs; i++) {
+        init_iov(w, &w->bufs[i], i);
+        sq_insert_head(&w->iov, &w->bufs[i], next);
+        ASAN_POISON_MEMORY_REGION(w->bufs[i].buf, max_buf_len(w));
+    }
+#endif
+#ifndef PARTICLE
+    if (w->opt.mlock && mlock(w->mem, b->mem_len) != 0) {
+        warn(WRN, "cannot mlock %zu bytes of buf mem (%s)", b->mem_len,
+             strerror(errno));
+        w->opt.mlock = false;
+    }
+#endif
+#ifdef POOL_ELASTIC
+    if (w->opt.mlock && b->small_max &&
+        mlock(b->small_mem, (size_t)b->small_max * SMALL_BUF_LEN) != 0)
+        warn(WRN, "cannot mlock small buf mem (%s)", strerror(errno));
+#endif
+    w->backend_name = "socket";
+#ifdef HAVE_MSG_ZEROCOPY
+    // indexed by w_iov::idx, which includes the small buffers
+    ensure((w->b->zc_state = calloc(b->small_idx + b->small_max,
+                                    sizeof(*w->b->zc_state))) != 0,
+           "cannot alloc zc_state");
+#endif
+
+#ifndef HAVE_IO_URING
+    msgs_init(w);
+#endif
+#ifdef HAVE_SO_TIMESTAMPING
+    hwts_init(w);
+#endif
+
+#if defined(HAVE_IO_URING)
+    uring_init(&b->ring, URING_SQ_ENTRIES);
+
+    // lend up to half of the buffers to the kernel for receiving
+    uint32_t n = 1;
+    while (n * 2 <= MIN(nbufs / 2, URING_RX_BUFS))
+        n *= 2;
+    b->rx_mask = n - 1;
+    b->rx_br = mmap(0, n * sizeof(*b->rx_br->bufs), PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    ensure(b->rx_br != MAP_FAILED, "cannot mmap io_uring buffer ring");
+    ensure((b->rx_iov = calloc(n, sizeof(*b->rx_iov))) != 0,
+           "cannot alloc rx_iov");
+    const int err = uring_register(
+        &b->ring, IORING_REGISTER_PBUF_RING,
+        &(struct io_uring_buf_reg){.ring_addr = (uintptr_t)b->rx_br,
+                                   .ring_entries = n,
+                                   .bgid = URING_BGID},
+        1);
+    ensure(err == 0, "cannot register io_uring buffer ring (%s)",
+           strerror(err));
+    uring_rx_post(w);
+
+    // the kernel places source address and cmsgs in front of the payload
+    b->rx_msg = (struct msghdr){.msg_namelen = URING_RX_NAME,
+                                .msg_controllen = URING_RX_CTRL};
+
+    ensure((b->tx = calloc(URING_TX_MSGS, sizeof(*b->tx))) != 0,
+           "cannot alloc tx");
+    ensure((b->tx_iov = calloc(URING_TX_IOVS, sizeof(*b->tx_iov))) != 0,
+           "cannot alloc tx_iov");
+    ensure((b->tx_retry = calloc(URING_TX_MSGS, sizeof(*b->tx_retry))) != 0,
+           "cannot alloc tx_retry");
+#ifdef HAVE_MSG_ZEROCOPY
+    ensure((b->zc.ent = calloc(ZC_ENTRIES, sizeof(*b->zc.ent))) != 0,
+           "cannot alloc w_zc FIFO");
+    b->zc.mask = ZC_ENTRIES - 1;
+#endif
+    w->backend_variant = "io_uring";
+#elif defined(HAVE_KQUEUE)
+    w->b->kq = kqueue();
+    w->backend_variant = "kqueue/" SENDFUNC "/" RECVFUNC;
+#elif defined(HAVE_EPOLL)
+    w->b->ep = epoll_create1(0);
+#ifdef HAVE_EPOLL_PARAMS
+    // let epoll_wait() busy-poll the NAPI contexts of our sockets
+    if (w->opt.busy_poll &&
+        unlikely(ioctl(w->b->ep, EPIOCSPARAMS,
+                       &(struct epoll_params){
+                           .busy_poll_usecs = w->opt.busy_poll,
+                           .busy_poll_budget = SOCK_BUSY_POLL_BUDGET,
+                           .prefer_busy_poll = 1}) < 0))
+        warn(WRN, "cannot ioctl EPIOCSPARAMS (%s)", strerror(errno));
+#endif
+#ifdef HAVE_EPOLL_PWAIT2
+    // epoll_pwait2() takes a timespec, so sub-millisecond timeouts work, but
+    // older kernels lack it
+    w->b->pwait2 = epoll_pwait2(w->b->ep, w->b->ev, 1, &(struct timespec){0},
+                                0) != -1 ||
+                   errno != ENOSYS;
+#endif
+    w->backend_variant = "epoll/" SENDFUNC "/" RECVFUNC;
+#else
+    w->backend_variant = "poll/" SENDFUNC "/" RECVFUNC;
+#endif
+
+    warn(DBG, "%s backend using %s", w->backend_name, w->backend_variant);
+}
+
+
+/// Shut a warpcore socket engine down cleanly. Does nothing, at the moment.
+///
+/// @param      w     Backend engine.
+///
+void backend_cleanup(struct w_engine * const w)
+{
+#if defined(HAVE_IO_URING)
+    struct w_backend * const b = w->b;
+    while (!sl_empty(&b->socks))
+        w_close(sl_first(&b->socks));
+#ifdef HAVE_MSG_ZEROCOPY
+    // wait a little for the kernel to release buffers still in flight
+    for (int i = 0; b->zc.head != b->zc.tail && i < ZC_CLOSE_TRIES; i++) {
+        uring_submit(b, true, NS_PER_MS);
+        uring_reap(w);
+    }
+    if (unlikely(b->zc.head != b->zc.tail)) {
+        warn(WRN, "%" PRIu32 " zero-copy buf%s still in flight at cleanup",
+             b->zc.tail - b->zc.head, plural(b->zc.tail - b->zc.head));
+        for (; b->zc.head != b->zc.tail; b->zc.head++)
+            zc_release(w, b->zc.ent[b->zc.head & b->zc.mask].idx);
+    }
+    free(b->zc.ent);
+#endif
+    uring_register(&b->ring, IORING_UNREGISTER_PBUF_RING,
+                   &(struct io_uring_buf_reg){.bgid = URING_BGID}, 1);
+    uring_cleanup(&b->ring);
+    munmap(b->rx_br, (b->rx_mask + 1) * sizeof(*b->rx_br->bufs));
+    free(b->rx_iov);
+    free(b->tx);
+    free(b->tx_iov);
+    free(b->tx_retry);
+#elif !defined(HAVE_KQUEUE) && !defined(HAVE_EPOLL)
+    free(w->b->fds);
+    w->b->fds = 0;
+    struct w_sock * s;
+    sl_foreach (s, &w->b->socks, __next)
+        w_close(s);
+#endif
+#ifndef HAVE_IO_URING
+    msgs_cleanup(w);
+#endif
+#ifdef SOCK_DEMUX
+    flow_free(&w->b->flows);
+#endif
+#ifdef HAVE_UDP_GRO
+    free(w->b->gro_buf);
+    w->b->gro_buf = 0;
+#endif
+#ifdef HAVE_MSG_ZEROCOPY
+    free(w->b->zc_state);
+    w->b->zc_state = 0;
+#endif
+#ifdef HAVE_SO_TIMESTAMPING
+    hwts_cleanup(w);
+#endif
+#ifndef PARTICLE
+    if (w->opt.mlock)
+        munlock(w->mem, w->b->mem_len);
+#endif
+#ifdef POOL_ELASTIC
+    // the address range may be reused, so don't leave it poisoned
+    ASAN_UNPOISON_MEMORY_REGION(w->mem, w->b->mem_len);
+    munmap(w->mem, w->b->mem_len);
+    munmap(w->bufs,
+           (w->b->small_idx + w->b->small_max) * sizeof(*w->bufs));
+    if (w->b->small_max) {
+        ASAN_UNPOISON_MEMORY_REGION(w->b->small_mem,
+                                    w->b->small_max * SMALL_BUF_LEN);
+        munmap(w->b->small_mem, w->b->small_max * SMALL_BUF_LEN);
+    }
+    free(w->b->pool_free);
+#else
+    free(w->mem);
+    free(w->bufs);
+#endif
+    w->b->n = 0;
+}
+
+
+/// Open and bind a kernel socket for w_sock @p s, and register it for receive
+/// events.
+///
+/// @param      s     The w_sock to bind.
+/// @param[in]  opt   Socket options for this socket. Can be zero.
+///
+/// @return     Zero on success, @p errno otherwise.
+///
+static int __attribute__((nonnull(1)))
+sock_bind(struct w_sock * const s, const struct w_sockopt * const opt)
+{
+#ifdef SOCK_DEMUX
+    const bool eph = s->ws_lport == 0;
+#endif
+    s->fd = socket(s->ws_af, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (unlikely(s->fd < 0))
+        return errno;
+
+#ifdef SO_REUSEPORT
+    // let the sockets of sharded engines bind the same port
+    const bool reuseport = s->w->opt.shards > 1 && s->ws_lport;
+    if (reuseport && unlikely(setsockopt((int)s->fd, SOL_SOCKET, SO_REUSEPORT,
+                                         &(int){1}, sizeof(int)) < 0))
+        return errno;
+#endif
+
+    struct sockaddr_storage ss;
+    to_sockaddr((struct sockaddr *)&ss, &s->ws_laddr, s->ws_lport, s->ws_scope);
+    if (unlikely(bind((int)s->fd, (struct sockaddr *)&ss, sa_len(s->ws_af)) !=
+                 0))
+        return errno;
+
+#ifdef HAVE_REUSEPORT_CBPF
+    if (reuseport && s->w->opt.shard_by_cpu) {
+        // return the receiving CPU modulo the shards as the socket index
+        struct sock_filter code[] = {
+            {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)},
+            {BPF_ALU | BPF_MOD | BPF_K, 0, 0, s->w->opt.shards},
+            {BPF_RET | BPF_A, 0, 0, 0}};
+        const struct sock_fprog prog = {.len = sizeof(code) / sizeof(code[0]),
+                                        .filter = code};
+        if (unlikely(setsockopt((int)s->fd, SOL_SOCKET,
+                                SO_ATTACH_REUSEPORT_CBPF, &prog,
+                                sizeof(prog)) < 0))
+            warn(WRN, "cannot setsockopt SO_ATTACH_REUSEPORT_CBPF (%s)",
+                 strerror(errno));
+    }
+#endif
+
+    // enable always receiving TOS information
+    ensure(setsockopt((int)s->fd,
+                      s->ws_af == AF_INET ? IPPROTO_IP : IPPROTO_IPV6,
+                      s->ws_af == AF_INET ? IP_RECVTOS : IPV6_RECVTCLASS,
+                      &(int){1}, sizeof(int)) >= 0,
+           "cannot setsockopt IP_RECVTOS/IPV6_RECVTCLASS");
+
+    // enable always receiving TTL information
+#ifdef __APPLE__
+    ensure(setsockopt((int)s->fd,
+                      s->ws_af == AF_INET ? IPPROTO_IP : IPPROTO_IPV6,
+                      IP_RECVTTL, &(int){1}, sizeof(int)) >= 0,
+           "cannot setsockopt IP_RECVTTL");
+#elif !defined(PARTICLE)
+    ensure(setsockopt((int)s->fd, IPPROTO_IP, IP_RECVTTL, &(int){1},
+                      sizeof(int)) >= 0,
+           "cannot setsockopt IP_RECVTTL");
+#endif
+
+#ifdef HAVE_SO_TIMESTAMPING
+    // enable always receiving timestamps, from the NIC if it provides them
+    ensure(setsockopt((int)s->fd, SOL_SOCKET, SO_TIMESTAMPING,
+                      &(int){SOF_TIMESTAMPING_RX_SOFTWARE |
+                             SOF_TIMESTAMPING_SOFTWARE |
+                             SOF_TIMESTAMPING_RX_HARDWARE |
+                             SOF_TIMESTAMPING_RAW_HARDWARE},
+                      sizeof(int)) >= 0,
+           "cannot setsockopt SO_TIMESTAMPING");
+#endif
+
+#ifdef HAVE_SO_BUSY_POLL
+    // let the kernel poll the NIC for a while before sleeping on receive
+    if (s->w->opt.busy_poll) {
+        if (unlikely(setsockopt((int)s->fd, SOL_SOCKET, SO_BUSY_POLL,
+                                &(int){(int)MIN(s->w->opt.busy_poll, INT_MAX)},
+                                sizeof(int)) < 0))
+            warn(WRN, "cannot setsockopt SO_BUSY_POLL (%s)", strerror(errno));
+#ifdef SO_PREFER_BUSY_POLL
+        if (unlikely(setsockopt((int)s->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+                                &(int){1}, sizeof(int)) < 0))
+            warn(WRN, "cannot setsockopt SO_PREFER_BUSY_POLL (%s)",
+                 strerror(errno));
+#endif
+    }
+#endif
+
+#if !defined(__APPLE__) && !defined(PARTICLE)
     if (s->ws_af == AF_INET) {
         // enable set DF
         const int ret =
@@ -240,9 +1216,6 @@ int backend_bind(struct w_sock * const s, const struct w_sockopt * const opt)
     }
 #endif
 
-    if (opt)
-        w_set_sockopt(s, opt);
-
     // if we're binding to a random port, find out what it is
     if (s->ws_lport == 0) {
         socklen_t len = sizeof(ss);
@@ -251,317 +1224,1506 @@ int backend_bind(struct w_sock * const s, const struct w_sockopt * const opt)
         s->ws_lport = sa_port(&ss);
     }
 
-#if defined(HAVE_KQUEUE)
-    struct kevent ev;
-    EV_SET(&ev, s->fd, EVFILT_READ, EV_ADD, 0, 0, s);
-    ensure(kevent(s->w->b->kq, &ev, 1, 0, 0, 0) != -1, "kevent");
-#elif defined(HAVE_EPOLL)
-    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = s};
-    ensure(epoll_ctl(s->w->b->ep, EPOLL_CTL_ADD, (int)s->fd, &ev) != -1,
-           "epoll_ctl");
-#else
-    sl_insert_head(&s->w->b->socks, s, __next);
-#endif
+#ifdef SOCK_DEMUX
+    if (s->w->opt.demux)
+        ksock_new(s, eph);
+#endif
+
+    if (opt)
+        w_set_sockopt(s, opt);
+
+#if defined(HAVE_IO_URING)
+    sl_insert_head(&s->w->b->socks, s, __next);
+    uring_rx_arm(s);
+    uring_submit(s->w->b, false, 0);
+#elif defined(HAVE_KQUEUE)
+    struct kevent ev;
+    EV_SET(&ev, s->fd, EVFILT_READ, EV_ADD, 0, 0, ev_data(s));
+    ensure(kevent(s->w->b->kq, &ev, 1, 0, 0, 0) != -1, "kevent");
+#elif defined(HAVE_EPOLL)
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = ev_data(s)};
+    ensure(epoll_ctl(s->w->b->ep, EPOLL_CTL_ADD, (int)s->fd, &ev) != -1,
+           "epoll_ctl");
+#else
+    sl_insert_head(&s->w->b->socks, s, __next);
+#endif
+
+    return 0;
+}
+
+
+/// Bind a warpcore socket-backend socket. Calls the underlying Socket API. In
+/// w_engopt::demux mode, shares an already open kernel socket for the local
+/// address and port instead, if there is one.
+///
+/// @param      s     The w_sock to bind.
+/// @param[in]  opt   Socket options for this socket. Can be zero.
+///
+/// @return     Zero on success, @p errno otherwise.
+///
+int backend_bind(struct w_sock * const s, const struct w_sockopt * const opt)
+{
+#ifdef SOCK_DEMUX
+    if (s->w->opt.demux) {
+        struct w_ksock * const ks = ksock_find(s);
+        if (ks) {
+            ksock_attach(s, ks);
+            if (opt)
+                w_set_sockopt(s, opt);
+        } else {
+            const int e = sock_bind(s, opt);
+            if (unlikely(e))
+                return e;
+        }
+        // datagrams from unknown peers go to the first unconnected w_sock
+        if (w_get_sock(s->w, &s->ws_loc, 0) == 0)
+            ins_sock(s);
+        return 0;
+    }
+#endif
+    return sock_bind(s, opt);
+}
+
+
+#ifdef SOCK_DEMUX
+/// Move w_sock @p s, whose four-tuple is taken on its shared kernel socket with
+/// an ephemeral port, to a new kernel socket with another ephemeral port.
+///
+/// @param      s     The w_sock to connect.
+///
+/// @return     Zero on success, @p errno otherwise.
+///
+static int __attribute__((nonnull)) ksock_reopen(struct w_sock * const s)
+{
+    struct w_ksock * const old = s->__ks;
+    const struct w_sockaddr rem = s->ws_rem;
+    const struct w_sockopt opt = s->opt;
+    const bool pace = s->__pace;
+
+    s->ws_lport = 0;
+    memset(&s->ws_rem, 0, sizeof(s->ws_rem));
+    s->opt = (struct w_sockopt){0};
+    s->__pace = false;
+    const int e = sock_bind(s, &opt);
+    if (unlikely(e)) {
+        s->__ks = old;
+        s->fd = old->fd;
+        s->ws_lport = old->local.port;
+        s->opt = opt;
+        s->__pace = pace;
+    } else
+        // the w_sock holding the four-tuple keeps the old kernel socket open
+        old->refs--;
+    s->ws_rem = rem;
+    return e;
+}
+#endif
+
+
+void backend_preconnect(struct w_sock * const s
+#ifndef SOCK_DEMUX
+                        __attribute__((unused))
+#endif
+)
+{
+#ifdef SOCK_DEMUX
+    if (s->__ks)
+        rem_sock(s);
+#endif
+}
+
+
+/// Connect the kernel socket of w_sock @p s. In w_engopt::demux mode, only
+/// registers the four-tuple of @p s for demultiplexing.
+///
+/// @param      s     The w_sock to connect.
+///
+/// @return     Zero on success, @p errno otherwise.
+///
+int backend_connect(struct w_sock * const s)
+{
+#ifdef SOCK_DEMUX
+    if (s->__ks) {
+        if (unlikely(w_get_sock(s->w, &s->ws_loc, &s->ws_rem))) {
+            if (s->__ks->eph == false)
+                return EADDRINUSE;
+            const int e = ksock_reopen(s);
+            if (unlikely(e))
+                return e;
+        }
+        ins_sock(s);
+        return 0;
+    }
+#endif
+
+    struct sockaddr_storage ss;
+    to_sockaddr((struct sockaddr *)&ss, &s->ws_raddr, s->ws_rport, s->ws_scope);
+    if (unlikely(connect((int)s->fd, (struct sockaddr *)&ss,
+                         sa_len(ss.ss_family)) != 0))
+        return errno;
+    return 0;
+}
+
+
+/// Close the socket.
+///
+/// @param      s     The w_sock to close.
+///
+void backend_close(struct w_sock * const s)
+{
+#ifdef SOCK_DEMUX
+    if (s->__ks) {
+        rem_sock(s);
+        if (s->__ready) {
+            s->__ready = false;
+            sl_remove(&s->w->b->rdy, s, w_sock, __rdy);
+        }
+        w_free(&s->iv);
+        if (ksock_detach(s) == false)
+            // other w_socks still share the kernel socket
+            return;
+    }
+#endif
+
+#if defined(HAVE_IO_URING)
+    struct w_backend * const b = s->w->b;
+    uring_tx_flush(s->w);
+    s->__closing = true;
+    if (s->__armed) {
+        struct io_uring_sqe * const sqe = uring_get_sqe(&b->ring);
+        ensure(sqe, "io_uring SQ full after flush");
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uint64_t)(uintptr_t)s;
+        sqe->user_data = URING_IGN;
+        // wait for the final completion of the multishot receive
+        while (s->__armed) {
+            uring_submit(b, true, -1);
+            uring_reap(s->w);
+        }
+    }
+    if (s->__starved) {
+        s->__starved = false;
+        b->n_starved--;
+    }
+    sl_remove(&b->socks, s, w_sock, __next);
+    if (s->__ready)
+        sl_remove(&b->rdy, s, w_sock, __rdy);
+    w_free(&s->iv);
+#elif defined(HAVE_KQUEUE)
+    struct kevent ev;
+    EV_SET(&ev, s->fd, EVFILT_READ, EV_DELETE, 0, 0, s);
+    ensure(kevent(s->w->b->kq, &ev, 1, 0, 0, 0) != -1, "kevent");
+#elif defined(HAVE_EPOLL)
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = s};
+    ensure(epoll_ctl(s->w->b->ep, EPOLL_CTL_DEL, (int)s->fd, &ev) != -1,
+           "epoll_ctl");
+#else
+    sl_remove(&s->w->b->socks, s, w_sock, __next);
+#endif
+
+#if defined(HAVE_MSG_ZEROCOPY) && !defined(HAVE_IO_URING)
+    if (s->__zc)
+        zc_close(s);
+#endif
+
+    ensure(close((int)s->fd) == 0, "close");
+}
+
+
+#ifdef __linux__
+// kernels below 4.9 can't deal with getting an uint8_t passed in, sigh
+#define TOS_CMSG_SPACE CMSG_SPACE(sizeof(int))
+#else
+#define TOS_CMSG_SPACE CMSG_SPACE(sizeof(uint8_t))
+#endif
+
+#ifdef HAVE_SO_TIMESTAMPING
+#define TS_CMSG_SPACE CMSG_SPACE(sizeof(struct scm_timestamping))
+#else
+#define TS_CMSG_SPACE 0
+#endif
+
+#ifdef HAVE_SO_TXTIME
+#define TXTIME_CMSG_SPACE CMSG_SPACE(sizeof(uint64_t))
+#else
+#define TXTIME_CMSG_SPACE 0
+#endif
+
+#ifdef HAVE_UDP_SEGMENT
+#define GSO_CMSG_SPACE CMSG_SPACE(sizeof(uint16_t))
+
+// Linux limits on what a single UDP GSO send may carry.
+#define GSO_MAX_SEGS 64
+#define GSO_MAX_LEN (UINT16_MAX - 28) // 28 = IPv4 + UDP header
+
+// With MSG_ZEROCOPY, the kernel pins each iovec into its own skb fragment, and
+// fails the send with EMSGSIZE beyond MAX_SKB_FRAGS (17). A payload that
+// straddles a page boundary takes two fragments.
+#define GSO_MAX_ZC_SEGS 8
+
+/// Check whether w_iov @p v can be appended to a UDP GSO send that currently
+/// ends with w_iov @p p, and that has so far accumulated @p len bytes in @p cnt
+/// segments. All segments must have the same length, except for the last one,
+/// which may be shorter, and must go to the same destination with the same TOS
+/// and departure time.
+///
+/// @param[in]  s     The w_sock the GSO send is for.
+/// @param[in]  p     The last w_iov currently in the GSO send.
+/// @param[in]  v     The candidate w_iov.
+/// @param[in]  seg   The GSO segment size.
+/// @param[in]  len   The number of bytes in the GSO send so far.
+/// @param[in]  cnt   The number of segments in the GSO send so far.
+///
+/// @return     True if @p v can be appended, false otherwise.
+///
+static bool __attribute__((nonnull))
+gso_appendable(const struct w_sock * const s,
+               const struct w_iov * const p,
+               const struct w_iov * const v,
+               const uint16_t seg,
+               const size_t len,
+               const size_t cnt)
+{
+    return p->len == seg && v->len <= seg && v->len && p->flags == v->flags &&
+           p->txtime == v->txtime &&
+           cnt < (s->opt.enable_zero_copy ? GSO_MAX_ZC_SEGS : GSO_MAX_SEGS) &&
+           len + v->len <= GSO_MAX_LEN &&
+           (w_connected(s) || w_sockaddr_cmp(&p->saddr, &v->saddr));
+}
+
+
+/// Check whether a send error means that the kernel or NIC cannot do UDP GSO.
+///
+/// @param[in]  err   The errno of the failed send.
+///
+/// @return     True if the send should be retried without GSO.
+///
+static inline bool gso_refused(const int err)
+{
+    return err == EIO || err == EINVAL || err == EOPNOTSUPP ||
+           err == ENOPROTOOPT;
+}
+#else
+#define GSO_CMSG_SPACE 0
+#endif
+
+// Control data space per TX and RX message.
+#define TX_CTRL_LEN (TOS_CMSG_SPACE + GSO_CMSG_SPACE + TXTIME_CMSG_SPACE)
+#define RX_CTRL_LEN (2 * CMSG_SPACE(sizeof(int)) + TS_CMSG_SPACE)
+
+
+/// Prepare message @p hdr for sending the w_iov chain starting at @p v over
+/// w_sock @p s. Without UDP GSO, the message covers only @p v. With
+/// w_sockopt::enable_udp_gso set, it covers the run of following w_iovs with
+/// the same length, destination and TOS, one iovec each.
+///
+/// @param      s        w_sock socket to transmit over.
+/// @param      v        First w_iov to send.
+/// @param      hdr      The message to prepare.
+/// @param      iov      iovec array for the message.
+/// @param[in]  max_iov  Number of available entries in @p iov.
+/// @param      sa       Storage for the destination address.
+/// @param      ctrl     Storage for TX_CTRL_LEN bytes of control data.
+///
+/// @return     The first w_iov not covered by @p hdr.
+///
+static struct w_iov * __attribute__((nonnull))
+mk_msg(struct w_sock * const s,
+       struct w_iov * v,
+       struct msghdr * const hdr,
+       struct iovec * const iov,
+       const size_t max_iov
+#ifndef HAVE_UDP_SEGMENT
+       __attribute__((unused))
+#endif
+       ,
+       struct sockaddr_storage * const sa,
+       uint8_t * const ctrl)
+{
+    struct w_iov * const lead = v;
+    const uint8_t flags = v->flags;
+    // a demultiplexed w_sock can't set ECN on its shared kernel socket
+    const uint8_t tos =
+        flags == 0 && demuxed(s) && s->opt.enable_ecn ? ECN_ECT0 : flags;
+    // if w_sock is disconnected, use destination IP and port from w_iov
+    // instead of the one in the template header; a demultiplexed w_sock
+    // shares an unconnected kernel socket, so always name its peer
+    const bool named = w_connected(s) == false || demuxed(s);
+    if (w_connected(s) == false)
+        to_sockaddr((struct sockaddr *)sa, &v->wv_addr, v->wv_port,
+                    s->ws_scope);
+    else if (named)
+        to_sockaddr((struct sockaddr *)sa, &s->ws_raddr, s->ws_rport,
+                    s->ws_scope);
+    *hdr = (struct msghdr){.msg_name = named ? sa : 0,
+                           .msg_namelen = named ? sa_len(sa->ss_family) : 0,
+                           .msg_iov = iov};
+
+#ifdef HAVE_UDP_SEGMENT
+    const uint16_t seg = v->len;
+    size_t len = 0;
+#endif
+    for (;;) {
+        iov[hdr->msg_iovlen++] =
+            (struct iovec){.iov_base = v->buf, .iov_len = v->len};
+        if (w_connected(s))
+            v->saddr = s->tup.remote;
+#ifdef HAVE_UDP_SEGMENT
+        len += v->len;
+        struct w_iov * const n = sq_next(v, next);
+        const bool more = s->opt.enable_udp_gso && n &&
+                          hdr->msg_iovlen < max_iov &&
+                          gso_appendable(s, v, n, seg, len, hdr->msg_iovlen);
+#endif
+        if (flags == 0 && s->opt.enable_ecn)
+            // make sure that the flags reflect what went out on the wire
+            v->flags = ECN_ECT0;
+        v = sq_next(v, next);
+#ifdef HAVE_UDP_SEGMENT
+        if (more == false)
+#endif
+            break;
+    }
+
+    size_t clen = 0;
+
+    // set TOS from w_iov
+    if (tos) {
+        struct cmsghdr * const cmsg = (struct cmsghdr *)(void *)ctrl;
+        cmsg->cmsg_level = lead->wv_af == AF_INET ? IPPROTO_IP : IPPROTO_IPV6;
+        cmsg->cmsg_type = lead->wv_af == AF_INET ? IP_TOS : IPV6_TCLASS;
+        cmsg->cmsg_len =
+#ifdef __FreeBSD__
+            CMSG_LEN(lead->wv_af == AF_INET ? sizeof(char) : sizeof(int));
+#else
+            CMSG_LEN(sizeof(int));
+#endif
+        *(int *)(void *)CMSG_DATA(cmsg) = tos;
+        clen += TOS_CMSG_SPACE;
+    }
+
+#ifdef HAVE_UDP_SEGMENT
+    // let the kernel segment the iovecs into datagrams of seg bytes
+    if (hdr->msg_iovlen > 1) {
+        struct cmsghdr * const cmsg = (struct cmsghdr *)(void *)(ctrl + clen);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        *(uint16_t *)(void *)CMSG_DATA(cmsg) = seg;
+        clen += GSO_CMSG_SPACE;
+    }
+#endif
+
+#ifdef HAVE_SO_TXTIME
+    // let the kernel hold the message back until its departure time
+    if (lead->txtime && s->opt.enable_txtime && s->__pace == false) {
+        struct cmsghdr * const cmsg = (struct cmsghdr *)(void *)(ctrl + clen);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        *(uint64_t *)(void *)CMSG_DATA(cmsg) = lead->txtime;
+        clen += TXTIME_CMSG_SPACE;
+    }
+#endif
+
+    if (clen) {
+        hdr->msg_control = ctrl;
+        hdr->msg_controllen = clen;
+    }
+    return v;
+}
+
+
+#ifndef HAVE_IO_URING
+/// Loops over the w_iov structures in the tail queue @p o, sending them all
+/// over w_sock @p s. This backend uses the Socket API.
+///
+/// When w_sockopt::enable_udp_gso is set, runs of w_iovs with the same length,
+/// destination and TOS are handed to the kernel as a single UDP GSO send, with
+/// one iovec per w_iov. If the kernel refuses GSO, the option is cleared and
+/// the remaining w_iovs are sent individually.
+///
+/// When w_sockopt::enable_zero_copy is set, the w_iovs are sent with
+/// MSG_ZEROCOPY and stay in flight until w_nic_tx() sees the kernel release
+/// them; see w_iov_in_flight().
+///
+/// When w_sockopt::enable_txtime is set but the kernel lacks SO_TXTIME, the
+/// w_iovs from the first one that is not due yet onwards are held back, and
+/// sent by a later w_nic_tx().
+///
+/// @param      s     w_sock socket to transmit over.
+/// @param      o     w_iov_sq to send.
+///
+void w_tx(struct w_sock * const s, struct w_iov_sq * const o)
+{
+    struct w_backend * const b = s->w->b;
+    const uint32_t batch = tx_batch(b);
+#ifdef HAVE_MSG_ZEROCOPY
+    int flags = s->opt.enable_zero_copy ? MSG_ZEROCOPY : 0;
+#else
+    const int flags = 0;
+#endif
+    const uint64_t now = unlikely(s->__pace) ? w_now(CLOCK_MONOTONIC) : 0;
+    struct w_iov * end = 0; // first w_iov held back for pacing
+
+    struct w_iov * v = sq_first(o);
+    while (v != end) {
+        size_t i = 0; // number of messages
+        size_t j = 0; // number of iovecs
+        for (; i < batch && j < batch && v != end; i++) {
+            if (pace_hold(s, v, now)) {
+                pace_defer(s, v);
+                end = v;
+                break;
+            }
+            struct msghdr * const hdr = tx_hdr(b, i);
+            // remember the first w_iov of each message, so we can resend
+            // without GSO on failure, and know which w_iovs a zero-copy send
+            // covers
+            b->tx_first[i] = v;
+            v = mk_msg(s, v, hdr, &b->tx_iov[j], batch - j, &b->tx_sa[i],
+                       &b->tx_ctrl[i * TX_CTRL_LEN]);
+            j += hdr->msg_iovlen;
+        }
+
+        for (size_t sent = 0; sent < i;) {
+            const ssize_t r =
+#if defined(HAVE_SENDMMSG)
+                sendmmsg((int)s->fd, &b->tx_msg[sent],
+                         (unsigned int)(i - sent), flags);
+#else
+                sendmsg((int)s->fd, b->tx_msg, flags);
+#endif
+            if (likely(r >= 0)) {
+#if defined(HAVE_SENDMMSG)
+                const size_t done = sent + (size_t)r;
+#else
+                const size_t done = i;
+#endif
+#ifdef HAVE_MSG_ZEROCOPY
+                if (flags)
+                    for (; sent < done; sent++)
+                        zc_record(s->__zc, b->tx_first[sent],
+                                  tx_hdr(b, sent)->msg_iovlen);
+#endif
+                sent = done;
+                continue;
+            }
+
+#ifdef HAVE_MSG_ZEROCOPY
+            if (flags && (errno == ENOBUFS || errno == EMSGSIZE)) {
+                // out of socket memory for zero-copy state, or too many
+                // fragments to pin, copy instead
+                warn(DBG, "MSG_ZEROCOPY send failed (%s), copying",
+                     strerror(errno));
+                flags = 0;
+                continue;
+            }
+#endif
+
+#ifdef HAVE_UDP_SEGMENT
+            if (tx_hdr(b, sent)->msg_iovlen > 1 && gso_refused(errno)) {
+                // the kernel or NIC can't do GSO here, resend without it
+                warn(WRN, "UDP GSO failed (%s), disabling for this socket",
+                     strerror(errno));
+                s->opt.enable_udp_gso = false;
+                v = b->tx_first[sent];
+                break;
+            }
+#endif
+            if (unlikely(errno != EAGAIN && errno != ETIMEDOUT))
+                warn(ERR, "sendmsg/sendmmsg returned %d (%s)", errno,
+                     strerror(errno));
+            break;
+        }
+    }
+}
+#endif
+
+
+/// Extract the TOS byte, TTL and receive timestamp from the control messages of
+/// a received message into w_iov @p v.
+///
+/// @param      hdr   The received message.
+/// @param      v     The w_iov to update.
+///
+/// @return     The UDP GRO segment size, or zero if the message was not
+///             coalesced.
+///
+static uint16_t __attribute__((nonnull))
+rx_cmsg(struct msghdr * const hdr, struct w_iov * const v)
+{
+    uint16_t seg = 0;
+    // extract TOS byte (Particle uses recvfrom w/o cmsg support)
+    for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(hdr); cmsg;
+         cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level == IPPROTO_IP ||
+            cmsg->cmsg_level == IPPROTO_IPV6) {
+            if (cmsg->cmsg_type ==
+#ifdef __linux__
+                    IP_TOS
+#else
+                    IP_RECVTOS
+#endif
+                || cmsg->cmsg_type == IPV6_TCLASS)
+                v->flags = *(uint8_t *)CMSG_DATA(cmsg);
+#ifndef PARTICLE
+            else if (cmsg->cmsg_type ==
+#ifdef __linux__
+                     IP_TTL
+#else
+                     IP_RECVTTL
+#endif
+            )
+                v->ttl = *(uint8_t *)CMSG_DATA(cmsg);
+#endif
+        }
+#ifdef HAVE_UDP_GRO
+        else if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+            seg = (uint16_t) * (int *)(void *)CMSG_DATA(cmsg);
+#endif
+#ifdef HAVE_SO_TIMESTAMPING
+        else if (cmsg->cmsg_level == SOL_SOCKET &&
+                 cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            // ts[0] is the software timestamp, ts[2] the raw NIC one, which
+            // is in a different clock
+            const struct scm_timestamping * const tss =
+                (const void *)CMSG_DATA(cmsg);
+            v->ts = (uint64_t)tss->ts[0].tv_sec * NS_PER_S +
+                    (uint64_t)tss->ts[0].tv_nsec;
+            v->hwts = (uint64_t)tss->ts[2].tv_sec * NS_PER_S +
+                      (uint64_t)tss->ts[2].tv_nsec;
+        }
+#endif
+    }
+    return seg;
+}
+
+
+#if defined(HAVE_UDP_GRO) && !defined(HAVE_IO_URING)
+// Number of (up to 64 KB) coalesced datagrams to receive per recvmmsg() call.
+#define GRO_SLOTS 8
+#define GRO_SLOT_LEN UINT16_MAX
+
+/// Receive coalesced UDP GRO datagrams on w_sock @p s into the engine's
+/// staging area and split them into one w_iov per segment, each carrying the
+/// sender address, TOS byte, TTL and timestamp of the datagram it came from.
+///
+/// @param      s     w_sock to receive on.
+/// @param      i     w_iov tail queue to append new data to.
+///
+static void __attribute__((nonnull))
+rx_gro(struct w_sock * const s, struct w_iov_sq * const i)
+{
+    struct w_backend * const b = s->w->b;
+    if (unlikely(b->gro_buf == 0))
+        ensure((b->gro_buf = malloc(GRO_SLOTS * GRO_SLOT_LEN)) != 0,
+               "cannot alloc GRO staging area");
+
+    int n = 0;
+    do {
+        struct iovec msg[GRO_SLOTS];
+        struct sockaddr_storage sa[GRO_SLOTS];
+        __extension__ uint8_t ctrl[GRO_SLOTS][CMSG_SPACE(sizeof(uint8_t)) +
+                                              CMSG_SPACE(sizeof(uint8_t)) +
+                                              CMSG_SPACE(sizeof(int)) +
+                                              TS_CMSG_SPACE];
+        struct mmsghdr msgvec[GRO_SLOTS];
+        for (int j = 0; likely(j < GRO_SLOTS); j++) {
+            msg[j] = (struct iovec){.iov_base = b->gro_buf + j * GRO_SLOT_LEN,
+                                    .iov_len = GRO_SLOT_LEN};
+            msgvec[j].msg_hdr =
+                (struct msghdr){.msg_name = &sa[j],
+                                .msg_namelen = sizeof(sa[j]),
+                                .msg_iov = &msg[j],
+                                .msg_iovlen = 1,
+                                .msg_control = &ctrl[j],
+                                .msg_controllen = sizeof(ctrl[j])};
+        }
+
+        n = recvmmsg((int)s->fd, msgvec, GRO_SLOTS, MSG_DONTWAIT, 0);
+        if (unlikely(n < 0)) {
+            if (errno != EAGAIN && errno != ETIMEDOUT)
+                warn(ERR, "recvmmsg returned %d (%s)", errno, strerror(errno));
+            return;
+        }
+
+        for (int j = 0; likely(j < n); j++) {
+            struct w_iov tmpl = {.ttl = 0};
+            tmpl.wv_port = sa_port(&sa[j]);
+            w_to_waddr(&tmpl.wv_addr, (struct sockaddr *)&sa[j]);
+            const uint16_t len = (uint16_t)msgvec[j].msg_len;
+            uint16_t seg = rx_cmsg(&msgvec[j].msg_hdr, &tmpl);
+            if (seg == 0)
+                seg = len;
+
+            const uint8_t * const data = msg[j].iov_base;
+            for (uint16_t off = 0; off < len; off += seg) {
+                const uint16_t l = MIN(seg, len - off);
+                // short segments can go into small buffers
+                struct w_iov * const v = w_alloc_iov(
+                    s->w, s->ws_af, l <= SMALL_BUF_LEN ? l : 0, 0);
+                if (unlikely(v == 0 || l > v->len)) {
+                    warn(CRT, "%s, dropping %u GRO byte%s",
+                         v ? "segment too large" : "no more bufs", len - off,
+                         plural(len - off));
+                    if (v)
+                        w_free_iov(v);
+                    break;
+                }
+                memcpy(v->buf, &data[off], l);
+                v->len = l;
+                v->saddr = tmpl.saddr;
+                v->flags = tmpl.flags;
+                v->ttl = tmpl.ttl;
+                v->ts = tmpl.ts;
+                v->hwts = tmpl.hwts;
+                sq_insert_tail(i, v, next);
+            }
+        }
+    } while (n == GRO_SLOTS);
+}
+#endif
+
+
+#ifdef HAVE_IO_URING
+/// Submit all queued SQEs to the io_uring of backend @p b, and optionally wait
+/// for a completion.
+///
+/// @param      b     The w_backend.
+/// @param[in]  wait  Whether to wait for a completion.
+/// @param[in]  nsec  Timeout in nanoseconds for waiting. Pass -1 for infinite
+///                   wait.
+///
+static void __attribute__((nonnull))
+uring_submit(struct w_backend * const b, const bool wait, const int64_t nsec)
+{
+    // submitted SQEs can no longer be linked to
+    b->tx_link = 0;
+    uring_enter(&b->ring, wait, nsec);
+}
+
+
+/// Return a zeroed SQE of the io_uring of backend @p b, submitting queued SQEs
+/// first if the submission queue is full.
+///
+/// @param      b     The w_backend.
+///
+/// @return     Submission queue entry.
+///
+static struct io_uring_sqe * __attribute__((nonnull))
+uring_sqe(struct w_backend * const b)
+{
+    struct io_uring_sqe * sqe = uring_get_sqe(&b->ring);
+    if (unlikely(sqe == 0)) {
+        uring_submit(b, false, 0);
+        sqe = uring_get_sqe(&b->ring);
+        ensure(sqe, "io_uring SQ full");
+    }
+    return sqe;
+}
+
+
+/// Lend free w_iov buffers of engine @p w to the kernel, by adding them to the
+/// provided-buffer ring that the multishot receives draw from. Each buffer
+/// covers BUF_HEADROOM bytes in front of w_iov::base, so that the payload of a
+/// received datagram starts at w_iov::buf.
+///
+/// @param      w     Backend engine.
+///
+static void __attribute__((nonnull)) uring_rx_post(struct w_engine * const w)
+{
+    struct w_backend * const b = w->b;
+    const uint32_t tail = b->rx_tail;
+    // buffer IDs are ring positions, so stop at one whose CQE is outstanding
+    while (b->rx_iov[b->rx_tail & b->rx_mask] == 0) {
+        struct w_iov * const v = w_alloc_iov_base(w);
+        if (unlikely(v == 0))
+            break;
+        const uint16_t bid = (uint16_t)(b->rx_tail & b->rx_mask);
+        // don't assign the whole entry; the ring tail overlays bufs[0]
+        struct io_uring_buf * const buf = &b->rx_br->bufs[bid];
+        buf->addr = (uint64_t)(uintptr_t)(v->base - BUF_HEADROOM);
+        buf->len = (uint32_t)(BUF_HEADROOM + max_buf_len(w));
+        buf->bid = bid;
+        b->rx_iov[bid] = v;
+        b->rx_tail++;
+        b->rx_posted++;
+    }
+    if (b->rx_tail != tail)
+        __atomic_store_n(&b->rx_br->tail, (uint16_t)b->rx_tail,
+                         __ATOMIC_RELEASE);
+}
+
+
+/// Queue a multishot recvmsg for w_sock @p s, which keeps completing with one
+/// datagram per provided buffer until it runs out of buffers or is cancelled.
+///
+/// @param      s     The w_sock to receive on.
+///
+static void __attribute__((nonnull)) uring_rx_arm(struct w_sock * const s)
+{
+    struct io_uring_sqe * const sqe = uring_sqe(s->w->b);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = (int32_t)s->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&s->w->b->rx_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (uint64_t)(uintptr_t)s;
+    s->__armed = true;
+}
+
+
+/// Handle the completion of a multishot recvmsg on w_sock @p s. Appends a
+/// received datagram to w_sock::iv and marks @p s as ready.
+///
+/// @param      w      Backend engine.
+/// @param      s      The w_sock the completion is for.
+/// @param[in]  res    The result of the completion.
+/// @param[in]  flags  The flags of the completion.
+///
+static void __attribute__((nonnull))
+uring_rx_cqe(struct w_engine * const w,
+             struct w_sock * const s,
+             const int32_t res,
+             const uint32_t flags)
+{
+    struct w_backend * const b = w->b;
+    if (flags & IORING_CQE_F_BUFFER) {
+        const uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+        struct w_iov * const v = b->rx_iov[bid];
+        b->rx_iov[bid] = 0;
+        b->rx_posted--;
+
+        if (likely(res >= 0 && s->__closing == false)) {
+            struct io_uring_recvmsg_out * const o =
+                (struct io_uring_recvmsg_out *)(void *)(v->base -
+                                                        BUF_HEADROOM);
+            uint8_t * const name = (uint8_t *)(o + 1);
+            if (unlikely(o->flags & MSG_TRUNC))
+                warn(WRN, "truncated %u-byte datagram to %u bytes",
+                     o->payloadlen, v->len);
+            v->len = (uint16_t)MIN(o->payloadlen, v->len);
+            v->wv_port = sa_port(name);
+            w_to_waddr(&v->wv_addr, (struct sockaddr *)(void *)name);
+            rx_cmsg(&(struct msghdr){.msg_control = name + URING_RX_NAME,
+                                     .msg_controllen = o->controllen},
+                    v);
+            sq_insert_tail(&s->iv, v, next);
+            if (s->__ready == false) {
+                s->__ready = true;
+                sl_insert_head(&b->rdy, s, __rdy);
+            }
+        } else
+            w_free_iov(v);
+    }
+
+    if ((flags & IORING_CQE_F_MORE) == 0) {
+        s->__armed = false;
+        if (res != -ECANCELED && s->__closing == false) {
+            // re-armed by uring_reap() once there are buffers again
+            if (res != -ENOBUFS)
+                warn(WRN, "multishot recvmsg ended (%s)", strerror(-res));
+            s->__starved = true;
+            b->n_starved++;
+        }
+    }
+}
+
+
+/// Handle a completion of TX message @p slot. Marks the message for resending
+/// if the kernel refused UDP GSO or zero-copy, or if the message was cancelled
+/// because an earlier message linked to it failed. Zero-copy sends complete
+/// twice. The first completion has the send result; the second one is a
+/// notification that the kernel has released the w_iovs, which may arrive after
+/// @p slot has been reused, and so only refers to zero-copy send @p seq.
+///
+/// @param      w      Backend engine.
+/// @param[in]  slot   Index of the w_uring_tx.
+/// @param[in]  seq    The w_zc sequence number of a zero-copy send.
+/// @param[in]  res    The result of the completion.
+/// @param[in]  flags  The flags of the completion.
+///
+static void __attribute__((nonnull)) uring_tx_cqe(struct w_engine * const w,
+                                                  const uint32_t slot,
+                                                  const uint32_t seq
+#ifndef HAVE_MSG_ZEROCOPY
+                                                  __attribute__((unused))
+#endif
+                                                  ,
+                                                  const int32_t res,
+                                                  const uint32_t flags)
+{
+    struct w_backend * const b = w->b;
+#ifdef HAVE_MSG_ZEROCOPY
+    if (flags & IORING_CQE_F_NOTIF) {
+        zc_done(w, &b->zc, seq, seq);
+        return;
+    }
+#endif
+    struct w_uring_tx * const t = &b->tx[slot];
+    b->tx_inflight--;
+#ifdef HAVE_MSG_ZEROCOPY
+    if (t->zc && (flags & IORING_CQE_F_MORE) == 0)
+        // no notification follows
+        zc_done(w, &b->zc, seq, seq);
+#endif
+    if (likely(res >= 0))
+        return;
+
+    if (res == -ECANCELED) {
+        t->retry = true;
+        return;
+    }
+#ifdef HAVE_MSG_ZEROCOPY
+    if (t->zc && (res == -EINVAL || res == -EOPNOTSUPP ||
+                  (res == -EMSGSIZE && t->msg.msg_iovlen > 1))) {
+        if (t->s->opt.enable_zero_copy)
+            warn(WRN, "zero-copy send failed (%s), disabling for this socket",
+                 strerror(-res));
+        t->s->opt.enable_zero_copy = false;
+        t->retry = true;
+        return;
+    }
+#endif
+#ifdef HAVE_UDP_SEGMENT
+    if (t->msg.msg_iovlen > 1 && gso_refused(-res)) {
+        if (t->s->opt.enable_udp_gso)
+            warn(WRN, "UDP GSO failed (%s), disabling for this socket",
+                 strerror(-res));
+        t->s->opt.enable_udp_gso = false;
+        t->retry = true;
+        return;
+    }
+#endif
+    if (unlikely(res != -EAGAIN && res != -ETIMEDOUT))
+        warn(ERR, "sendmsg returned %d (%s)", -res, strerror(-res));
+}
+
+
+/// Process all available completions of the io_uring of engine @p w. Then
+/// lends freed buffers to the kernel and re-arms receives on sockets that ran
+/// out of buffers.
+///
+/// @param      w     Backend engine.
+///
+static void __attribute__((nonnull)) uring_reap(struct w_engine * const w)
+{
+    struct w_backend * const b = w->b;
+    const struct io_uring_cqe * cqe;
+    while ((cqe = uring_peek_cqe(&b->ring)) != 0) {
+        const uint64_t ud = cqe->user_data;
+        if ((ud & URING_TAG_MASK) == 0)
+            uring_rx_cqe(w, (struct w_sock *)(uintptr_t)ud, cqe->res,
+                         cqe->flags);
+        else if (ud & URING_TX)
+            uring_tx_cqe(w, (uint32_t)ud >> 2, (uint32_t)(ud >> 32), cqe->res,
+                         cqe->flags);
+        uring_cqe_seen(&b->ring);
+    }
+
+    uring_rx_post(w);
+    if (unlikely(b->n_starved && b->rx_posted)) {
+        struct w_sock * s;
+        sl_foreach (s, &b->socks, __next)
+            if (s->__starved) {
+                s->__starved = false;
+                b->n_starved--;
+                uring_rx_arm(s);
+            }
+    }
+}
+
+
+/// Queue one sendmsg for the w_iov chain starting at @p v on w_sock @p s,
+/// covering at most @p max w_iovs. Consecutive messages on the same socket are
+/// linked, so the kernel sends them in order. There must be room for the
+/// message; see uring_tx_queue().
+///
+/// @param      s     w_sock socket to transmit over.
+/// @param      v     First w_iov to send; updated to the first one not queued.
+/// @param[in]  max   Maximum number of w_iovs to cover.
+///
+/// @return     Number of w_iovs queued.
+///
+static size_t __attribute__((nonnull))
+uring_tx_msg(struct w_sock * const s, struct w_iov ** const v, const size_t max)
+{
+    struct w_backend * const b = s->w->b;
+    const uint32_t slot = b->tx_n++;
+    struct w_uring_tx * const t = &b->tx[slot];
+    t->s = s;
+    t->v = *v;
+    t->retry = false;
+    *v = mk_msg(s, *v, &t->msg, &b->tx_iov[b->tx_iov_n],
+                MIN(max, URING_TX_IOVS - b->tx_iov_n), &t->sa, t->ctrl);
+    b->tx_iov_n += (uint32_t)t->msg.msg_iovlen;
+
+    struct io_uring_sqe * const sqe = uring_sqe(b);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->user_data = ((uint64_t)slot << 2) | URING_TX;
+#ifdef HAVE_MSG_ZEROCOPY
+    t->zc = s->opt.enable_zero_copy;
+    if (t->zc) {
+        sqe->opcode = IORING_OP_SENDMSG_ZC;
+        sqe->user_data |= (uint64_t)b->zc.seq << 32;
+        zc_record(&b->zc, t->v, t->msg.msg_iovlen);
+    }
+#endif
+    sqe->fd = (int32_t)s->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&t->msg;
+    sqe->len = 1;
+    if (b->tx_link && b->tx_link_s == s)
+        b->tx_link->flags |= IOSQE_IO_LINK;
+    b->tx_link = sqe;
+    b->tx_link_s = s;
+    b->tx_inflight++;
+    return t->msg.msg_iovlen;
+}
+
+
+/// Queue one sendmsg for the w_iov chain starting at @p v on w_sock @p s,
+/// covering at most @p max w_iovs. Flushes the queue first if it is full.
+///
+/// @param      s     w_sock socket to transmit over.
+/// @param      v     First w_iov to send; updated to the first one not queued.
+/// @param[in]  max   Maximum number of w_iovs to cover.
+///
+/// @return     Number of w_iovs queued.
+///
+static size_t __attribute__((nonnull))
+uring_tx_queue(struct w_sock * const s, struct w_iov ** const v, const size_t max)
+{
+    struct w_backend * const b = s->w->b;
+    if (unlikely(b->tx_n == URING_TX_MSGS || b->tx_iov_n == URING_TX_IOVS))
+        uring_tx_flush(s->w);
+    return uring_tx_msg(s, v, max);
+}
+
+
+/// Submit all queued TX messages of engine @p w and wait for their send
+/// results, after which the queue is empty again. Messages that need to be
+/// resent are queued and submitted again. Zero-copy notifications are not
+/// waited for; uring_reap() processes them as they arrive.
+///
+/// @param      w     Backend engine.
+///
+static void __attribute__((nonnull)) uring_tx_flush(struct w_engine * const w)
+{
+    struct w_backend * const b = w->b;
+    while (b->tx_n) {
+        uring_submit(b, false, 0);
+        for (;;) {
+            uring_reap(w);
+            if (b->tx_inflight == 0)
+                break;
+            uring_submit(b, true, -1);
+        }
+
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < b->tx_n; i++)
+            if (unlikely(b->tx[i].retry))
+                b->tx_retry[n++] =
+                    (struct w_uring_retry){.s = b->tx[i].s,
+                                           .v = b->tx[i].v,
+                                           .n = b->tx[i].msg.msg_iovlen};
+        b->tx_n = b->tx_iov_n = 0;
+
+        // each message covers at least one w_iov, so the retries fit
+        for (uint32_t i = 0; i < n; i++)
+            for (size_t left = b->tx_retry[i].n; left;)
+                left -= uring_tx_msg(b->tx_retry[i].s, &b->tx_retry[i].v, left);
+    }
+}
+
+
+/// Queues the w_iov structures in the tail queue @p o for sending over w_sock
+/// @p s. This backend uses io_uring; the messages are submitted by w_nic_tx(),
+/// or earlier if the queue fills up. The w_iovs must therefore not be modified
+/// until w_nic_tx() returns.
+///
+/// When w_sockopt::enable_udp_gso is set, runs of w_iovs with the same length,
+/// destination and TOS are handed to the kernel as a single UDP GSO send. If
+/// the kernel refuses GSO, the option is cleared and the w_iovs are resent
+/// individually.
+///
+/// When w_sockopt::enable_zero_copy is set, the messages are sent with
+/// IORING_OP_SENDMSG_ZC, and the w_iovs stay in flight after w_nic_tx()
+/// returns, until the kernel releases them; see w_iov_in_flight().
+///
+/// @param      s     w_sock socket to transmit over.
+/// @param      o     w_iov_sq to send.
+///
+void w_tx(struct w_sock * const s, struct w_iov_sq * const o)
+{
+    const uint64_t now = unlikely(s->__pace) ? w_now(CLOCK_MONOTONIC) : 0;
+    struct w_iov * v = sq_first(o);
+    while (v) {
+        if (pace_hold(s, v, now)) {
+            // held back for pacing, w_nic_tx() sends it when due
+            pace_defer(s, v);
+            break;
+        }
+        uring_tx_queue(s, &v, SIZE_MAX);
+    }
+}
+
+
+/// Appends the data received on w_sock @p s by its multishot receive to @p i.
+///
+/// @param      s     w_sock for which the application would like to receive new
+///                   data.
+/// @param      i     w_iov tail queue to append new data to.
+///
+static void __attribute__((nonnull))
+rx_sock(struct w_sock * const s, struct w_iov_sq * const i)
+{
+    struct w_backend * const b = s->w->b;
+    uring_submit(b, false, 0);
+    uring_reap(s->w);
+    sq_concat(i, &s->iv);
+    if (s->__ready) {
+        s->__ready = false;
+        sl_remove(&b->rdy, s, w_sock, __rdy);
+    }
+}
+
 
-    return 0;
+/// Submits all messages queued by w_tx(), and any held back for pacing that are
+/// now due, and waits for them to be sent. Also processes zero-copy
+/// notifications, so that w_iov_in_flight() reflects which sent w_iovs can be
+/// reused.
+///
+/// @param[in]  w     Backend engine.
+///
+void w_nic_tx(struct w_engine * const w)
+{
+    pace_flush(w);
+    uring_tx_flush(w);
+#ifdef HAVE_MSG_ZEROCOPY
+    if (w->b->zc_held) {
+        uring_submit(w->b, false, 0);
+        uring_reap(w);
+    }
+#endif
 }
 
 
-void backend_preconnect(struct w_sock * const s __attribute__((unused))) {}
+/// Check/wait until any data has been received.
+///
+/// @param[in]  w     Backend engine.
+/// @param[in]  nsec  Timeout in nanoseconds. Pass zero for immediate return, -1
+///                   for infinite wait.
+///
+/// @return     Whether any data is ready for reading.
+///
+bool w_nic_rx(struct w_engine * const w, const int64_t nsec)
+{
+    struct w_backend * const b = w->b;
+    pool_reclaim(w);
+    uring_submit(b, false, 0);
+    uring_reap(w);
+    if (sl_empty(&b->rdy) && nsec != 0) {
+        uring_submit(b, true, nsec);
+        uring_reap(w);
+    }
+    return !sl_empty(&b->rdy);
+}
 
 
-/// The socket backend performs no operation here.
+/// Fill a w_sock_slist with pointers to some sockets with pending inbound
+/// data. Data can be obtained via w_rx() on each w_sock in the list. Will
+/// return the number of ready connections, or zero if none are ready.
 ///
-/// @param      s     The w_sock to connect.
+/// @param[in]  w     Backend engine.
+/// @param      sl    Empty and initialized w_sock_slist.
 ///
-/// @return     Zero on success, @p errno otherwise.
+/// @return     Number of connections that are ready for reading.
 ///
-int backend_connect(struct w_sock * const s)
+uint32_t w_rx_ready(struct w_engine * const w, struct w_sock_slist * const sl)
 {
-    struct sockaddr_storage ss;
-    to_sockaddr((struct sockaddr *)&ss, &s->ws_raddr, s->ws_rport, s->ws_scope);
-    if (unlikely(connect((int)s->fd, (struct sockaddr *)&ss,
-                         sa_len(ss.ss_family)) != 0))
-        return errno;
-    return 0;
+    struct w_backend * const b = w->b;
+    if (sl_empty(&b->rdy)) {
+        uring_submit(b, false, 0);
+        uring_reap(w);
+    }
+
+    uint32_t i = 0;
+    while (!sl_empty(&b->rdy)) {
+        struct w_sock * const s = sl_first(&b->rdy);
+        sl_remove_head(&b->rdy, __rdy);
+        s->__ready = false;
+        sl_insert_head(sl, s, next);
+        i++;
+    }
+    return i;
 }
 
+#else
 
-/// Close the socket.
+/// Allocate the message arrays of the socket backend, and prepare the
+/// RX messages, which only need their buffers patched in later.
 ///
-/// @param      s     The w_sock to close.
+/// @param      w     Backend engine.
 ///
-void backend_close(struct w_sock * const s)
+static void __attribute__((nonnull)) msgs_init(struct w_engine * const w)
 {
-#if defined(HAVE_KQUEUE)
-    struct kevent ev;
-    EV_SET(&ev, s->fd, EVFILT_READ, EV_DELETE, 0, 0, s);
-    ensure(kevent(s->w->b->kq, &ev, 1, 0, 0, 0) != -1, "kevent");
-#elif defined(HAVE_EPOLL)
-    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = s};
-    ensure(epoll_ctl(s->w->b->ep, EPOLL_CTL_DEL, (int)s->fd, &ev) != -1,
-           "epoll_ctl");
+    struct w_backend * const b = w->b;
+#if defined(HAVE_SENDMMSG) || defined(HAVE_RECVMMSG)
+    b->batch = (uint32_t)MIN(w->opt.batch ? w->opt.batch : SOCK_BATCH, IOV_MAX);
 #else
-    sl_remove(&s->w->b->socks, s, w_sock, __next);
+    b->batch = 1;
 #endif
-
-    ensure(close((int)s->fd) == 0, "close");
+    w->opt.batch = b->batch;
+
+    ensure((b->tx_msg = calloc(b->batch, sizeof(*b->tx_msg))) != 0,
+           "cannot alloc tx_msg");
+    ensure((b->tx_iov = calloc(b->batch, sizeof(*b->tx_iov))) != 0,
+           "cannot alloc tx_iov");
+    ensure((b->tx_sa = calloc(b->batch, sizeof(*b->tx_sa))) != 0,
+           "cannot alloc tx_sa");
+    ensure((b->tx_ctrl = calloc(b->batch, TX_CTRL_LEN)) != 0,
+           "cannot alloc tx_ctrl");
+    ensure((b->tx_first = calloc(b->batch, sizeof(*b->tx_first))) != 0,
+           "cannot alloc tx_first");
+
+    ensure((b->rx_msg = calloc(b->batch, sizeof(*b->rx_msg))) != 0,
+           "cannot alloc rx_msg");
+    ensure((b->rx_iov = calloc(b->batch, sizeof(*b->rx_iov))) != 0,
+           "cannot alloc rx_iov");
+    ensure((b->rx_sa = calloc(b->batch, sizeof(*b->rx_sa))) != 0,
+           "cannot alloc rx_sa");
+    ensure((b->rx_ctrl = calloc(b->batch, RX_CTRL_LEN)) != 0,
+           "cannot alloc rx_ctrl");
+    ensure((b->rx_v = calloc(b->batch, sizeof(*b->rx_v))) != 0,
+           "cannot alloc rx_v");
+    for (uint32_t j = 0; j < b->batch; j++)
+        *rx_hdr(b, j) =
+            (struct msghdr){.msg_name = &b->rx_sa[j],
+                            .msg_namelen = sizeof(b->rx_sa[j]),
+                            .msg_iov = &b->rx_iov[j],
+                            .msg_iovlen = 1,
+                            .msg_control = &b->rx_ctrl[j * RX_CTRL_LEN],
+                            .msg_controllen = RX_CTRL_LEN};
+    b->rx_n = 0;
 }
 
 
-/// Loops over the w_iov structures in the tail queue @p o, sending them all
-/// over w_sock @p s. This backend uses the Socket API.
+/// Free the message arrays of the socket backend, and return any prepared RX
+/// buffers to the engine.
 ///
-/// @param      s     w_sock socket to transmit over.
-/// @param      o     w_iov_sq to send.
+/// @param      w     Backend engine.
 ///
-void w_tx(struct w_sock * const s, struct w_iov_sq * const o)
+static void __attribute__((nonnull)) msgs_cleanup(struct w_engine * const w)
 {
-#ifdef HAVE_SENDMMSG
-// There is a tradeoff here in terms of how many messages we should try and
-// send. Preparing to handle longer sizes has preparation overheads, whereas
-// only handling shorter sizes may require multiple syscalls (and incur their
-// overheads). So we're picking a number out of a hat. We could allocate
-// dynamically for MAX(IOV_MAX, w_iov_sq_cnt(c)), but that seems overkill.
-#define SEND_SIZE MIN(64, IOV_MAX)
-    struct mmsghdr msgvec[SEND_SIZE];
-#else
-#define SEND_SIZE 1
-    struct msghdr msgvec[SEND_SIZE];
-#endif
-    struct iovec msg[SEND_SIZE];
-    struct sockaddr_storage sa[SEND_SIZE];
-#ifdef __linux__
-    // kernels below 4.9 can't deal with getting an uint8_t passed in, sigh
-    __extension__ uint8_t ctrl[SEND_SIZE][CMSG_SPACE(sizeof(int))];
-#else
-    __extension__ uint8_t ctrl[SEND_SIZE][CMSG_SPACE(sizeof(uint8_t))];
-#endif
+    struct w_backend * const b = w->b;
+    for (uint32_t j = 0; j < b->rx_n; j++)
+        w_free_iov(b->rx_v[j]);
+    b->rx_n = 0;
+    free(b->tx_msg);
+    free(b->tx_iov);
+    free(b->tx_sa);
+    free(b->tx_ctrl);
+    free(b->tx_first);
+    free(b->rx_msg);
+    free(b->rx_iov);
+    free(b->rx_sa);
+    free(b->rx_ctrl);
+    free(b->rx_v);
+}
 
-    struct w_iov * v = sq_first(o);
-    do {
-        size_t i;
-        for (i = 0; i < SEND_SIZE && v; i++) {
-
-            // for sendmmsg, we populate the parameters
-            msg[i] = (struct iovec){.iov_base = v->buf, .iov_len = v->len};
-            // if w_sock is disconnected, use destination IP and port from w_iov
-            // instead of the one in the template header
-            if (w_connected(s))
-                v->saddr = s->tup.remote;
-            else
-                to_sockaddr((struct sockaddr *)&sa[i], &v->wv_addr, v->wv_port,
-                            s->ws_scope);
-#ifdef HAVE_SENDMMSG
-            msgvec[i].msg_hdr =
-#else
-            msgvec[i] =
-#endif
-                (struct msghdr){
-                    .msg_name = w_connected(s) ? 0 : &sa[i],
-                    .msg_namelen = w_connected(s) ? 0 : sa_len(sa[i].ss_family),
-                    .msg_iov = &msg[i],
-                    .msg_iovlen = 1};
 
-            // set TOS from w_iov
-            if (v->flags) {
-#ifdef HAVE_SENDMMSG
-                msgvec[i].msg_hdr.msg_control = &ctrl[i];
-                msgvec[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
-                struct cmsghdr * const cmsg = CMSG_FIRSTHDR(&msgvec[i].msg_hdr);
-#else
-                msgvec[i].msg_control = &ctrl[i];
-                msgvec[i].msg_controllen = sizeof(ctrl[i]);
-                struct cmsghdr * const cmsg = CMSG_FIRSTHDR(&msgvec[i]);
-#endif
-                cmsg->cmsg_level =
-                    v->wv_af == AF_INET ? IPPROTO_IP : IPPROTO_IPV6;
-                cmsg->cmsg_type = v->wv_af == AF_INET ? IP_TOS : IPV6_TCLASS;
-                cmsg->cmsg_len =
-#ifdef __FreeBSD__
-                    CMSG_LEN(v->wv_af == AF_INET ? sizeof(char) : sizeof(int));
-#else
-                    CMSG_LEN(sizeof(int));
-#endif
-                *(int *)(void *)CMSG_DATA(cmsg) = v->flags;
-            } else if (s->opt.enable_ecn)
-                // make sure that the flags reflect what went out on the wire
-                v->flags = ECN_ECT0;
+/// Prepare RX message @p j of engine @p w with a fresh buffer.
+///
+/// @param      w     Backend engine.
+/// @param[in]  j     Index of the RX message.
+///
+/// @return     False if the engine is out of buffers, true otherwise.
+///
+static inline bool __attribute__((nonnull))
+rx_prep(struct w_engine * const w, const uint32_t j)
+{
+    struct w_backend * const b = w->b;
+    struct w_iov * const v = w_alloc_iov_base(w);
+    if (unlikely(v == 0))
+        return false;
+    b->rx_v[j] = v;
+    b->rx_iov[j] = (struct iovec){.iov_base = v->buf, .iov_len = v->len};
+    return true;
+}
 
-            v = sq_next(v, next);
-        }
 
-        const ssize_t r =
-#if defined(HAVE_SENDMMSG)
-            sendmmsg((int)s->fd, msgvec, (unsigned int)i, 0);
-#else
-            sendmsg((int)s->fd, msgvec, 0);
-#endif
-        if (unlikely(r < 0 && errno != EAGAIN && errno != ETIMEDOUT))
-            warn(ERR, "sendmsg/sendmmsg returned %d (%s)", errno,
-                 strerror(errno));
-    } while (v);
+/// Refill the RX messages of engine @p w. The first @p used of the prepared
+/// w_backend::rx_n messages have been handed to the application and need new
+/// buffers; the remaining ones stay prepared for the next receive. Also tops
+/// the prepared messages up to the batch size. If the engine runs out of
+/// buffers, the prepared messages are compacted to the front.
+///
+/// @param      w     Backend engine.
+/// @param[in]  used  Number of RX messages consumed by the last receive.
+///
+static void __attribute__((nonnull))
+rx_fill(struct w_engine * const w, const uint32_t used)
+{
+    struct w_backend * const b = w->b;
+    uint32_t j = 0;
+    for (; j < used; j++)
+        if (unlikely(rx_prep(w, j) == false))
+            goto compact;
+
+    for (j = b->rx_n; j < rx_batch(b); j++)
+        if (unlikely(rx_prep(w, j) == false))
+            break;
+    b->rx_n = j;
+    return;
+
+compact:
+    // messages [j, used) are empty, move the still-prepared ones down
+    memmove(&b->rx_v[j], &b->rx_v[used], (b->rx_n - used) * sizeof(*b->rx_v));
+    memmove(&b->rx_iov[j], &b->rx_iov[used],
+            (b->rx_n - used) * sizeof(*b->rx_iov));
+    b->rx_n = j + b->rx_n - used;
 }
 
 
-/// Calls recvmsg() or recvmmsg() for all sockets associated with the engine,
-/// emulating the operation of netmap backend_rx() function. Appends all data to
-/// the w_sock::iv socket buffers of the respective w_sock structures.
+/// Calls recvmsg() or recvmmsg() on socket descriptor @p fd until it has no
+/// more data, and appends the received datagrams to @p i.
 ///
-/// @param      s     w_sock for which the application would like to receive new
-///                   data.
+/// @param      w     Backend engine.
+/// @param[in]  fd    The socket descriptor to receive on.
 /// @param      i     w_iov tail queue to append new data to.
 ///
-void w_rx(struct w_sock * const s, struct w_iov_sq * const i)
+static void __attribute__((nonnull))
+rx_msgs(struct w_engine * const w, const int fd, struct w_iov_sq * const i)
 {
-#ifdef HAVE_RECVMMSG
-// There is a tradeoff here in terms of how many messages we should try and
-// receive. Preparing to handle longer sizes has preparation overheads, whereas
-// only handling shorter sizes may require multiple syscalls (and incur their
-// overheads). So we're picking a number out of a hat.
-#define RECV_SIZE MIN(64, IOV_MAX)
-#else
-#define RECV_SIZE 1
-#endif
+    struct w_backend * const b = w->b;
+    if (unlikely(b->rx_n < rx_batch(b)))
+        rx_fill(w, 0);
+
     ssize_t n = 0;
     do {
-        struct w_iov * v[RECV_SIZE];
-        struct iovec msg[RECV_SIZE];
-        struct sockaddr_storage sa[RECV_SIZE];
-        __extension__ uint8_t ctrl[RECV_SIZE][CMSG_SPACE(sizeof(uint8_t)) +
-                                              CMSG_SPACE(sizeof(uint8_t))];
-#ifdef HAVE_RECVMMSG
-        struct mmsghdr msgvec[RECV_SIZE];
-#else
-        struct msghdr msgvec[RECV_SIZE];
-#endif
-        ssize_t nbufs = 0;
-        for (int j = 0; likely(j < RECV_SIZE); j++, nbufs++) {
-            v[j] = w_alloc_iov(s->w, s->ws_af, 0, 0);
-            if (unlikely(v[j] == 0))
-                break;
-            msg[j] =
-                (struct iovec){.iov_base = v[j]->buf, .iov_len = v[j]->len};
-#ifdef HAVE_RECVMMSG
-            msgvec[j].msg_hdr =
-#else
-            msgvec[j] =
-#endif
-                (struct msghdr){.msg_name = &sa[j],
-                                .msg_namelen = sizeof(sa[j]),
-                                .msg_iov = &msg[j],
-                                .msg_iovlen = 1,
-                                .msg_control = &ctrl[j],
-                                .msg_controllen = sizeof(ctrl[j])};
-        }
-        if (unlikely(nbufs == 0)) {
+        if (unlikely(b->rx_n == 0)) {
             warn(CRT, "no more bufs");
             return;
         }
 #if defined(HAVE_RECVMMSG)
-        n = (ssize_t)recvmmsg((int)s->fd, msgvec, (unsigned int)nbufs,
-                              MSG_DONTWAIT, 0);
+        n = (ssize_t)recvmmsg(fd, b->rx_msg, b->rx_n, MSG_DONTWAIT, 0);
 #else
-        n = recvmsg((int)s->fd, msgvec, MSG_DONTWAIT);
+        n = recvmsg(fd, b->rx_msg, MSG_DONTWAIT);
 #endif
         if (likely(n > 0)) {
-            for (int j = 0; likely(j < MIN(n, nbufs)); j++) {
-                v[j]->wv_port = sa_port(&sa[j]);
-                w_to_waddr(&v[j]->wv_addr, (struct sockaddr *)&sa[j]);
-
-#ifdef HAVE_RECVMMSG
-                v[j]->len = (uint16_t)msgvec[j].msg_len;
-#else
-                v[j]->len = (uint16_t)n;
-                // recvmsg returns number of bytes, we need number of
-                // messages for the return loop below
-                n = 1;
-#endif
-
-                // extract TOS byte (Particle uses recvfrom w/o cmsg support)
-#ifdef HAVE_RECVMMSG
-                for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msgvec[j].msg_hdr);
-                     cmsg; cmsg = CMSG_NXTHDR(&msgvec[j].msg_hdr, cmsg)) {
-#else
-                for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msgvec[j]); cmsg;
-                     cmsg = CMSG_NXTHDR(&msgvec[j], cmsg)) {
+#ifndef HAVE_RECVMMSG
+            b->rx_v[0]->len = (uint16_t)n;
+            // recvmsg returns number of bytes, we need number of messages
+            n = 1;
 #endif
-                    if (cmsg->cmsg_level == IPPROTO_IP ||
-                        cmsg->cmsg_level == IPPROTO_IPV6) {
-                        if (cmsg->cmsg_type ==
-#ifdef __linux__
-                                IP_TOS
-#else
-                                IP_RECVTOS
+#ifndef HAVE_SO_TIMESTAMPING
+            // no kernel timestamps, so stamp the whole batch at once
+            const uint64_t now = w_now(CLOCK_REALTIME);
 #endif
-                            || cmsg->cmsg_type == IPV6_TCLASS)
-                            v[j]->flags = *(uint8_t *)CMSG_DATA(cmsg);
-#ifndef PARTICLE
-                        else if (cmsg->cmsg_type ==
-#ifdef __linux__
-                                 IP_TTL
-#else
-                                 IP_RECVTTL
+            for (uint32_t j = 0; likely(j < (uint32_t)n); j++) {
+                struct w_iov * const v = b->rx_v[j];
+                struct msghdr * const hdr = rx_hdr(b, j);
+                v->wv_port = sa_port(&b->rx_sa[j]);
+                w_to_waddr(&v->wv_addr, (struct sockaddr *)&b->rx_sa[j]);
+#ifdef HAVE_RECVMMSG
+                v->len = (uint16_t)b->rx_msg[j].msg_len;
 #endif
-                        )
-                            v[j]->ttl = *(uint8_t *)CMSG_DATA(cmsg);
+                rx_cmsg(hdr, v);
+#ifndef HAVE_SO_TIMESTAMPING
+                v->ts = now;
 #endif
-                    }
-                }
+
+                // undo what the kernel changed in the message
+                hdr->msg_namelen = sizeof(b->rx_sa[j]);
+                hdr->msg_controllen = RX_CTRL_LEN;
+
                 // add the iov to the tail of the result
-                sq_insert_tail(i, v[j], next);
+                sq_insert_tail(i, v, next);
             }
+            rx_fill(w, (uint32_t)n);
         } else {
             if (unlikely(n < 0 && errno != EAGAIN && errno != ETIMEDOUT))
                 warn(ERR, "recvmsg/recvmmsg returned %d (%s)", errno,
                      strerror(errno));
             n = 0;
         }
+    } while (n == (ssize_t)rx_batch(b));
+}
 
-        // return any unused buffers
-        for (ssize_t j = n; likely(j < nbufs); j++)
-            w_free_iov(v[j]);
-    } while (
-#ifdef HAVE_RECVMMSG
-        n == RECV_SIZE
+
+#ifdef SOCK_DEMUX
+/// Receive all data on the shared kernel socket @p ks, and demultiplex it to
+/// the w_sock::iv socket buffers of the w_socks connected to the sender, or
+/// else to the unconnected w_sock bound first.
+///
+/// @param      w     Backend engine.
+/// @param[in]  ks    The w_ksock to receive on.
+///
+static void __attribute__((nonnull))
+demux_rx(struct w_engine * const w, const struct w_ksock * const ks)
+{
+    struct w_backend * const b = w->b;
+    struct w_iov_sq i = w_iov_sq_initializer(i);
+    rx_msgs(w, (int)ks->fd, &i);
+    while (!sq_empty(&i)) {
+        struct w_iov * const v = sq_first(&i);
+        sq_remove_head(&i, next);
+        struct w_sock * const s = flow_find(&b->flows, &ks->local, &v->saddr);
+        if (unlikely(s == 0)) {
+            w_free_iov(v);
+            continue;
+        }
+        sq_insert_tail(&s->iv, v, next);
+        if (s->__ready == false) {
+            s->__ready = true;
+            sl_insert_head(&b->rdy, s, __rdy);
+        }
+    }
+}
+
+
+/// Demultiplex the data of all shared kernel sockets that the last ev_wait()
+/// found readable.
+///
+/// @param      w     Backend engine.
+///
+static void __attribute__((nonnull)) demux_events(struct w_engine * const w)
+{
+    struct w_backend * const b = w->b;
+    for (int i = 0; i < b->n; i++)
+#if defined(HAVE_KQUEUE)
+        demux_rx(w, (struct w_ksock *)b->ev[i].udata);
 #else
-        n == 1
+        demux_rx(w, (struct w_ksock *)b->ev[i].data.ptr);
 #endif
-    );
+    b->n = 0;
 }
+#endif
 
 
-/// The sock backend performs no operation here.
+/// Calls recvmsg() or recvmmsg() for all sockets associated with the engine,
+/// emulating the operation of netmap backend_rx() function. Appends all data to
+/// the w_sock::iv socket buffers of the respective w_sock structures.
 ///
-/// @param[in]  w     Backend engine.
+/// In w_engopt::demux mode, only returns the data that w_nic_rx() or
+/// w_rx_ready() have already demultiplexed to @p s.
 ///
-void w_nic_tx(struct w_engine * const w __attribute__((unused))) {}
+/// @param      s     w_sock for which the application would like to receive new
+///                   data.
+/// @param      i     w_iov tail queue to append new data to.
+///
+static void __attribute__((nonnull))
+rx_sock(struct w_sock * const s, struct w_iov_sq * const i)
+{
+#ifdef SOCK_DEMUX
+    if (s->__ks) {
+        sq_concat(i, &s->iv);
+        if (s->__ready) {
+            s->__ready = false;
+            sl_remove(&s->w->b->rdy, s, w_sock, __rdy);
+        }
+        return;
+    }
+#endif
 
+#ifdef HAVE_UDP_GRO
+    if (s->opt.enable_udp_gro) {
+        rx_gro(s, i);
+        return;
+    }
+#endif
 
-/// Check/wait until any data has been received.
+    rx_msgs(s->w, (int)s->fd, i);
+}
+
+
+/// The socket backend sends in w_tx() already. Here, it only sends w_iovs held
+/// back for pacing that are now due, and processes zero-copy completions, so
+/// that w_iov_in_flight() reflects which sent w_iovs can be reused.
 ///
 /// @param[in]  w     Backend engine.
+///
+void w_nic_tx(struct w_engine * const w)
+{
+    pace_flush(w);
+#ifdef HAVE_MSG_ZEROCOPY
+    struct w_zc * zc;
+    sl_foreach (zc, &w->b->zc, next)
+        zc_reap(w, zc);
+#endif
+}
+
+
+#if defined(HAVE_KQUEUE) || defined(HAVE_EPOLL)
+/// Wait for receive events on the sockets of an engine, and store them in
+/// w_backend::ev.
+///
+/// @param      b     Backend of the engine.
 /// @param[in]  nsec  Timeout in nanoseconds. Pass zero for immediate return, -1
 ///                   for infinite wait.
 ///
-/// @return     Whether any data is ready for reading.
+/// @return     Number of events, or -1 on error.
 ///
-bool w_nic_rx(struct w_engine * const w, const int64_t nsec)
+static int __attribute__((nonnull))
+ev_wait(struct w_backend * const b, const int64_t nsec)
 {
-    struct w_backend * const b = w->b;
-
 #if defined(HAVE_KQUEUE)
     b->n = kevent(b->kq, 0, 0, b->ev, sizeof(b->ev) / sizeof(b->ev[0]),
                   nsec == -1
                       ? 0
                       : &(struct timespec){(uint64_t)nsec / NS_PER_S,
                                            (long)((uint64_t)nsec % NS_PER_S)});
-    return b->n > 0;
+    return b->n;
 
-#elif defined(HAVE_EPOLL)
+#else
+#ifdef HAVE_EPOLL_PWAIT2
+    if (likely(b->pwait2)) {
+        b->n = epoll_pwait2(
+            b->ep, b->ev, sizeof(b->ev) / sizeof(b->ev[0]),
+            nsec == -1 ? 0
+                       : &(struct timespec){(time_t)((uint64_t)nsec / NS_PER_S),
+                                            (long)((uint64_t)nsec % NS_PER_S)},
+            0);
+        return b->n;
+    }
+    // the kernel is too old, fall back to millisecond granularity
+#endif
     b->n = epoll_wait(b->ep, b->ev, sizeof(b->ev) / sizeof(b->ev[0]),
                       nsec == -1 ? -1 : (int)(nsec / NS_PER_MS));
-    return b->n > 0;
+    return b->n;
+#endif
+}
+#endif
+
+
+/// Check/wait until any data has been received. In w_engopt::demux mode, also
+/// demultiplexes the received data to its w_socks, and does not wait while
+/// earlier data has not been retrieved with w_rx() yet.
+///
+/// @param[in]  w     Backend engine.
+/// @param[in]  nsec  Timeout in nanoseconds. Pass zero for immediate return, -1
+///                   for infinite wait.
+///
+/// @return     Whether any data is ready for reading.
+///
+bool w_nic_rx(struct w_engine * const w, const int64_t nsec)
+{
+    struct w_backend * const b = w->b;
+    pool_reclaim(w);
+
+#ifdef SOCK_DEMUX
+    if (w->opt.demux) {
+        ev_wait(b, sl_empty(&b->rdy) ? nsec : 0);
+        demux_events(w);
+        return !sl_empty(&b->rdy);
+    }
+#endif
+
+#if defined(HAVE_KQUEUE) || defined(HAVE_EPOLL)
+    return ev_wait(b, nsec) > 0;
 
 #else
 
@@ -605,6 +2767,25 @@ uint32_t w_rx_ready(struct w_engine * const w, struct w_sock_slist * const sl)
 {
     struct w_backend * const b = w->b;
 
+#ifdef SOCK_DEMUX
+    if (w->opt.demux) {
+        if (sl_empty(&b->rdy)) {
+            ev_wait(b, 0);
+            demux_events(w);
+        }
+
+        uint32_t i = 0;
+        while (!sl_empty(&b->rdy)) {
+            struct w_sock * const s = sl_first(&b->rdy);
+            sl_remove_head(&b->rdy, __rdy);
+            s->__ready = false;
+            sl_insert_head(sl, s, next);
+            i++;
+        }
+        return i;
+    }
+#endif
+
 #if defined(HAVE_KQUEUE)
     if (b->n <= 0)
         b->n = kevent(b->kq, 0, 0, b->ev, sizeof(b->ev) / sizeof(b->ev[0]),
@@ -637,3 +2818,65 @@ uint32_t w_rx_ready(struct w_engine * const w, struct w_sock_slist * const sl)
     return i;
 #endif
 }
+#endif
+
+
+#ifdef POOL_ELASTIC
+/// Move the short datagrams in @p q out of their full-size receive buffers and
+/// into small buffers, and return the full-size buffers to the pool. Stops
+/// early when no small buffers are left.
+///
+/// @param      w     Backend engine.
+/// @param      q     w_iov tail queue of received datagrams.
+///
+static void __attribute__((nonnull))
+pool_compact(struct w_engine * const w, struct w_iov_sq * const q)
+{
+    struct w_iov_sq out = w_iov_sq_initializer(out);
+    while (!sq_empty(q)) {
+        struct w_iov * v = sq_first(q);
+        sq_remove_head(q, next);
+        if (v->len <= SMALL_BUF_LEN && !iov_small(v)) {
+            struct w_iov * const c = pool_alloc(w, true);
+            if (likely(c)) {
+                c->saddr = v->saddr;
+                c->flags = v->flags;
+                c->ttl = v->ttl;
+                c->ts = v->ts;
+                c->hwts = v->hwts;
+                c->user_data = v->user_data;
+                c->len = v->len;
+                memcpy(c->buf, v->buf, v->len);
+                sq_next(v, next) = 0;
+                w_free_iov(v);
+                v = c;
+            }
+        }
+        sq_insert_tail(&out, v, next);
+    }
+    sq_concat(q, &out);
+}
+#endif
+
+
+/// Return the data received on w_sock @p s. Short datagrams are moved into
+/// small buffers first, if w_engopt::rx_compact is set.
+///
+/// @param      s     w_sock for which the application would like to receive new
+///                   data.
+/// @param      i     w_iov tail queue to append new data to.
+///
+void w_rx(struct w_sock * const s, struct w_iov_sq * const i)
+{
+#ifdef POOL_ELASTIC
+    struct w_engine * const w = s->w;
+    if (w->opt.rx_compact && w->b->small_max) {
+        struct w_iov_sq q = w_iov_sq_initializer(q);
+        rx_sock(s, &q);
+        pool_compact(w, &q);
+        sq_concat(i, &q);
+        return;
+    }
+#endif
+    rx_sock(s, i);
+}
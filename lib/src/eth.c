@@ -26,6 +26,7 @@
 // POSSIBILITY OF SUCH DAMAGE.
 
 #include <string.h>
+#include <sys/param.h>
 
 #include <net/netmap_user.h>
 
@@ -35,8 +36,10 @@
 #include "arp.h"
 #include "backend.h"
 #include "eth.h"
+#include "in_cksum.h"
 #include "ip4.h"
 #include "ip6.h"
+#include "udp.h"
 
 
 /// Receive an Ethernet frame. This is the lowest-level RX function, called for
@@ -88,36 +91,186 @@ bool eth_rx(struct w_engine * const w,
 }
 
 
-/// Places an Ethernet frame into a TX ring. The Ethernet frame is contained in
-/// the w_iov @p v, and will be placed into an available slot in a TX ring or -
-/// if all are full - dropped.
+/// Receive up to #RX_BURST Ethernet frames from netmap RX ring @p r in one
+/// burst, and advance the ring past them. Instead of walking each frame through
+/// eth_rx(), ip4_rx()/ip6_rx() and udp_rx() in turn, the frames are processed
+/// stage by stage: prefetch the headers of the whole burst, classify them,
+/// validate and demux the UDP/IP ones, and finally checksum and deliver those
+/// that have a w_sock via udp_deliver(). That way, the cache misses of the
+/// burst overlap, and each stage runs as a tight loop. Frames that are not
+/// plain UDP over IP for one of our w_socks (ARP, ICMP, IPv4 options or
+/// fragments, bad IP headers, unbound ports, etc.) are handed to eth_rx()
+/// afterwards, in their original order.
 ///
-/// @param      v     The w_iov containing the Ethernet frame to transmit.
+/// @param      w     Backend engine.
+/// @param      r     The netmap RX ring to receive from.
 ///
-/// @return     True if the buffer was placed into a TX ring, false otherwise.
+/// @return     Whether a packet was placed into a socket.
 ///
-bool eth_tx(struct w_iov * const v)
+bool
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 8)
+    __attribute__((no_sanitize("alignment")))
+#endif
+    eth_rx_burst(struct w_engine * const w, struct netmap_ring * const r)
 {
-    struct w_backend * const b = v->w->b;
+    struct netmap_slot * s[RX_BURST];
+    uint8_t * buf[RX_BURST];
+    bool fast[RX_BURST];
+    struct w_sock * ws[RX_BURST];
+    const uint32_t n = MIN(RX_BURST, nm_ring_space(r));
+
+    // stage 1: gather the slots of the burst and prefetch their headers
+    for (uint32_t j = 0; j < n; j++) {
+        s[j] = &r->slot[r->cur];
+        buf[j] = (uint8_t *)NETMAP_BUF(r, s[j]->buf_idx);
+        __builtin_prefetch(buf[j]);
+        __builtin_prefetch(buf[j] + 64);
+        r->cur = nm_ring_next(r, r->cur);
+    }
+
+    // stage 2: classify, marking plain UDP/IP frames for the fast path
+    for (uint32_t j = 0; j < n; j++) {
+        const struct eth_hdr * const eth = (void *)buf[j];
+        const uint8_t * const ip = eth_data(buf[j]);
+        fast[j] = false;
+#ifndef FUZZING
+        if (unlikely(memcmp(&eth->dst, &w->mac, sizeof(eth->dst)) != 0))
+            // let eth_rx() deal with broadcast, multicast and strays
+            continue;
+#endif
+        if (eth->type == ETH_TYPE_IP4 && likely(w->have_ip4)) {
+            const struct ip4_hdr * const ip4 = (const void *)ip;
+            if (likely(ip4->vhl == 0x45 && ip4->p == IP_P_UDP &&
+                       (ip4->off & IP4_OFFMASK) == 0 &&
+                       s[j]->len >= sizeof(*eth) + sizeof(*ip4) +
+                                        sizeof(struct udp_hdr)))
+                fast[j] = true;
+        } else if (eth->type == ETH_TYPE_IP6 && likely(w->have_ip6)) {
+            const struct ip6_hdr * const ip6 = (const void *)ip;
+            if (likely(ip_v(ip6->vfc) == 6 && ip6->next_hdr == IP_P_UDP &&
+                       s[j]->len >= sizeof(*eth) + sizeof(*ip6) +
+                                        sizeof(struct udp_hdr)))
+                fast[j] = true;
+        }
+    }
+
+    // stage 3: validate the headers of the fast-path frames and demux them to
+    // their w_socks; anything questionable goes to eth_rx() for diagnosis
+    for (uint32_t j = 0; j < n; j++) {
+        ws[j] = 0;
+        if (fast[j] == false)
+            continue;
+        const uint8_t * const ip = eth_data(buf[j]);
+        const struct udp_hdr * udp;
+        struct w_sockaddr local;
+        struct w_sockaddr remote;
+        if (ip_v(*ip) == 4) {
+            const struct ip4_hdr * const ip4 = (const void *)ip;
+            udp = (const void *)(ip + sizeof(*ip4));
+            if (unlikely(is_my_ip4(w, ip4->dst, true) == UINT16_MAX ||
+                         ip_cksum(ip4, sizeof(*ip4)) != 0 ||
+                         bswap16(ip4->len) < sizeof(*ip4) + sizeof(*udp))) {
+                fast[j] = false;
+                continue;
+            }
+            local.addr.af = remote.addr.af = AF_INET;
+            remote.addr.ip4 = ip4->src;
+            local.addr.ip4 = ip4->dst;
+        } else {
+            const struct ip6_hdr * const ip6 = (const void *)ip;
+            udp = (const void *)(ip + sizeof(*ip6));
+            if (unlikely(is_my_ip6(w, ip6->dst, true) == UINT16_MAX ||
+                         bswap16(ip6->len) < sizeof(*udp))) {
+                fast[j] = false;
+                continue;
+            }
+            local.addr.af = remote.addr.af = AF_INET6;
+            memcpy(remote.addr.ip6, ip6->src, sizeof(remote.addr.ip6));
+            memcpy(local.addr.ip6, ip6->dst, sizeof(local.addr.ip6));
+        }
+        remote.port = udp->sport;
+        local.port = udp->dport;
+        ws[j] = flow_find(&w->b->flows, &local, &remote);
+        if (unlikely(ws[j] == 0))
+            // let udp_rx() decide about an ICMP unreachable
+            fast[j] = false;
+    }
+
+    // stage 4: checksum the payloads of the demuxed frames and deliver them
+    bool rx = false;
+    for (uint32_t j = 0; j < n; j++) {
+        if (ws[j] == 0)
+            continue;
+        const uint8_t * const ip = eth_data(buf[j]);
+        uint16_t ip_hdr_len;
+        uint16_t ip_plen;
+        if (ip_v(*ip) == 4) {
+            ip_hdr_len = sizeof(struct ip4_hdr);
+            ip_plen = bswap16(((const struct ip4_hdr *)(const void *)ip)->len) -
+                      ip_hdr_len;
+        } else {
+            ip_hdr_len = sizeof(struct ip6_hdr);
+            ip_plen = bswap16(((const struct ip6_hdr *)(const void *)ip)->len);
+        }
+        const struct udp_hdr * const udp = (const void *)(ip + ip_hdr_len);
+        if (likely(udp->cksum) &&
+            unlikely(payload_cksum(ip, MIN(bswap16(udp->len), ip_plen) +
+                                           ip_hdr_len) != 0)) {
+            warn(WRN, "invalid UDP checksum, received 0x%04x",
+                 bswap16(udp->cksum));
+            continue;
+        }
+        // a failed delivery has already been logged; don't retry it
+        rx = udp_deliver(w, s[j], buf[j], ws[j]) || rx;
+    }
+
+    // stage 5: everything else takes the per-packet path
+    for (uint32_t j = 0; j < n; j++)
+        if (fast[j] == false)
+            rx = eth_rx(w, s[j], buf[j]) || rx;
 
-    // find a tx ring with space
-    struct netmap_ring * txr = 0;
-    uint32_t r = 0;
-    for (; likely(r < b->nif->ni_tx_rings); r++) {
-        txr = NETMAP_TXRING(b->nif, b->cur_txr);
+    r->head = r->cur;
+    return rx;
+}
+
+
+/// Find a TX ring with space, starting with the one currently active.
+///
+/// @param      b     Backend.
+///
+/// @return     A TX ring with at least one free slot, or zero if all are full.
+///
+static struct netmap_ring * __attribute__((nonnull))
+tx_ring(struct w_backend * const b)
+{
+    for (uint32_t r = 0; likely(r < b->nif->ni_tx_rings); r++) {
+        struct netmap_ring * const txr = NETMAP_TXRING(b->nif, b->cur_txr);
         if (likely(!nm_ring_empty(txr)))
             // we have space in this ring
-            break;
+            return txr;
 
         warn(INF, "tx ring %u full; moving to next", b->cur_txr);
         b->cur_txr = (b->cur_txr + 1) % b->nif->ni_tx_rings;
     }
+    warn(NTE, "all tx rings are full");
+    return 0;
+}
+
 
-    // return false if all rings are full
-    if (unlikely(r == b->nif->ni_tx_rings)) {
-        warn(NTE, "all tx rings are full");
+/// Places an Ethernet frame into a TX ring. The Ethernet frame is contained in
+/// the w_iov @p v, and will be placed into an available slot in a TX ring or -
+/// if all are full - dropped.
+///
+/// @param      v     The w_iov containing the Ethernet frame to transmit.
+///
+/// @return     True if the buffer was placed into a TX ring, false otherwise.
+///
+bool eth_tx(struct w_iov * const v)
+{
+    struct w_backend * const b = v->w->b;
+    struct netmap_ring * const txr = tx_ring(b);
+    if (unlikely(txr == 0))
         return false;
-    }
 
     struct netmap_slot * const s = &txr->slot[txr->cur];
     b->slot_buf[txr->ringid][txr->cur] = v;
@@ -162,18 +315,31 @@ bool eth_tx(struct w_iov * const v)
 }
 
 
-/// Wait until @p v has been transmitted, and return free it.
+/// Places an Ethernet frame contained in the engine-owned w_iov @p v into a TX
+/// ring by copying it into the buffer of a free slot, and returns @p v to the
+/// engine right away. The frame leaves with the next w_nic_tx(), together with
+/// the application data. Used for ARP and ICMP messages and for frames that
+/// were held back for neighbor resolution, which are all small or rare enough
+/// that copying beats tracking their buffers through the TX rings.
 ///
 /// @param      v     The w_iov containing the Ethernet frame to transmit.
 ///
-void eth_tx_and_free(struct w_iov * const v)
+/// @return     True if the frame was placed into a TX ring, false otherwise.
+///
+bool eth_tx_ctl(struct w_iov * const v)
 {
-    // send the packet, and make sure it went out before returning
-    const uint32_t orig_idx = v->idx;
-    eth_tx(v);
-    do {
-        w_nanosleep(100 * NS_PER_US);
-        w_nic_tx(v->w);
-    } while (v->idx != orig_idx);
-    sq_insert_head(&v->w->iov, v, next);
+    struct w_backend * const b = v->w->b;
+    struct netmap_ring * const txr = tx_ring(b);
+    if (likely(txr)) {
+        struct netmap_slot * const s = &txr->slot[txr->cur];
+        // the slot keeps its buffer, so w_nic_tx() has nothing to return
+        b->slot_buf[txr->ringid][txr->cur] = 0;
+        s->len = v->len + sizeof(struct eth_hdr);
+        memcpy(NETMAP_BUF(txr, s->buf_idx), v->base, s->len);
+        txr->head = txr->cur = nm_ring_next(txr, txr->cur);
+    } else
+        rwarn(WRN, 10, "dropping control frame");
+
+    w_free_iov(v);
+    return txr != 0;
 }
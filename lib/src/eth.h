@@ -29,6 +29,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/socket.h>
 
 #include <warpcore/warpcore.h>
@@ -80,32 +81,39 @@ extern bool __attribute__((nonnull)) eth_rx(struct w_engine * const w,
                                             struct netmap_slot * const s,
                                             uint8_t * const buf);
 
+#define RX_BURST 32 ///< Maximum number of frames eth_rx_burst() handles at once.
+
+extern bool __attribute__((nonnull))
+eth_rx_burst(struct w_engine * const w, struct netmap_ring * const r);
+
 extern bool __attribute__((nonnull)) eth_tx(struct w_iov * const v);
 
-extern void __attribute__((nonnull)) eth_tx_and_free(struct w_iov * const v);
+extern bool __attribute__((nonnull)) eth_tx_ctl(struct w_iov * const v);
 
 
-static inline void __attribute__((nonnull))
+/// Fill in the Ethernet header of the frame in @p v for transmission over
+/// w_sock @p s. The destination MAC address is w_sock::dmac for a connected
+/// w_sock, and looked up for w_iov::saddr otherwise.
+///
+/// @param[in]  s     The w_sock to transmit over.
+/// @param      v     The w_iov to transmit.
+///
+/// @return     True if the destination MAC address is known, false if neighbor
+///             resolution is (still) in progress.
+///
+static inline bool __attribute__((nonnull))
 mk_eth_hdr(const struct w_sock * const s, struct w_iov * const v)
 {
-    struct eth_hdr * const eth = (void *)v->base;
+    struct eth_hdr * const eth = (struct eth_hdr *)(void *)v->base;
+    eth->src = v->w->mac;
+    eth->type = s->ws_af == AF_INET ? ETH_TYPE_IP4 : ETH_TYPE_IP6;
 
-    if (w_connected(s))
+    if (w_connected(s)) {
+        // a connected w_sock has a template once its peer is resolved
         eth->dst = s->dmac;
-    else {
-        static struct w_addr last_addr = {0};
-        static struct eth_addr last_mac = {{0}};
-
-        if (likely(w_addr_cmp(&last_addr, &v->wv_addr)))
-            eth->dst = last_mac;
-        else {
-            last_addr = v->wv_addr;
-            eth->dst = last_mac = who_has(s->w, &v->wv_addr);
-        }
+        return s->__tmpl != 0;
     }
-
-    eth->src = v->w->mac;
-    eth->type = s->ws_af == AF_INET ? ETH_TYPE_IP4 : ETH_TYPE_IP6;
+    return who_has(s->w, &v->wv_addr, &eth->dst);
 }
 
 #endif
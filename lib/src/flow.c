@@ -0,0 +1,332 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2014-2022, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <warpcore/warpcore.h>
+
+#include "flow.h"
+
+
+#define FLOW_EMPTY 0x80 ///< Control tag of a never-used slot.
+#define FLOW_DEAD 0xfe  ///< Control tag of a deleted slot.
+
+
+// wyhash constants
+#define K0 0xa0761d6478bd642f
+#define K1 0xe7037ed1a0b428db
+#define K2 0x8ebc6af09c88c6e3
+#define K3 0x589965cc75374cc3
+
+
+static inline uint64_t
+#if defined(__clang__)
+    __attribute__((no_sanitize("unsigned-integer-overflow")))
+#endif
+    mum(const uint64_t a, const uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+    const __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    return (a * b) ^ div_mulhi64(a, b);
+#endif
+}
+
+
+static inline void __attribute__((nonnull))
+addr_words(const struct w_addr * const a, uint64_t * const w)
+{
+    if (a->af == AF_INET)
+        w[0] = a->ip4;
+    else if (a->af == AF_INET6)
+        memcpy(w, a->ip6, sizeof(a->ip6));
+}
+
+
+/// Hash a w_socktuple, wyhash-style. Only the fields w_socktuple_cmp()
+/// compares are hashed, i.e., both address families, addresses and ports.
+///
+/// @param[in]  tup   The w_socktuple to hash.
+///
+/// @return     64-bit hash value.
+///
+uint64_t flow_hash(const struct w_socktuple * const tup)
+{
+    uint64_t w[4] = {0};
+    addr_words(&tup->local.addr, &w[0]);
+    addr_words(&tup->remote.addr, &w[2]);
+    const uint64_t p =
+        (uint64_t)tup->local.port << 48 | (uint64_t)tup->remote.port << 32 |
+        (uint64_t)tup->local.addr.af << 16 | tup->remote.addr.af;
+
+    uint64_t h = mum(w[0] ^ K0, w[1] ^ K1);
+    h = mum(w[2] ^ K2, w[3] ^ h);
+    return mum(p ^ K3, h ^ K1);
+}
+
+
+/// Compare the control tags of group @p g against @p tag.
+///
+/// @param[in]  g     The first control tag of a group.
+/// @param[in]  tag   The tag to look for.
+///
+/// @return     Bitmask of the matching slots in the group.
+///
+static inline uint32_t __attribute__((nonnull))
+grp_match(const uint8_t * const g, const uint8_t tag)
+{
+#if defined(__SSE2__)
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(const void *)g),
+                       _mm_set1_epi8((char)tag)));
+#else
+    uint32_t m = 0;
+    for (uint32_t i = 0; i < FLOW_GRP; i++)
+        m |= (uint32_t)(g[i] == tag) << i;
+    return m;
+#endif
+}
+
+
+#define h_grp(f, h) ((uint32_t)(h) & ((f)->grps - 1))
+#define h_tag(h) ((uint8_t)((h) >> 57))
+
+// triangular probing visits every group of a power-of-two table exactly once
+#define grp_next(f, g, i) (((g) + (i)) & ((f)->grps - 1))
+
+
+/// Find the slot holding @p tup.
+///
+/// @param[in]  f     The flow table.
+/// @param[in]  tup   The w_socktuple to look for.
+/// @param[in]  h     The flow_hash() of @p tup.
+///
+/// @return     Slot index, or UINT32_MAX if @p tup is not in @p f.
+///
+static uint32_t __attribute__((nonnull))
+slot_get(const struct w_flows * const f,
+         const struct w_socktuple * const tup,
+         const uint64_t h)
+{
+    if (unlikely(f->grps == 0))
+        return UINT32_MAX;
+
+    const uint8_t tag = h_tag(h);
+    uint32_t g = h_grp(f, h);
+    for (uint32_t i = 1; i <= f->grps; g = grp_next(f, g, i++)) {
+        const uint8_t * const t = &f->tag[g * FLOW_GRP];
+        for (uint32_t m = grp_match(t, tag); m; m &= m - 1) {
+            const uint32_t slot = g * FLOW_GRP + (uint32_t)__builtin_ctz(m);
+            if (likely(w_socktuple_cmp(&f->sock[slot]->tup, tup)))
+                return slot;
+        }
+        if (likely(grp_match(t, FLOW_EMPTY)))
+            break;
+    }
+    return UINT32_MAX;
+}
+
+
+/// Place @p s into the first free slot along its probe sequence. The caller
+/// must make sure that @p f has space.
+///
+/// @param      f     The flow table.
+/// @param      s     The w_sock to insert.
+/// @param[in]  h     The flow_hash() of the w_socktuple of @p s.
+///
+static void __attribute__((nonnull))
+slot_put(struct w_flows * const f, struct w_sock * const s, const uint64_t h)
+{
+    uint32_t g = h_grp(f, h);
+    for (uint32_t i = 1;; g = grp_next(f, g, i++)) {
+        uint8_t * const t = &f->tag[g * FLOW_GRP];
+        const uint32_t m = grp_match(t, FLOW_EMPTY) | grp_match(t, FLOW_DEAD);
+        if (m) {
+            const uint32_t slot = g * FLOW_GRP + (uint32_t)__builtin_ctz(m);
+            if (f->tag[slot] == FLOW_DEAD)
+                f->dead--;
+            f->tag[slot] = h_tag(h);
+            f->sock[slot] = s;
+            f->used++;
+            return;
+        }
+    }
+}
+
+
+/// Rehash @p f into @p grps groups, dropping all deleted slots.
+///
+/// @param      f     The flow table.
+/// @param[in]  grps  The new number of groups. Must be a power of two.
+///
+static void __attribute__((nonnull))
+resize(struct w_flows * const f, const uint32_t grps)
+{
+    struct w_flows n = {.grps = grps};
+    ensure((n.tag = malloc(grps * FLOW_GRP)) != 0,
+           "cannot allocate flow tags");
+    ensure((n.sock = calloc(grps * FLOW_GRP, sizeof(*n.sock))) != 0,
+           "cannot allocate flow slots");
+    memset(n.tag, FLOW_EMPTY, grps * FLOW_GRP);
+
+    for (uint32_t slot = 0; slot < f->grps * FLOW_GRP; slot++)
+        if (f->tag[slot] < FLOW_EMPTY)
+            slot_put(&n, f->sock[slot], flow_hash(&f->sock[slot]->tup));
+
+    flow_free(f);
+    *f = n;
+}
+
+
+/// Insert w_sock @p s into flow table @p f, keyed by w_sock::tup.
+///
+/// @param      f     The flow table.
+/// @param      s     The w_sock to insert.
+///
+/// @return     True if @p s was inserted, false if its w_socktuple already was
+///             in @p f.
+///
+bool flow_ins(struct w_flows * const f, struct w_sock * const s)
+{
+    const uint64_t h = flow_hash(&s->tup);
+    if (unlikely(slot_get(f, &s->tup, h) != UINT32_MAX))
+        return false;
+
+    // keep the table at most 7/8 full, counting deleted slots
+    const uint32_t slots = f->grps * FLOW_GRP;
+    if (unlikely((f->used + f->dead + 1) * 8 > slots * 7)) {
+        // grow if more than half would be in use, otherwise just clean up
+        uint32_t grps = f->grps ? f->grps : 1;
+        while ((f->used + 1) * 2 > grps * FLOW_GRP)
+            grps <<= 1;
+        resize(f, grps);
+    }
+
+    slot_put(f, s, h);
+    f->last_ok = false;
+    return true;
+}
+
+
+/// Remove w_sock @p s from flow table @p f, if it is the one stored for its
+/// w_socktuple.
+///
+/// @param      f     The flow table.
+/// @param[in]  s     The w_sock to remove.
+///
+/// @return     True if @p s was removed, false otherwise.
+///
+bool flow_rem(struct w_flows * const f, const struct w_sock * const s)
+{
+    const uint32_t slot = slot_get(f, &s->tup, flow_hash(&s->tup));
+    if (slot == UINT32_MAX || f->sock[slot] != s)
+        return false;
+
+    // a group with an empty slot ends every probe sequence passing through it,
+    // so a slot in such a group can become empty again
+    const uint32_t g = slot / FLOW_GRP;
+    if (grp_match(&f->tag[g * FLOW_GRP], FLOW_EMPTY))
+        f->tag[slot] = FLOW_EMPTY;
+    else {
+        f->tag[slot] = FLOW_DEAD;
+        f->dead++;
+    }
+    f->sock[slot] = 0;
+    f->used--;
+    f->last_ok = false;
+    return true;
+}
+
+
+/// Get the w_sock stored for w_socktuple @p tup in flow table @p f.
+///
+/// @param[in]  f     The flow table.
+/// @param[in]  tup   The w_socktuple to look up.
+///
+/// @return     The w_sock for @p tup, or zero.
+///
+struct w_sock * flow_get(const struct w_flows * const f,
+                         const struct w_socktuple * const tup)
+{
+    const uint32_t slot = slot_get(f, tup, flow_hash(tup));
+    return slot == UINT32_MAX ? 0 : f->sock[slot];
+}
+
+
+/// Find the w_sock that an inbound packet from @p remote to @p local should be
+/// delivered to. That is the w_sock connected to @p remote, or else the one
+/// only bound to @p local. Bursts of packets of the same flow are answered
+/// from a one-entry cache, which any change to @p f invalidates.
+///
+/// @param      f       The flow table.
+/// @param[in]  local   The local IP address and port.
+/// @param[in]  remote  The remote IP address and port. Can be zero.
+///
+/// @return     The w_sock to deliver to, or zero.
+///
+struct w_sock * flow_find(struct w_flows * const f,
+                          const struct w_sockaddr * const local,
+                          const struct w_sockaddr * const remote)
+{
+    struct w_socktuple tup = {.local = *local};
+    if (remote)
+        tup.remote = *remote;
+    if (likely(f->last_ok && w_socktuple_cmp(&f->last, &tup)))
+        return f->last_s;
+
+    struct w_sock * s = flow_get(f, &tup);
+    if (s == 0 && remote) {
+        // no socket connected, check for bound-only socket
+        struct w_socktuple bound = {.local = *local};
+        s = flow_get(f, &bound);
+    }
+
+    f->last = tup;
+    f->last_s = s;
+    f->last_ok = true;
+    return s;
+}
+
+
+/// Free the memory held by flow table @p f, which becomes empty.
+///
+/// @param      f     The flow table.
+///
+void flow_free(struct w_flows * const f)
+{
+    free(f->tag);
+    free(f->sock);
+    *f = (struct w_flows){0};
+}
@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2014-2022, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <warpcore/warpcore.h>
+
+
+/// Number of slots whose tags are compared at once during a flow table probe.
+#define FLOW_GRP 16
+
+
+/// An open-addressing hash table mapping w_socktuple four-tuples (or bound-only
+/// two-tuples) to the w_sock bound to them. Each slot has a one-byte control
+/// tag, which holds seven bits of the hash for a used slot, and the tags of a
+/// group of FLOW_GRP slots are compared in one go. A zero-initialized struct
+/// is an empty table.
+///
+struct w_flows {
+    uint8_t * tag;         ///< Control tags, one per slot.
+    struct w_sock ** sock; ///< w_socks, one per slot.
+    uint32_t grps;         ///< Number of groups (a power of two) or zero.
+    uint32_t used;         ///< Number of slots holding a w_sock.
+    uint32_t dead;         ///< Number of deleted slots.
+
+    /// The tuple of the last flow_find() call, valid if @p last_ok.
+    struct w_socktuple last;
+    struct w_sock * last_s; ///< The result of the last flow_find() call.
+    bool last_ok;           ///< Whether @p last and @p last_s are valid.
+    /// @cond
+    uint8_t _unused[7]; ///< @internal Padding.
+                        /// @endcond
+};
+
+
+extern uint64_t __attribute__((nonnull))
+flow_hash(const struct w_socktuple * const tup);
+
+extern bool __attribute__((nonnull))
+flow_ins(struct w_flows * const f, struct w_sock * const s);
+
+extern bool __attribute__((nonnull))
+flow_rem(struct w_flows * const f, const struct w_sock * const s);
+
+extern struct w_sock * __attribute__((nonnull))
+flow_get(const struct w_flows * const f, const struct w_socktuple * const tup);
+
+extern struct w_sock * __attribute__((nonnull(1, 2)))
+flow_find(struct w_flows * const f,
+          const struct w_sockaddr * const local,
+          const struct w_sockaddr * const remote);
+
+extern void __attribute__((nonnull)) flow_free(struct w_flows * const f);
@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2014-2022, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <warpcore/warpcore.h>
+
+
+/// Classes of generated ICMPv4 and ICMPv6 messages, each with its own rate
+/// limit. Neighbor advertisements are not limited, since address resolution
+/// depends on them.
+///
+enum icmp_class {
+    ICMP_ECHO,    ///< Echo replies.
+    ICMP_UNREACH, ///< Destination (port or protocol) unreachable errors.
+    ICMP_CLASSES, ///< Number of classes.
+};
+
+#define ICMP_ECHO_RATE 1000   ///< Echo replies per second.
+#define ICMP_ECHO_BURST 50    ///< Echo replies sent back-to-back.
+#define ICMP_UNREACH_RATE 100 ///< Unreachable errors per second.
+#define ICMP_UNREACH_BURST 10 ///< Unreachable errors sent back-to-back.
+
+
+/// Per-engine ICMP rate limiter, one token bucket per icmp_class. The buckets
+/// are kept in their GCRA form, i.e., as the time at which a bucket will be
+/// full again. A zero-initialized struct has full buckets.
+///
+struct w_icmp_limit {
+    uint64_t tat[ICMP_CLASSES];   ///< Theoretical arrival time of next message.
+    uint64_t drops[ICMP_CLASSES]; ///< Messages not sent due to the limit.
+};
+
+
+/// Check whether the rate limit for ICMP messages of class @p c allows sending
+/// another one now, and take a token from the bucket if so. Otherwise, count
+/// the message as dropped.
+///
+/// @param      l     The ICMP rate limiter of the engine.
+/// @param[in]  c     The class of the ICMP message to be sent.
+///
+/// @return     True if the message may be sent, false otherwise.
+///
+static inline bool __attribute__((nonnull))
+icmp_allow(struct w_icmp_limit * const l, const enum icmp_class c)
+{
+    static const uint64_t ival[ICMP_CLASSES] = {NS_PER_S / ICMP_ECHO_RATE,
+                                                NS_PER_S / ICMP_UNREACH_RATE};
+    static const uint64_t burst[ICMP_CLASSES] = {ICMP_ECHO_BURST,
+                                                 ICMP_UNREACH_BURST};
+
+    const uint64_t now = w_now(CLOCK_MONOTONIC);
+    const uint64_t tat = l->tat[c] > now ? l->tat[c] : now;
+    if (unlikely(tat - now > (burst[c] - 1) * ival[c])) {
+        l->drops[c]++;
+        return false;
+    }
+    l->tat[c] = tat + ival[c];
+    return true;
+}
@@ -36,6 +36,7 @@
 
 #include "backend.h"
 #include "eth.h"
+#include "icmp.h"
 #include "icmp4.h"
 #include "in_cksum.h"
 #include "ip4.h"
@@ -46,7 +47,9 @@
 
 
 /// Make an ICMPv4 message with the given @p type and @p code based on the
-/// received packet in @p buf.
+/// received packet in @p buf, unless that exceeds the rate limit for its
+/// icmp_class. The message is queued in a TX ring and goes out with the next
+/// w_nic_tx().
 ///
 /// @param      w     Backend engine.
 /// @param[in]  type  The ICMPv4 type to send.
@@ -62,6 +65,14 @@ void
              const uint8_t code,
              uint8_t * const buf)
 {
+    if (unlikely(icmp_allow(&w->b->icmp, type == ICMP4_TYPE_ECHOREPLY
+                                             ? ICMP_ECHO
+                                             : ICMP_UNREACH) == false)) {
+        rwarn(INF, 10, "rate limit; ICMPv4 not sent (type %d, code %d)", type,
+              code);
+        return;
+    }
+
     struct w_iov * const v = w_alloc_iov_base(w);
     if (unlikely(v == 0)) {
         warn(CRT, "no more bufs; ICMPv4 not sent (type %d, code %d)", type,
@@ -125,7 +136,7 @@ void
     dst_eth->src = w->mac;
     dst_eth->type = ETH_TYPE_IP4;
 
-    eth_tx_and_free(v);
+    eth_tx_ctl(v);
 }
 
 
@@ -41,6 +41,7 @@
 
 #include "backend.h"
 #include "eth.h"
+#include "icmp.h"
 #include "icmp6.h"
 #include "in_cksum.h"
 #include "ip4.h"
@@ -125,12 +126,14 @@ void
     eth->dst.addr[4] = addr[14];
     eth->dst.addr[5] = addr[15];
 
-    eth_tx_and_free(v);
+    eth_tx_ctl(v);
 }
 
 
 /// Make an ICMPv6 message with the given @p type and @p code based on the
-/// received packet in @p buf.
+/// received packet in @p buf, unless that exceeds the rate limit for its
+/// icmp_class (neighbor advertisements are never limited). The message is
+/// queued in a TX ring and goes out with the next w_nic_tx().
 ///
 /// @param      w     Backend engine.
 /// @param[in]  type  The ICMPv6 type to send.
@@ -146,6 +149,15 @@ void
              const uint8_t code,
              uint8_t * const buf)
 {
+    if (unlikely(type != ICMP6_TYPE_NADV &&
+                 icmp_allow(&w->b->icmp, type == ICMP6_TYPE_ECHOREPLY
+                                             ? ICMP_ECHO
+                                             : ICMP_UNREACH) == false)) {
+        rwarn(INF, 10, "rate limit; ICMPv6 not sent (type %d, code %d)", type,
+              code);
+        return;
+    }
+
     struct w_iov * const v = w_alloc_iov_base(w);
     if (unlikely(v == 0)) {
         warn(CRT, "no more bufs; ICMPv6 not sent (type %d, code %d)", type,
@@ -227,7 +239,7 @@ void
     struct eth_hdr * const dst_eth = (void *)v->base;
     dst_eth->dst = sla ? *sla : src_eth->src;
 
-    eth_tx_and_free(v);
+    eth_tx_ctl(v);
 }
 
 
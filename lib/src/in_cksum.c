@@ -51,14 +51,17 @@
  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 *******************************************************************************/
 
-// #define CHECKSUM_SSE
+#if defined(__x86_64__) || defined(__i386__)
+#define CKSUM_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define CKSUM_NEON
+#include <arm_neon.h>
+#endif
 
-#ifdef CHECKSUM_SSE
-#include <emmintrin.h>
-#include <smmintrin.h>
+#include <stdbool.h>
 #include <stdint.h>
-#include <tmmintrin.h>
-#endif
+#include <string.h>
 
 #ifdef __FreeBSD__
 #include <sys/socket.h>
@@ -80,7 +83,16 @@ csum_oc16_reduce(uint32_t sum)
 }
 
 
-#ifdef CKSUM_UPDATE
+/// Incrementally update the Internet checksum @p old_check of a header in
+/// which the 32-bit word @p old_data changed to @p new_data. See
+/// [RFC1624](https://tools.ietf.org/html/rfc1624).
+///
+/// @param[in]  old_check  The old checksum.
+/// @param[in]  old_data   The old data.
+/// @param[in]  new_data   The new data.
+///
+/// @return     The updated checksum.
+///
 uint16_t
 ip_cksum_update32(uint16_t old_check, uint32_t old_data, uint32_t new_data)
 {
@@ -93,234 +105,385 @@ ip_cksum_update32(uint16_t old_check, uint32_t old_data, uint32_t new_data)
 }
 
 
+/// Incrementally update the Internet checksum @p old_check of a header in
+/// which the 16-bit word @p old_data changed to @p new_data. See
+/// [RFC1624](https://tools.ietf.org/html/rfc1624).
+///
+/// @param[in]  old_check  The old checksum.
+/// @param[in]  old_data   The old data.
+/// @param[in]  new_data   The new data.
+///
+/// @return     The updated checksum.
+///
 uint16_t
 ip_cksum_update16(uint16_t old_check, uint16_t old_data, uint16_t new_data)
 {
     old_check = ~old_check;
     old_data = ~old_data;
-    const uint32_t l = (uint32_t)(old_check + ~old_data + new_data);
+    const uint32_t l = (uint32_t)old_check + old_data + new_data;
     return csum_oc16_reduce(l);
 }
-#endif
 
 
-static inline uint32_t __attribute__((always_inline))
-csum_oc16(const uint8_t * const restrict data, const uint32_t data_len)
+static uint32_t csum_oc16_scalar(const uint8_t * const restrict data,
+                                 const uint32_t data_len,
+                                 uint8_t * const restrict dst)
 {
-    const uint16_t * restrict data16 = (const uint16_t *)(const void *)data;
     uint32_t sum = 0;
 
-    for (uint64_t n = 0; n < data_len / sizeof(uint16_t); n++)
-        sum += (uint32_t)data16[n];
+    for (uint32_t n = 0; n < data_len / sizeof(uint16_t); n++) {
+        uint16_t w;
+        memcpy(&w, &data[n * sizeof(w)], sizeof(w));
+        if (dst)
+            memcpy(&dst[n * sizeof(w)], &w, sizeof(w));
+        sum += (uint32_t)w;
+    }
 
-    if (data_len & 1)
+    if (data_len & 1) {
+        if (dst)
+            dst[data_len - 1] = data[data_len - 1];
         sum += (uint32_t)data[data_len - 1];
+    }
 
     return sum;
 }
 
 
-#ifndef CHECKSUM_SSE
-
-/// Compute the Internet checksum over buffer @p buf of length @p len. See
-/// [RFC1071](https://tools.ietf.org/html/rfc1071).
+#if defined(CKSUM_X86) || defined(CKSUM_NEON)
+/// Fold the 32-bit lane sums @p lane of a vector checksum implementation into
+/// a partial sum that can be combined with that of csum_oc16_scalar().
 ///
-/// @param[in]  buf   The buffer
-/// @param[in]  len   The length
+/// @param[in]  lane  The lane sums.
+/// @param[in]  n     The number of lanes.
 ///
-/// @return     Internet checksum of @p buf.
+/// @return     Partial checksum.
 ///
-uint16_t ip_cksum(const void * const buf, const uint16_t len)
+static inline uint32_t __attribute__((always_inline))
+csum_fold_lanes(const uint32_t * const lane, const uint32_t n)
 {
-    const uint32_t sum = csum_oc16(buf, len);
-    return csum_oc16_reduce(sum);
+    uint64_t sum = 0;
+    for (uint32_t l = 0; l < n; l++)
+        sum += lane[l];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint32_t)sum;
 }
+#endif
 
 
-uint16_t payload_cksum(const void * const buf, const uint16_t len)
-{
-    const uint8_t v = ip_v(*(const uint8_t *)buf);
-    uint16_t ip_hdr_len;
-    uint32_t sum;
+// The checksum implementations sum @p data_len bytes at @p data and, if @p dst
+// is non-zero, copy them to @p dst in the same pass. The vector variants split
+// each 32-bit lane into its two 16-bit words and add them into 32-bit lane
+// sums. Because the inputs are at most 64 KB, the lane sums cannot overflow.
+// Any tail shorter than a vector is handled by csum_oc16_scalar().
 
-    if (v == 4) {
-        const struct ip4_hdr * const ip = buf;
-        ip_hdr_len = ip4_hl(*(const uint8_t *)buf);
-        sum = (uint32_t)ip->p << 8;
-        sum += csum_oc16((const uint8_t *)&ip->src, sizeof(ip->src));
-        sum += csum_oc16((const uint8_t *)&ip->dst, sizeof(ip->dst));
-        const uint16_t plen = bswap16(bswap16(ip->len) - ip_hdr_len);
-        sum += csum_oc16((const uint8_t *)&plen, sizeof(plen));
-    } else {
-        const struct ip6_hdr * const ip = buf;
-        ip_hdr_len = sizeof(*ip);
-        sum = (uint32_t)ip->next_hdr << 24;
-        sum += csum_oc16((const uint8_t *)&ip->src, sizeof(ip->src));
-        sum += csum_oc16((const uint8_t *)&ip->dst, sizeof(ip->dst));
-        sum += csum_oc16((const uint8_t *)&ip->len, sizeof(ip->len));
+#ifdef CKSUM_X86
+static uint32_t __attribute__((target("sse2")))
+csum_oc16_sse2(const uint8_t * const restrict data,
+               const uint32_t data_len,
+               uint8_t * const restrict dst)
+{
+    const __m128i mask = _mm_set1_epi32(0xffff);
+    __m128i sum = _mm_setzero_si128();
+    uint32_t n = 0;
+    for (; n + sizeof(sum) <= data_len; n += sizeof(sum)) {
+        const __m128i d = _mm_loadu_si128((const void *)&data[n]);
+        if (dst)
+            _mm_storeu_si128((void *)&dst[n], d);
+        sum = _mm_add_epi32(sum, _mm_and_si128(d, mask));
+        sum = _mm_add_epi32(sum, _mm_srli_epi32(d, 16));
     }
 
-    // payload
-    sum += csum_oc16((const uint8_t *)buf + ip_hdr_len, len - ip_hdr_len);
-
-    return csum_oc16_reduce(sum);
+    uint32_t lane[sizeof(sum) / sizeof(uint32_t)];
+    _mm_storeu_si128((void *)lane, sum);
+    return csum_fold_lanes(lane, sizeof(lane) / sizeof(lane[0])) +
+           csum_oc16_scalar(&data[n], data_len - n, dst ? &dst[n] : 0);
 }
 
-#else
 
-#define DECLARE_ALIGNED(_declaration, _boundary)                               \
-    _declaration __attribute__((aligned(_boundary)))
+static uint32_t __attribute__((target("avx2")))
+csum_oc16_avx2(const uint8_t * const restrict data,
+               const uint32_t data_len,
+               uint8_t * const restrict dst)
+{
+    const __m256i mask = _mm256_set1_epi32(0xffff);
+    __m256i sum = _mm256_setzero_si256();
+    uint32_t n = 0;
+    for (; n + sizeof(sum) <= data_len; n += sizeof(sum)) {
+        const __m256i d = _mm256_loadu_si256((const void *)&data[n]);
+        if (dst)
+            _mm256_storeu_si256((void *)&dst[n], d);
+        sum = _mm256_add_epi32(sum, _mm256_and_si256(d, mask));
+        sum = _mm256_add_epi32(sum, _mm256_srli_epi32(d, 16));
+    }
 
-static const DECLARE_ALIGNED(uint8_t crc_xmm_shift_tab[48], 16) = {
-    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-    0xff, 0xff, 0xff, 0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff,
-    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    uint32_t lane[sizeof(sum) / sizeof(uint32_t)];
+    _mm256_storeu_si256((void *)lane, sum);
+    return csum_fold_lanes(lane, sizeof(lane) / sizeof(lane[0])) +
+           csum_oc16_scalar(&data[n], data_len - n, dst ? &dst[n] : 0);
+}
 
 
-static inline __m128i __attribute__((always_inline))
-xmm_shift_right(const __m128i reg, const unsigned int num)
+static uint32_t __attribute__((target("avx512f")))
+csum_oc16_avx512(const uint8_t * const restrict data,
+                 const uint32_t data_len,
+                 uint8_t * const restrict dst)
 {
-    const __m128i * p =
-        (const __m128i *)(const void *)(crc_xmm_shift_tab + 16 + num);
-    return _mm_shuffle_epi8(reg, _mm_loadu_si128(p));
+    const __m512i mask = _mm512_set1_epi32(0xffff);
+    __m512i sum = _mm512_setzero_si512();
+    uint32_t n = 0;
+    for (; n + sizeof(sum) <= data_len; n += sizeof(sum)) {
+        const __m512i d = _mm512_loadu_si512((const void *)&data[n]);
+        if (dst)
+            _mm512_storeu_si512((void *)&dst[n], d);
+        sum = _mm512_add_epi32(sum, _mm512_and_si512(d, mask));
+        sum = _mm512_add_epi32(sum, _mm512_srli_epi32(d, 16));
+    }
+
+    uint32_t lane[sizeof(sum) / sizeof(uint32_t)];
+    _mm512_storeu_si512((void *)lane, sum);
+    return csum_fold_lanes(lane, sizeof(lane) / sizeof(lane[0])) +
+           csum_oc16_scalar(&data[n], data_len - n, dst ? &dst[n] : 0);
 }
+#endif
 
 
-static inline __m128i __attribute__((always_inline))
-xmm_shift_left(const __m128i reg, const unsigned int num)
+#ifdef CKSUM_NEON
+static uint32_t csum_oc16_neon(const uint8_t * const restrict data,
+                               const uint32_t data_len,
+                               uint8_t * const restrict dst)
 {
-    const __m128i * p =
-        (const __m128i *)(const void *)(crc_xmm_shift_tab + 16 - num);
-    return _mm_shuffle_epi8(reg, _mm_loadu_si128(p));
+    uint32x4_t sum = vdupq_n_u32(0);
+    uint32_t n = 0;
+    for (; n + sizeof(sum) <= data_len; n += sizeof(sum)) {
+        const uint16x8_t d = vld1q_u16((const void *)&data[n]);
+        if (dst)
+            vst1q_u16((void *)&dst[n], d);
+        // pairwise add the 16-bit words into the 32-bit lanes
+        sum = vpadalq_u16(sum, d);
+    }
+
+    uint32_t lane[sizeof(sum) / sizeof(uint32_t)];
+    vst1q_u32(lane, sum);
+    return csum_fold_lanes(lane, sizeof(lane) / sizeof(lane[0])) +
+           csum_oc16_scalar(&data[n], data_len - n, dst ? &dst[n] : 0);
 }
+#endif
 
 
-static __m128i swap16a;
-static __m128i swap16b;
-static __m128i udp_mask;
+typedef uint32_t (*csum_oc16_fn)(const uint8_t * const restrict,
+                                 const uint32_t,
+                                 uint8_t * const restrict);
+
+static uint32_t csum_oc16_init(const uint8_t * const restrict data,
+                               const uint32_t data_len,
+                               uint8_t * const restrict dst);
+
+/// The checksum implementation in use, selected by cksum_init().
+static csum_oc16_fn csum_oc16 = csum_oc16_init;
+
+static const struct {
+    const char * name; ///< Name of the implementation.
+    csum_oc16_fn fn;   ///< The implementation, if built for this platform.
+} cksum_impls[CKSUM_IMPLS] = {
+    [CKSUM_SCALAR] = {"scalar", csum_oc16_scalar},
+#ifdef CKSUM_X86
+    [CKSUM_SSE2] = {"SSE2", csum_oc16_sse2},
+    [CKSUM_AVX2] = {"AVX2", csum_oc16_avx2},
+    [CKSUM_AVX512] = {"AVX-512", csum_oc16_avx512},
+#else
+    [CKSUM_SSE2] = {"SSE2", 0},
+    [CKSUM_AVX2] = {"AVX2", 0},
+    [CKSUM_AVX512] = {"AVX-512", 0},
+#endif
+#ifdef CKSUM_NEON
+    [CKSUM_NEON] = {"NEON", csum_oc16_neon},
+#else
+    [CKSUM_NEON] = {"NEON", 0},
+#endif
+};
 
 
-static void __attribute__((constructor)) cksum_sse_init(void)
+/// Make ip_cksum() and payload_cksum() use checksum implementation @p impl.
+///
+/// @param[in]  impl  The implementation to use.
+///
+/// @return     True if @p impl is supported by this platform and CPU, and is
+///             now in use; false otherwise.
+///
+bool cksum_use(const enum cksum_impl impl)
 {
-    swap16a = _mm_setr_epi16((short)0x0001, (short)0xffff, (short)0x0203,
-                             (short)0xffff, (short)0x0405, (short)0xffff,
-                             (short)0x0607, (short)0xffff);
-
-    swap16b = _mm_setr_epi16((short)0x0809, (short)0xffff, (short)0x0a0b,
-                             (short)0xffff, (short)0x0c0d, (short)0xffff,
-                             (short)0x0e0f, (short)0xffff);
-
-    udp_mask = _mm_setr_epi8((char)0x01, (char)0x00, (char)0xff, (char)0xff,
-                             (char)0x03, (char)0x02, (char)0xff, (char)0xff,
-                             (char)0x05, (char)0x04, (char)0xff, (char)0xff,
-                             (char)0x05, (char)0x04, (char)0xff, (char)0xff);
+    if (unlikely(impl >= CKSUM_IMPLS || cksum_impls[impl].fn == 0))
+        return false;
+
+#ifdef CKSUM_X86
+    if ((impl == CKSUM_SSE2 && !__builtin_cpu_supports("sse2")) ||
+        (impl == CKSUM_AVX2 && !__builtin_cpu_supports("avx2")) ||
+        (impl == CKSUM_AVX512 && !__builtin_cpu_supports("avx512f")))
+        return false;
+#endif
+
+    csum_oc16 = cksum_impls[impl].fn;
+    warn(DBG, "using %s Internet checksum", cksum_impls[impl].name);
+    return true;
 }
 
 
-static inline uint32_t __attribute__((always_inline))
-csum_oc16_sse(const uint8_t * const data,
-              const uint32_t data_len,
-              __m128i sum32a,
-              __m128i sum32b)
+/// Select the fastest checksum implementation the CPU supports. Called during
+/// engine initialization, or on first use.
+///
+void cksum_init(void)
 {
-    uint32_t n = 0;
-    for (n = 0; (n + 64) <= data_len; n += 64) {
-        __m128i dblock1;
-        __m128i dblock2;
+    static const enum cksum_impl pref[] = {CKSUM_AVX512, CKSUM_AVX2,
+                                           CKSUM_SSE2, CKSUM_NEON};
+    for (uint32_t i = 0; i < sizeof(pref) / sizeof(pref[0]); i++)
+        if (cksum_use(pref[i]))
+            return;
+    cksum_use(CKSUM_SCALAR);
+}
 
-        dblock1 = _mm_loadu_si128((const __m128i *)(const void *)&data[n]);
-        dblock2 = _mm_loadu_si128((const __m128i *)(const void *)&data[n + 16]);
 
-        sum32a = _mm_add_epi32(sum32a, _mm_shuffle_epi8(dblock1, swap16a));
-        sum32b = _mm_add_epi32(sum32b, _mm_shuffle_epi8(dblock1, swap16b));
-        sum32a = _mm_add_epi32(sum32a, _mm_shuffle_epi8(dblock2, swap16a));
-        sum32b = _mm_add_epi32(sum32b, _mm_shuffle_epi8(dblock2, swap16b));
+static uint32_t csum_oc16_init(const uint8_t * const restrict data,
+                               const uint32_t data_len,
+                               uint8_t * const restrict dst)
+{
+    cksum_init();
+    return csum_oc16(data, data_len, dst);
+}
 
-        dblock1 = _mm_loadu_si128((const __m128i *)(const void *)&data[n + 32]);
-        dblock2 = _mm_loadu_si128((const __m128i *)(const void *)&data[n + 48]);
 
-        sum32a = _mm_add_epi32(sum32a, _mm_shuffle_epi8(dblock1, swap16a));
-        sum32b = _mm_add_epi32(sum32b, _mm_shuffle_epi8(dblock1, swap16b));
-        sum32a = _mm_add_epi32(sum32a, _mm_shuffle_epi8(dblock2, swap16a));
-        sum32b = _mm_add_epi32(sum32b, _mm_shuffle_epi8(dblock2, swap16b));
+/// Compute the unreduced sum of the UDP pseudo-header fields of the IPv4 or
+/// IPv6 packet in @p buf that do not depend on the packet length, i.e., the
+/// addresses and the protocol. Used to prepare a w_sock header template, so
+/// that payload_cksum_pseudo() only needs to sum the UDP header and payload.
+///
+/// @param[in]  buf   The IP packet.
+///
+/// @return     Partial pseudo-header sum, to be passed to
+///             payload_cksum_pseudo().
+///
+uint32_t pseudo_cksum(const void * const buf)
+{
+    uint32_t sum;
+    if (ip_v(*(const uint8_t *)buf) == 4) {
+        const struct ip4_hdr * const ip = buf;
+        sum = (uint32_t)ip->p << 8;
+        sum += csum_oc16_scalar((const uint8_t *)&ip->src, sizeof(ip->src), 0);
+        sum += csum_oc16_scalar((const uint8_t *)&ip->dst, sizeof(ip->dst), 0);
+    } else {
+        const struct ip6_hdr * const ip = buf;
+        sum = (uint32_t)ip->next_hdr << 24;
+        sum += csum_oc16_scalar((const uint8_t *)&ip->src, sizeof(ip->src), 0);
+        sum += csum_oc16_scalar((const uint8_t *)&ip->dst, sizeof(ip->dst), 0);
     }
+    return sum;
+}
 
-    while ((n + 16) <= data_len) {
-        __m128i dblock;
 
-        dblock = _mm_loadu_si128((const __m128i *)(const void *)&data[n]);
-        sum32a = _mm_add_epi32(sum32a, _mm_shuffle_epi8(dblock, swap16a));
-        sum32b = _mm_add_epi32(sum32b, _mm_shuffle_epi8(dblock, swap16b));
-        n += 16;
-    }
+/// Compute the checksum of the transport-layer segment @p buf of length @p
+/// len, given the partial pseudo-header sum @p pseudo from pseudo_cksum().
+///
+/// @param[in]  pseudo  The partial pseudo-header sum.
+/// @param[in]  buf     The transport-layer header and payload.
+/// @param[in]  len     The length of @p buf.
+///
+/// @return     Transport-layer checksum.
+///
+uint16_t payload_cksum_pseudo(const uint32_t pseudo,
+                              const void * const buf,
+                              const uint16_t len)
+{
+    const uint16_t plen = bswap16(len);
+    return csum_oc16_reduce(pseudo + plen + csum_oc16(buf, len, 0));
+}
 
-    if (likely(n != data_len)) {
-        __m128i dblock;
 
-        dblock = _mm_loadu_si128((const __m128i *)(const void *)&data[n]);
-        dblock = xmm_shift_left(dblock, 16 - (data_len & 15));
-        dblock = xmm_shift_right(dblock, 16 - (data_len & 15));
-        sum32a = _mm_add_epi32(sum32a, _mm_shuffle_epi8(dblock, swap16a));
-        sum32b = _mm_add_epi32(sum32b, _mm_shuffle_epi8(dblock, swap16b));
-    }
+/// Compute the checksum of a transport-layer segment of length @p len, given
+/// the partial pseudo-header sum @p pseudo from pseudo_cksum(), the @p hdr_len
+/// bytes of transport header at @p hdr, and the partial sum @p psum of the
+/// payload that follows the header, as returned by cksum_copy().
+///
+/// @param[in]  pseudo   The partial pseudo-header sum.
+/// @param[in]  hdr      The transport-layer header.
+/// @param[in]  hdr_len  The length of @p hdr. Must be even.
+/// @param[in]  len      The length of the transport-layer segment.
+/// @param[in]  psum     The partial sum of the payload.
+///
+/// @return     Transport-layer checksum.
+///
+uint16_t payload_cksum_hdr(const uint32_t pseudo,
+                           const void * const hdr,
+                           const uint16_t hdr_len,
+                           const uint16_t len,
+                           const uint16_t psum)
+{
+    const uint16_t plen = bswap16(len);
+    return csum_oc16_reduce(pseudo + plen + psum +
+                            csum_oc16_scalar(hdr, hdr_len, 0));
+}
+
 
-    sum32a = _mm_add_epi32(sum32a, sum32b);
-    sum32a = _mm_hadd_epi32(sum32a, _mm_setzero_si128());
-    sum32a = _mm_hadd_epi32(sum32a, _mm_setzero_si128());
-    return (uint32_t)_mm_extract_epi32(sum32a, 0);
+/// Copy @p len bytes from @p src to @p dst, and compute their partial Internet
+/// checksum in the same pass. The result is zero only if all bytes are.
+///
+/// @param      dst   The destination buffer.
+/// @param[in]  src   The source buffer.
+/// @param[in]  len   The number of bytes to copy.
+///
+/// @return     Partial checksum of the copied bytes, folded to 16 bits.
+///
+uint16_t cksum_copy(void * const restrict dst,
+                    const void * const restrict src,
+                    const uint16_t len)
+{
+    uint32_t sum = csum_oc16(src, len, dst);
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)sum;
 }
 
 
+/// Compute the Internet checksum over buffer @p buf of length @p len. See
+/// [RFC1071](https://tools.ietf.org/html/rfc1071).
+///
+/// @param[in]  buf   The buffer
+/// @param[in]  len   The length
+///
+/// @return     Internet checksum of @p buf.
+///
 uint16_t ip_cksum(const void * const buf, const uint16_t len)
 {
-    const uint32_t sum =
-        csum_oc16_sse(buf, len, _mm_setzero_si128(), _mm_setzero_si128());
-
-    return bswap16(csum_oc16_reduce(sum));
+    const uint32_t sum = csum_oc16(buf, len, 0);
+    return csum_oc16_reduce(sum);
 }
 
 
-uint16_t
-#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 8)
-    __attribute__((no_sanitize("alignment")))
-#endif
-    udp_cksum(const void * const buf, const uint16_t len)
+uint16_t payload_cksum(const void * const buf, const uint16_t len)
 {
-    const struct ip4_hdr * ip = (const struct ip4_hdr *)buf;
-    __m128i sum32a;
-    __m128i sum32b;
+    const uint8_t v = ip_v(*(const uint8_t *)buf);
+    uint16_t ip_hdr_len;
     uint32_t sum;
 
-    /**
-     * Do pseudo IPv4 header
-     * Load source and destination addresses from IP header
-     * Swap 16-bit words from big endian to little endian
-     * Extend 16 bit words to 32 bit words for further with SSE
-     */
-    sum32a = _mm_loadu_si128(
-        (const __m128i *)(const void *)((const uint8_t *)buf +
-                                        __builtin_offsetof(struct ip4_hdr,
-                                                           src)));
-    sum32a = _mm_shuffle_epi8(sum32a, swap16a);
-
-    /**
-     * Read UDP header
-     * Duplicate length field as it wasn't included in IPv4 pseudo header
-     * Swap 16-bit words from big endian to little endian
-     * Extend 16 bit words to 32 bit words for further with SSE
-     */
-    sum32b = _mm_loadu_si128(
-        (const __m128i *)(const void *)((const uint8_t *)buf +
-                                        sizeof(struct ip4_hdr)));
-    sum32b = _mm_shuffle_epi8(sum32b, udp_mask);
-
-    sum = csum_oc16_sse((const uint8_t *)buf + sizeof(struct ip4_hdr) +
-                            sizeof(struct udp_hdr),
-                        len - sizeof(struct ip4_hdr) - sizeof(struct udp_hdr),
-                        sum32a, sum32b) +
-          ((uint32_t)ip->p);
-
-    return bswap16(csum_oc16_reduce(sum));
+    if (v == 4) {
+        const struct ip4_hdr * const ip = buf;
+        ip_hdr_len = ip4_hl(*(const uint8_t *)buf);
+        sum = (uint32_t)ip->p << 8;
+        sum += csum_oc16_scalar((const uint8_t *)&ip->src, sizeof(ip->src), 0);
+        sum += csum_oc16_scalar((const uint8_t *)&ip->dst, sizeof(ip->dst), 0);
+        const uint16_t plen = bswap16(bswap16(ip->len) - ip_hdr_len);
+        sum += csum_oc16_scalar((const uint8_t *)&plen, sizeof(plen), 0);
+    } else {
+        const struct ip6_hdr * const ip = buf;
+        ip_hdr_len = sizeof(*ip);
+        sum = (uint32_t)ip->next_hdr << 24;
+        sum += csum_oc16_scalar((const uint8_t *)&ip->src, sizeof(ip->src), 0);
+        sum += csum_oc16_scalar((const uint8_t *)&ip->dst, sizeof(ip->dst), 0);
+        sum += csum_oc16_scalar((const uint8_t *)&ip->len, sizeof(ip->len), 0);
+    }
+
+    // payload
+    sum +=
+        csum_oc16((const uint8_t *)buf + ip_hdr_len, len - ip_hdr_len, 0);
+
+    return csum_oc16_reduce(sum);
 }
-#endif
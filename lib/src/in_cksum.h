@@ -27,18 +27,53 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
+
+/// Implementations of the Internet checksum that cksum_use() can select.
+///
+enum cksum_impl {
+    CKSUM_SCALAR, ///< Portable C.
+    CKSUM_SSE2,   ///< x86 SSE2.
+    CKSUM_AVX2,   ///< x86 AVX2.
+    CKSUM_AVX512, ///< x86 AVX-512F.
+    CKSUM_NEON,   ///< ARMv8 NEON.
+    CKSUM_IMPLS   ///< Number of implementations.
+};
+
+
+extern void cksum_init(void);
+
+extern bool cksum_use(const enum cksum_impl impl);
+
 extern uint16_t __attribute__((nonnull))
 ip_cksum(const void * const buf, const uint16_t len);
 
 extern uint16_t __attribute__((nonnull))
 payload_cksum(const void * const buf, const uint16_t len);
 
-#ifdef CKSUM_UPDATE
+extern uint32_t __attribute__((nonnull)) pseudo_cksum(const void * const buf);
+
+extern uint16_t __attribute__((nonnull))
+payload_cksum_pseudo(const uint32_t pseudo,
+                     const void * const buf,
+                     const uint16_t len);
+
+extern uint16_t __attribute__((nonnull))
+payload_cksum_hdr(const uint32_t pseudo,
+                  const void * const hdr,
+                  const uint16_t hdr_len,
+                  const uint16_t len,
+                  const uint16_t psum);
+
+extern uint16_t __attribute__((nonnull))
+cksum_copy(void * const dst,
+           const void * const src,
+           const uint16_t len);
+
 extern uint16_t __attribute__((const))
 ip_cksum_update32(uint16_t old_check, uint32_t old_data, uint32_t new_data);
 
 extern uint16_t __attribute__((const))
 ip_cksum_update16(uint16_t old_check, uint16_t old_data, uint16_t new_data);
-#endif
@@ -38,8 +38,166 @@
 #include "neighbor.h"
 
 
+#define NEIGHBOR_MIN 64 ///< Initial number of neighbor cache entries.
+
+
+/// Return the slot for IP address @p addr in neighbor cache @p nb, which is
+/// either the one holding @p addr or the free one ending its probe sequence.
+///
+/// @param[in]  nb    The neighbor cache. Must have at least one free slot.
+/// @param[in]  addr  IP address to look up.
+///
+/// @return     Neighbor cache slot.
+///
+static struct w_neighbor * __attribute__((nonnull))
+slot(const struct w_neighbors * const nb, const struct w_addr * const addr)
+{
+    for (uint32_t i = w_addr_hash(addr) & nb->mask;; i = (i + 1) & nb->mask) {
+        struct w_neighbor * const n = &nb->n[i];
+        if (n->state == NEIGHBOR_FREE || w_addr_cmp(&n->addr, addr))
+            return n;
+    }
+}
+
+
+/// Rehash neighbor cache @p nb into @p size slots, dropping all entries that
+/// have been marked NEIGHBOR_FREE.
+///
+/// @param      nb    The neighbor cache.
+/// @param[in]  size  The new number of slots. Must be a power of two.
+///
+static void __attribute__((nonnull))
+resize(struct w_neighbors * const nb, const uint32_t size)
+{
+    struct w_neighbors old = *nb;
+    ensure((nb->n = calloc(size, sizeof(*nb->n))) != 0,
+           "cannot allocate neighbor cache");
+    nb->mask = size - 1;
+    nb->cnt = 0;
+    for (uint32_t i = 0; old.n && i <= old.mask; i++)
+        if (old.n[i].state != NEIGHBOR_FREE) {
+            struct w_neighbor * const n = slot(nb, &old.n[i].addr);
+            *n = old.n[i];
+            if (sq_empty(&n->pend))
+                // an empty queue points back at its own head
+                sq_init(&n->pend);
+            nb->cnt++;
+        }
+    free(old.n);
+}
+
+
+/// Find the neighbor cache entry for IP address @p addr, and optionally create
+/// it if there is none. The returned pointer is only valid until the next
+/// change to the neighbor cache.
+///
+/// @param      w       Backend engine.
+/// @param[in]  addr    IP address to look up in the neighbor cache.
+/// @param[in]  create  Whether to create a missing entry.
+///
+/// @return     Neighbor cache entry of @p addr, or zero.
+///
+static struct w_neighbor * __attribute__((nonnull))
+neighbor_get(struct w_engine * const w,
+             const struct w_addr * const addr,
+             const bool create)
+{
+    struct w_neighbors * const nb = &w->b->neighbor;
+    if (likely(nb->n)) {
+        struct w_neighbor * const n = slot(nb, addr);
+        if (likely(n->state != NEIGHBOR_FREE))
+            return n;
+    }
+    if (create == false)
+        return 0;
+
+    // keep the cache at most half full
+    if (unlikely((nb->cnt + 1) * 2 > nb->mask + 1))
+        resize(nb, nb->n ? (nb->mask + 1) * 2 : NEIGHBOR_MIN);
+
+    struct w_neighbor * const n = slot(nb, addr);
+    *n = (struct w_neighbor){.addr = *addr,
+                             .state = NEIGHBOR_INCOMPLETE,
+                             .used = nb->now};
+    sq_init(&n->pend);
+    nb->cnt++;
+    return n;
+}
+
+
+/// Send a neighbor query for @p n, unless one was sent less than
+/// NEIGHBOR_RETRY ago.
+///
+/// @param      w     Backend engine.
+/// @param      n     Neighbor cache entry to resolve.
+///
+static void __attribute__((nonnull))
+neighbor_query(struct w_engine * const w, struct w_neighbor * const n)
+{
+    const uint64_t now = w_now(CLOCK_MONOTONIC);
+    if (n->query && now - n->query < NEIGHBOR_RETRY)
+        return;
+    n->query = now;
+    n->probes++;
+
+    warn(INF, "%s neighbor entry for %s, sending query",
+         n->state == NEIGHBOR_INCOMPLETE ? "no" : "stale",
+         w_ntop(&n->addr, ip_tmp));
+    if (n->addr.af == AF_INET)
+        arp_who_has(w, n->addr.ip4);
+    else
+        icmp6_nsol(w, n->addr.ip6);
+}
+
+
+/// Set the MAC address of neighbor cache entry @p n, and transmit any frames
+/// that were held while it was being resolved.
+///
+/// @param      w      Backend engine.
+/// @param      n      Neighbor cache entry.
+/// @param[in]  mac    Ethernet MAC address of @p n.
+/// @param[in]  state  New neighbor_state of @p n.
+///
+static void
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 8)
+    __attribute__((nonnull, no_sanitize("alignment")))
+#else
+    __attribute__((nonnull))
+#endif
+    neighbor_set(struct w_engine * const w,
+                 struct w_neighbor * const n,
+                 const struct eth_addr mac,
+                 const enum neighbor_state state)
+{
+    if (n->state != NEIGHBOR_INCOMPLETE &&
+        memcmp(&n->mac, &mac, sizeof(mac)) != 0)
+        // make connected w_socks pick up the new MAC address
+        w->b->neighbor.gen++;
+    n->mac = mac;
+    n->seen = w_now(CLOCK_MONOTONIC);
+    n->probes = 0;
+    n->query = 0;
+    n->state = state;
+
+    warn(INF, "neighbor cache entry: %s is at %s", w_ntop(&n->addr, ip_tmp),
+         eth_ntoa(&mac, eth_tmp, ETH_STRLEN));
+
+    if (unlikely(!sq_empty(&n->pend)))
+        warn(INF, "sending %" PRIu " frames held for %s", sq_len(&n->pend),
+             w_ntop(&n->addr, ip_tmp));
+    while (!sq_empty(&n->pend)) {
+        struct w_iov * const v = sq_first(&n->pend);
+        sq_remove_head(&n->pend, next);
+        sq_next(v, next) = 0;
+        ((struct eth_hdr *)(void *)v->base)->dst = mac;
+        eth_tx_ctl(v);
+    }
+}
+
+
 /// Update the MAC address associated with IP address @p addr in the neighbor
-/// cache.
+/// cache, marking it reachable, and transmit any frames that were held while
+/// it was being resolved.
 ///
 /// @param      w     Backend engine.
 /// @param[in]  addr  IP address to update the neighbor cache for.
@@ -49,87 +207,172 @@ void neighbor_update(struct w_engine * const w,
                      const struct w_addr * const addr,
                      const struct eth_addr mac)
 {
-    khiter_t k = kh_get(neighbor, &w->b->neighbor, addr);
-    if (k == kh_end(&w->b->neighbor)) {
-        struct w_addr * const a = malloc(sizeof(*addr));
-        ensure(a, "could not malloc");
-        memcpy(a, addr, sizeof(*addr));
-        int ret;
-        k = kh_put(neighbor, &w->b->neighbor, a, &ret); // NOLINT
-        assure(ret >= 1, "inserted");
-    }
-    kh_val(&w->b->neighbor, k) = mac;
+    struct w_neighbor * const n = neighbor_get(w, addr, true);
+    if (likely(n->state != NEIGHBOR_STATIC))
+        neighbor_set(w, n, mac, NEIGHBOR_REACHABLE);
+}
 
-    warn(INF, "neighbor cache entry: %s is at %s", w_ntop(addr, ip_tmp),
-         eth_ntoa(&mac, eth_tmp, ETH_STRLEN));
+
+/// Enter a static MAC address for IP address @p addr into the neighbor cache.
+/// Static entries are never aged or re-resolved.
+///
+/// @param      w     Backend engine.
+/// @param[in]  addr  IP address to update the neighbor cache for.
+/// @param[in]  mac   Ethernet MAC address of @p addr.
+///
+void neighbor_static(struct w_engine * const w,
+                     const struct w_addr * const addr,
+                     const struct eth_addr mac)
+{
+    neighbor_set(w, neighbor_get(w, addr, true), mac, NEIGHBOR_STATIC);
 }
 
 
-/// Find the neighbor cache entry associated with IP address @p ip.
+/// Look up the Ethernet MAC address for target IP address @p addr. If there is
+/// no resolved entry in the neighbor cache for @p addr, this function sends an
+/// ARP request or neighbor solicitation (at most once per NEIGHBOR_RETRY) and
+/// returns without waiting for the answer, which arp_rx() or icmp6_rx() will
+/// eventually enter into the cache. A stale entry is returned as-is, but also
+/// re-resolved in the background.
 ///
 /// @param      w     Backend engine.
-/// @param[in]  addr  IP address to look up in neighbor cache.
+/// @param[in]  addr  IP address that is the target of the neighbor request.
+/// @param[out] mac   Ethernet MAC address of @p addr, if known.
 ///
-/// @return     Pointer to eth_addr of @p addr, or zero.
+/// @return     True if @p mac was set, false if resolution is in progress.
 ///
-static struct eth_addr __attribute__((nonnull))
-neighbor_find(struct w_engine * const w, const struct w_addr * const addr)
+bool who_has(struct w_engine * const w,
+             const struct w_addr * const addr,
+             struct eth_addr * const mac)
 {
-    const khiter_t k = kh_get(neighbor, &w->b->neighbor, addr);
-    if (unlikely(k == kh_end(&w->b->neighbor)))
-        return (struct eth_addr){ETH_ADDR_BCAST};
-    return kh_val(&w->b->neighbor, k);
+    struct w_neighbor * const n = neighbor_get(w, addr, true);
+    n->used = w->b->neighbor.now;
+    switch (n->state) {
+    case NEIGHBOR_INCOMPLETE:
+        neighbor_query(w, n);
+        return false;
+
+    case NEIGHBOR_STALE:
+        n->state = NEIGHBOR_PROBE;
+        n->probes = 0;
+        neighbor_query(w, n);
+        break;
+
+    default:
+        break;
+    }
+    *mac = n->mac;
+    return true;
 }
 
 
-/// Return the Ethernet MAC address for target IP address @p addr. If there is
-/// no entry in the neighbor cache for the Ethernet MAC address corresponding to
-/// IPv4 address @p addr, this function will block while attempting to resolve
-/// the address.
+/// Hold a copy of the Ethernet frame in @p v, which is addressed to the
+/// unresolved neighbor @p addr, until neighbor_update() learns its MAC address.
+/// At most NEIGHBOR_PEND frames are held per neighbor; older ones are dropped
+/// in favor of newer ones.
 ///
 /// @param      w     Backend engine.
-/// @param[in]  addr  IP address that is the target of the neighbor request
+/// @param[in]  addr  IP address of the neighbor.
+/// @param[in]  v     The w_iov containing the Ethernet frame.
+///
+void neighbor_hold(struct w_engine * const w,
+                   const struct w_addr * const addr,
+                   const struct w_iov * const v)
+{
+    struct w_neighbor * const n = neighbor_get(w, addr, true);
+    neighbor_query(w, n);
+
+    struct w_iov * c;
+    if (unlikely(sq_len(&n->pend) >= NEIGHBOR_PEND)) {
+        rwarn(WRN, 10, "dropping oldest frame held for %s",
+              w_ntop(addr, ip_tmp));
+        c = sq_first(&n->pend);
+        sq_remove_head(&n->pend, next);
+        sq_next(c, next) = 0;
+    } else {
+        c = w_alloc_iov_base(w);
+        if (unlikely(c == 0)) {
+            warn(CRT, "no more bufs; frame for %s not held",
+                 w_ntop(addr, ip_tmp));
+            return;
+        }
+    }
+
+    c->len = v->len;
+    memcpy(c->base, v->base, v->len + sizeof(struct eth_hdr));
+    sq_insert_tail(&n->pend, c, next);
+}
+
+
+/// Age the neighbor cache entries of engine @p w. Called from w_nic_tx(), but
+/// only does work every NEIGHBOR_RETRY: reachable entries that were not
+/// confirmed for NEIGHBOR_REACHABLE_TIME become stale, queries are repeated for
+/// entries being (re-)resolved until NEIGHBOR_PROBES went unanswered, after
+/// which held frames are dropped and the MAC address forgotten, and entries
+/// unused for NEIGHBOR_GC_TIME are removed.
 ///
-/// @return     Ethernet MAC address of @p addr.
+/// @param      w     Backend engine.
 ///
-struct eth_addr
-#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 8)
-    __attribute__((no_sanitize("alignment")))
-#endif
-    who_has(struct w_engine * const w, const struct w_addr * const addr)
+void neighbor_tick(struct w_engine * const w)
 {
-    struct eth_addr a = neighbor_find(w, addr);
-    while (unlikely(memcmp(&a, ETH_ADDR_BCAST, sizeof(a)) == 0)) {
-        warn(INF, "no neighbor entry for %s, sending query",
-             w_ntop(addr, ip_tmp));
+    struct w_neighbors * const nb = &w->b->neighbor;
+    const uint64_t now = nb->now = w_now(CLOCK_MONOTONIC);
+    if (likely(now < nb->tick))
+        return;
+    nb->tick = now + NEIGHBOR_RETRY;
+
+    // have connected w_socks check on their neighbors once per sweep
+    nb->gen++;
 
-        if (addr->af == AF_INET)
-            arp_who_has(w, addr->ip4);
-        else
-            icmp6_nsol(w, addr->ip6);
+    bool gc = false;
+    for (uint32_t i = 0; nb->n && i <= nb->mask; i++) {
+        struct w_neighbor * const n = &nb->n[i];
+        switch (n->state) {
+        case NEIGHBOR_REACHABLE:
+            if (now - n->seen > NEIGHBOR_REACHABLE_TIME)
+                n->state = NEIGHBOR_STALE;
+            break;
 
-        // wait until packets have been received, then handle them
-        w_nic_rx(w, 1 * NS_PER_S);
+        case NEIGHBOR_PROBE:
+        case NEIGHBOR_INCOMPLETE:
+            if (n->probes >= NEIGHBOR_PROBES &&
+                now - n->query >= NEIGHBOR_RETRY) {
+                warn(WRN, "neighbor %s unreachable", w_ntop(&n->addr, ip_tmp));
+                n->state = NEIGHBOR_INCOMPLETE;
+                n->probes = 0;
+                w_free(&n->pend);
+            } else if (n->state == NEIGHBOR_PROBE || !sq_empty(&n->pend))
+                neighbor_query(w, n);
+            break;
 
-        // check if we can now resolve dip
-        a = neighbor_find(w, addr);
+        default:
+            break;
+        }
+
+        if (n->state != NEIGHBOR_STATIC && n->state != NEIGHBOR_FREE &&
+            sq_empty(&n->pend) && now - n->used > NEIGHBOR_GC_TIME) {
+            n->state = NEIGHBOR_FREE;
+            gc = true;
+        }
     }
-    return a;
+
+    if (gc)
+        // rehash to close the gaps in the probe sequences
+        resize(nb, nb->mask + 1);
 }
 
 
-/// Free the neighbor cache entries associated with engine @p w.
+/// Free the neighbor cache entries associated with engine @p w, together with
+/// any frames still held for them.
 ///
 /// @param[in]  w     Backend engine.
 ///
 void free_neighbor(struct w_engine * const w)
 {
-    const struct w_addr * k;
-    struct eth_addr v;
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wcast-qual"
-    kh_foreach(&w->b->neighbor, k, v, { free((void *)k); });
-#pragma clang diagnostic pop
-
-    kh_release(neighbor, &w->b->neighbor);
+    struct w_neighbors * const nb = &w->b->neighbor;
+    for (uint32_t i = 0; nb->n && i <= nb->mask; i++)
+        if (nb->n[i].state != NEIGHBOR_FREE)
+            w_free(&nb->n[i].pend);
+    free(nb->n);
+    *nb = (struct w_neighbors){0};
 }
@@ -27,13 +27,76 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/socket.h>
 
 #include <warpcore/warpcore.h>
 
 
-extern struct eth_addr __attribute__((nonnull))
-who_has(struct w_engine * const w, const struct w_addr * const addr);
+#define NEIGHBOR_PEND 16        ///< Frames held per unresolved neighbor.
+#define NEIGHBOR_RETRY NS_PER_S ///< Interval between neighbor queries.
+#define NEIGHBOR_PROBES 3       ///< Unanswered queries before giving up.
+
+/// Time after a confirmation during which a neighbor is reachable.
+#define NEIGHBOR_REACHABLE_TIME (30 * NS_PER_S)
+
+/// Time after which an unused neighbor cache entry is removed.
+#define NEIGHBOR_GC_TIME (300 * NS_PER_S)
+
+
+/// States of a neighbor cache entry, loosely following RFC 4861, section 7.3.2.
+///
+enum neighbor_state {
+    NEIGHBOR_FREE,       ///< Unused slot.
+    NEIGHBOR_INCOMPLETE, ///< Resolution in progress, frames are held.
+    NEIGHBOR_REACHABLE,  ///< Recently confirmed.
+    NEIGHBOR_STALE,      ///< Not recently confirmed, re-resolved on next use.
+    NEIGHBOR_PROBE,      ///< Being re-resolved, the old MAC is still used.
+    NEIGHBOR_STATIC,     ///< Configured, never aged.
+};
+
+
+/// A neighbor cache entry.
+///
+struct w_neighbor {
+    struct w_addr addr;   ///< IP address of the neighbor (the key).
+    struct eth_addr mac;  ///< Ethernet MAC address, unless incomplete.
+    uint8_t state;        ///< The neighbor_state of the entry.
+    uint8_t probes;       ///< Unanswered queries since the last confirmation.
+    uint64_t seen;        ///< w_now() of the last confirmation.
+    uint64_t query;       ///< w_now() of the last query, or zero.
+    uint64_t used;        ///< Coarse w_now() of the last lookup.
+    struct w_iov_sq pend; ///< Frames waiting for resolution.
+};
+
+
+/// The neighbor cache, an open-addressing hash table with linear probing
+/// that stores its entries inline. A zero-initialized struct is an empty
+/// cache.
+///
+struct w_neighbors {
+    struct w_neighbor * n; ///< Entries.
+    uint32_t mask;         ///< Number of entries minus one, or zero.
+    uint32_t cnt;          ///< Number of used entries.
+    uint32_t gen;          ///< Bumped whenever cached MACs may have changed.
+    /// @cond
+    uint8_t _unused[4]; ///< @internal Padding.
+                        /// @endcond
+    uint64_t now;       ///< w_now() of the last neighbor_tick().
+    uint64_t tick;      ///< w_now() of the next neighbor cache sweep.
+};
+
+
+extern bool __attribute__((nonnull))
+who_has(struct w_engine * const w,
+        const struct w_addr * const addr,
+        struct eth_addr * const mac);
+
+extern void __attribute__((nonnull))
+neighbor_hold(struct w_engine * const w,
+              const struct w_addr * const addr,
+              const struct w_iov * const v);
 
 extern void __attribute__((nonnull)) free_neighbor(struct w_engine * const w);
 
@@ -42,6 +105,13 @@ neighbor_update(struct w_engine * const w,
                 const struct w_addr * const addr,
                 const struct eth_addr mac);
 
+extern void __attribute__((nonnull))
+neighbor_static(struct w_engine * const w,
+                const struct w_addr * const addr,
+                const struct eth_addr mac);
+
+extern void __attribute__((nonnull)) neighbor_tick(struct w_engine * const w);
+
 
 static inline khint_t __attribute__((nonnull))
 w_addr_hash(const struct w_addr * const addr)
@@ -50,11 +120,3 @@ w_addr_hash(const struct w_addr * const addr)
     return addr->af == AF_INET ? fnv1a_32(&addr->ip4, IP4_LEN)
                                : fnv1a_32(addr->ip6, IP6_LEN);
 }
-
-
-KHASH_INIT(neighbor,
-           const struct w_addr *,
-           struct eth_addr,
-           1,
-           w_addr_hash,
-           w_addr_cmp)
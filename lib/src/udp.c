@@ -29,6 +29,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
 #include <sys/socket.h>
@@ -58,18 +59,15 @@
 #endif
 
 
-// Receive a UDP packet.
-
-/// Receive a UDP packet. Validates the UDP checksum and appends the payload
-/// data to the corresponding w_sock. Also makes the receive timestamp and IPv4
-/// flags available, via w_iov::ts and w_iov::flags, respectively.
-///
-/// The Ethernet frame to operate on is in the current netmap lot of the
-/// indicated RX ring.
+/// Hand the UDP packet in netmap slot @p s, which udp_rx() or eth_rx_burst()
+/// have validated, to w_sock @p ws. Swaps the slot buffer with that of a spare
+/// w_iov, and appends the w_iov to w_sock::iv. Also makes the receive timestamp
+/// and IPv4 flags available, via w_iov::ts and w_iov::flags, respectively.
 ///
 /// @param      w     Backend engine.
 /// @param      s     Currently active netmap RX slot.
 /// @param      buf   Incoming packet.
+/// @param      ws    The w_sock the packet is for.
 ///
 /// @return     Whether a packet was placed into a socket.
 ///
@@ -77,9 +75,10 @@ bool
 #if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 8)
     __attribute__((no_sanitize("alignment")))
 #endif
-    udp_rx(struct w_engine * const w,
-           struct netmap_slot * const s,
-           uint8_t * const buf)
+    udp_deliver(struct w_engine * const w,
+                struct netmap_slot * const s,
+                uint8_t * const buf,
+                struct w_sock * const ws)
 {
     // grab an unused iov for the data in this packet
     //
@@ -91,33 +90,100 @@ bool
         return false;
     }
 
+    const uint8_t * const ip = eth_data(buf);
+    struct udp_hdr * udp;
+    uint16_t ip_plen;
+    if (ip_v(*ip) == 4) {
+        const struct ip4_hdr * ip4 = (const void *)ip;
+        ip_plen = bswap16(ip4->len) - ip4_hl(ip4->vhl);
+        udp = (void *)ip4_data(buf);
+        i->wv_af = AF_INET;
+        i->wv_ip4 = ip4->src;
+        i->flags = ip4->tos;
+        i->ttl = ip4->ttl;
+    } else {
+        const struct ip6_hdr * ip6 = (const void *)ip;
+        ip_plen = bswap16(ip6->len);
+        udp = (void *)ip6_data(buf);
+        i->wv_af = AF_INET6;
+        memcpy(i->wv_ip6, ip6->src, sizeof(i->wv_ip6));
+        i->flags = ip6_tos(ip6->vtcecnfl);
+        i->ttl = ip6->hlim;
+    }
+    i->ts = w->b->rx_ts;
+    i->hwts = 0;
+    i->wv_port = udp->sport;
+    i->len = MIN(bswap16(udp->len), ip_plen) - sizeof(*udp);
+
+#if 0
+    warn(DBG, "swapping rx slot idx %d and spare idx %u", s->buf_idx, i->idx);
+#endif
+
+    // adjust the buffer offset to the received data into the iov
+    i->base = buf;
+    i->buf = (uint8_t *)udp + sizeof(*udp);
+    const uint32_t tmp_idx = i->idx;
+    i->idx = s->buf_idx;
+
+    // put the original buffer of the iov into the receive ring
+    s->buf_idx = tmp_idx;
+    s->flags = NS_BUF_CHANGED;
+
+    // append the iov to the socket, and mark it ready if it wasn't already
+    sq_insert_tail(&ws->iv, i, next);
+    if (ws->__ready == false) {
+        ws->__ready = true;
+        sl_insert_head(&w->b->rdy, ws, __rdy);
+    }
+    return true;
+}
+
+
+/// Receive a UDP packet. Looks up the corresponding w_sock, validates the UDP
+/// checksum only if the packet will be delivered or answered with an ICMP
+/// unreachable, and appends the payload data to the w_sock via udp_deliver().
+///
+/// The Ethernet frame to operate on is in the current netmap lot of the
+/// indicated RX ring.
+///
+/// @param      w     Backend engine.
+/// @param      s     Currently active netmap RX slot.
+/// @param      buf   Incoming packet.
+///
+/// @return     Whether a packet was placed into a socket.
+///
+bool
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 8)
+    __attribute__((no_sanitize("alignment")))
+#endif
+    udp_rx(struct w_engine * const w,
+           struct netmap_slot * const s,
+           uint8_t * const buf)
+{
     const uint8_t * const ip = eth_data(buf);
     const uint8_t v = ip_v(*ip);
     uint16_t ip_hdr_len;
     struct udp_hdr * udp;
     uint16_t ip_plen;
     struct w_sockaddr local;
+    struct w_sockaddr remote;
 
     if (v == 4) {
         const struct ip4_hdr * ip4 = (const void *)ip;
         ip_hdr_len = ip4_hl(ip4->vhl);
         ip_plen = bswap16(ip4->len) - ip_hdr_len;
         udp = (void *)ip4_data(buf);
-        local.addr.af = i->wv_af = AF_INET;
-        i->wv_ip4 = ip4->src;
+        local.addr.af = remote.addr.af = AF_INET;
+        remote.addr.ip4 = ip4->src;
         local.addr.ip4 = ip4->dst;
-        i->flags = ip4->tos;
-        i->ttl = ip4->ttl;
     } else {
         const struct ip6_hdr * ip6 = (const void *)ip;
         ip_hdr_len = sizeof(*ip6);
         ip_plen = bswap16(ip6->len);
         udp = (void *)ip6_data(buf);
-        local.addr.af = i->wv_af = AF_INET6;
-        memcpy(i->wv_ip6, ip6->src, sizeof(i->wv_ip6));
+        local.addr.af = remote.addr.af = AF_INET6;
+        memcpy(remote.addr.ip6, ip6->src, sizeof(remote.addr.ip6));
         memcpy(local.addr.ip6, ip6->dst, sizeof(local.addr.ip6));
-        i->flags = ip6_tos(ip6->vtcecnfl);
-        i->ttl = ip6->hlim;
     }
 
     if (unlikely(ip_plen < sizeof(*udp))) {
@@ -125,12 +191,25 @@ bool
         return false;
     }
 
-    const uint16_t udp_len = MIN(bswap16(udp->len), ip_plen);
-    i->len = udp_len - sizeof(*udp);
     udp_log(udp);
 
+    // demux first, so packets nobody wants cost neither a checksum nor a w_iov
+    remote.port = udp->sport;
+    local.port = udp->dport;
+    struct w_sock * const ws = flow_find(&w->b->flows, &local, &remote);
+
+    // nobody bound to this port locally; only send an ICMP unreachable reply
+    // if this was not a broadcast, and then only for an intact packet
+    const bool unreach =
+        unlikely(ws == 0) &&
+        ((v == 4 && is_my_ip4(w, remote.addr.ip4, false) != UINT16_MAX) ||
+         (v == 6 && is_my_ip6(w, remote.addr.ip6, false) != UINT16_MAX));
+    if (unlikely(ws == 0 && unreach == false))
+        return false;
+
     if (likely(udp->cksum)) {
         // validate the checksum
+        const uint16_t udp_len = MIN(bswap16(udp->len), ip_plen);
         if (unlikely(payload_cksum(ip, udp_len + ip_hdr_len) != 0)) {
             warn(WRN, "invalid UDP checksum, received 0x%04x",
                  bswap16(udp->cksum));
@@ -138,48 +217,145 @@ bool
         }
     }
 
-    i->wv_port = udp->sport;
-    local.port = udp->dport;
-    struct w_sock * ws = w_get_sock(w, &local, &i->saddr);
-    if (unlikely(ws == 0)) {
-        // no socket connected, check for bound-only socket
-        ws = w_get_sock(w, &local, 0);
-        if (unlikely(ws == 0)) {
-            // nobody bound to this port locally
-            // send an ICMP unreachable reply, if this was not a broadcast
-            if (v == 4 && is_my_ip4(w, i->wv_ip4, false) != UINT16_MAX)
-                icmp4_tx(w, ICMP4_TYPE_UNREACH, ICMP4_UNREACH_PORT, buf);
-            else if (v == 6 && is_my_ip6(w, i->wv_ip6, false) != UINT16_MAX)
-                icmp6_tx(w, ICMP6_TYPE_UNREACH, ICMP6_UNREACH_PORT, buf);
-            return false;
-        }
+    if (unlikely(unreach)) {
+        if (v == 4)
+            icmp4_tx(w, ICMP4_TYPE_UNREACH, ICMP4_UNREACH_PORT, buf);
+        else
+            icmp6_tx(w, ICMP6_TYPE_UNREACH, ICMP6_UNREACH_PORT, buf);
+        return false;
     }
 
-#if 0
-    warn(DBG, "swapping rx slot idx %d and spare idx %u", s->buf_idx, i->idx);
+    return udp_deliver(w, s, buf, ws);
+}
+
+
+/// Build the transmit header template of connected w_sock @p s, by running the
+/// regular header construction once and zeroing the fields that vary per
+/// packet. Must be called again whenever the four-tuple or destination MAC
+/// address of @p s change.
+///
+/// @param      s     The w_sock to build the template for.
+///
+void
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 8)
+    __attribute__((no_sanitize("alignment")))
 #endif
+    udp_mk_tmpl(struct w_sock * const s)
+{
+    if (s->__tmpl == 0)
+        ensure((s->__tmpl = calloc(1, sizeof(*s->__tmpl))) != 0,
+               "cannot allocate header template");
+    struct w_tmpl * const t = s->__tmpl;
+    memset(t->hdr, 0, sizeof(t->hdr));
 
+    struct w_iov v = {.w = s->w, .base = t->hdr};
+    struct udp_hdr * udp;
+    uint8_t * const ip = eth_data(t->hdr);
+    if (s->ws_af == AF_INET) {
+        mk_ip4_hdr(&v, s);
+        struct ip4_hdr * const ip4 = (void *)ip;
+        ip4->tos = 0;
+        ip4->len = ip4->id = ip4->cksum = 0;
+        ip4->cksum = ip_cksum(ip4, sizeof(*ip4));
+        t->id = (uint16_t)w_rand_uniform32(UINT16_MAX);
+        udp = (void *)ip4_data(t->hdr);
+    } else {
+        mk_ip6_hdr(&v, s);
+        struct ip6_hdr * const ip6 = (void *)ip;
+        ip6->vtcecnfl = 0;
+        ip6->vfc = (6 << 4);
+        ip6->len = 0;
+        udp = (void *)ip6_data(t->hdr);
+    }
+    udp->sport = s->ws_lport;
+    udp->dport = s->ws_rport;
+    mk_eth_hdr(s, &v);
+    t->sum = pseudo_cksum(ip);
+}
 
-    // adjust the buffer offset to the received data into the iov
-    i->base = buf;
-    i->buf = (uint8_t *)udp + sizeof(*udp);
-    const uint32_t tmp_idx = i->idx;
-    i->idx = s->buf_idx;
 
-    // put the original buffer of the iov into the receive ring
-    s->buf_idx = tmp_idx;
-    s->flags = NS_BUF_CHANGED;
+/// Prepend a copy of the header template of connected w_sock @p s to the
+/// payload in @p v, and patch in the per-packet fields. The IPv4 header
+/// checksum is updated incrementally, and the UDP checksum only sums the UDP
+/// header and payload on top of the precomputed pseudo-header sum.
+///
+/// @param      s     The w_sock to transmit over.
+/// @param      v     The w_iov to transmit.
+///
+/// @return     True if the payloads was sent, false otherwise.
+///
+static bool
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 8)
+    __attribute__((no_sanitize("alignment")))
+#endif
+    udp_tx_tmpl(const struct w_sock * const s, struct w_iov * const v)
+{
+    struct w_tmpl * const t = s->__tmpl;
+    const uint16_t vlen = v->len;
+    const uint16_t udp_len = vlen + sizeof(struct udp_hdr);
+    struct udp_hdr * udp;
 
-    // append the iov to the socket
-    sq_insert_tail(&ws->iv, i, next);
-    return true;
+    if (s->ws_af == AF_INET) {
+        memcpy(v->base, t->hdr,
+               sizeof(struct eth_hdr) + sizeof(struct ip4_hdr) + sizeof(*udp));
+        struct ip4_hdr * const ip = (void *)eth_data(v->base);
+        ip->tos = v->flags;
+        // if there is no per-packet ECN marking, apply default
+        if ((v->flags & ECN_MASK) == 0 && s->opt.enable_ecn)
+            ip->tos |= ECN_ECT0;
+        ip->len = bswap16(udp_len + sizeof(*ip));
+        // no need to do bswap16() for the ID, it only needs to be unique
+        ip->id = t->id++;
+
+        // TOS, length and ID are zero in the template checksum
+        uint16_t cksum = ip_cksum_update16(ip->cksum, 0, ip->len);
+        cksum = ip_cksum_update16(cksum, 0, ip->id);
+        if (ip->tos) {
+            uint16_t tos;
+            memcpy(&tos, (const uint8_t[]){0, ip->tos}, sizeof(tos));
+            cksum = ip_cksum_update16(cksum, 0, tos);
+        }
+        ip->cksum = cksum;
+        udp = (void *)ip4_data(v->base);
+        v->len = udp_len + sizeof(*ip);
+    } else {
+        memcpy(v->base, t->hdr,
+               sizeof(struct eth_hdr) + sizeof(struct ip6_hdr) + sizeof(*udp));
+        struct ip6_hdr * const ip = (void *)eth_data(v->base);
+        if (v->flags & ECN_MASK)
+            ip->vtcecnfl |=
+                (uint32_t)((v->flags & 0x0f) << 12 | (v->flags & 0xf0) >> 4);
+        else if (s->opt.enable_ecn)
+            // if there is no per-packet ECN marking, apply default
+            ip->vtcecnfl |= (ECN_ECT0 << 20);
+        ip->len = bswap16(udp_len);
+        udp = (void *)ip6_data(v->base);
+        v->len = udp_len + sizeof(*ip);
+    }
+
+    udp->len = bswap16(udp_len);
+    // compute the checksum, unless disabled by a socket option; reuse the
+    // payload sum if w_copy_cksum() already computed it
+    if (unlikely(s->opt.enable_udp_zero_checksums == false))
+        udp->cksum =
+            v->__csum
+                ? payload_cksum_hdr(t->sum, udp, sizeof(*udp), udp_len,
+                                    v->__csum)
+                : payload_cksum_pseudo(t->sum, udp, udp_len);
+
+    udp_log(udp);
+    const bool ret = eth_tx(v);
+    v->len = vlen;
+    return ret;
 }
 
 
 /// Sends a payload contained in a w_sock::ov via UDP. For a connected w_sock,
-/// prepends the template header from w_sock::hdr, computes the UDP length and
-/// checksum, and hands the packet off to ip_tx(). For a disconnected w_sock,
-/// uses the destination IP and port information in the w_iov for TX.
+/// prepends the header template built by udp_mk_tmpl() via udp_tx_tmpl(). For
+/// a disconnected w_sock, uses the destination IP and port information in the
+/// w_iov for TX, computes the UDP length and checksum, and hands the packet off
+/// to eth_tx(), or to neighbor_hold() if the destination MAC address is still
+/// being resolved.
 ///
 /// @param      s     The w_sock to transmit over.
 /// @param      v     The w_iov to transmit.
@@ -188,6 +364,9 @@ bool
 ///
 bool udp_tx(const struct w_sock * const s, struct w_iov * const v)
 {
+    if (likely(s->__tmpl))
+        return udp_tx_tmpl(s, v);
+
     const uint16_t vlen = v->len;
     v->len += sizeof(struct udp_hdr);
 
@@ -210,11 +389,19 @@ bool udp_tx(const struct w_sock * const s, struct w_iov * const v)
 
     // compute the checksum, unless disabled by a socket option
     if (unlikely(s->opt.enable_udp_zero_checksums == false))
-        udp->cksum = payload_cksum(eth_data(v->base), v->len);
+        udp->cksum =
+            v->__csum ? payload_cksum_hdr(pseudo_cksum(eth_data(v->base)), udp,
+                                          sizeof(*udp), v->len - ip_hdr_len,
+                                          v->__csum)
+                      : payload_cksum(eth_data(v->base), v->len);
 
-    mk_eth_hdr(s, v);
     udp_log(udp);
-    const bool ret = eth_tx(v);
+    bool ret = true;
+    if (likely(mk_eth_hdr(s, v)))
+        ret = eth_tx(v);
+    else
+        // hold a copy until the neighbor is resolved
+        neighbor_hold(s->w, w_connected(s) ? &s->ws_raddr : &v->wv_addr, v);
     v->len = vlen;
     return ret;
 }
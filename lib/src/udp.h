@@ -50,5 +50,13 @@ extern bool __attribute__((nonnull)) udp_rx(struct w_engine * const w,
                                             struct netmap_slot * const s,
                                             uint8_t * const buf);
 
+extern bool __attribute__((nonnull))
+udp_deliver(struct w_engine * const w,
+            struct netmap_slot * const s,
+            uint8_t * const buf,
+            struct w_sock * const ws);
+
+extern void __attribute__((nonnull)) udp_mk_tmpl(struct w_sock * const s);
+
 extern bool __attribute__((nonnull))
 udp_tx(const struct w_sock * const s, struct w_iov * const v);
@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2014-2022, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/time_types.h>
+#include <warpcore/warpcore.h>
+
+#include "uring.h"
+
+
+/// Map part of the io_uring @p fd into memory.
+///
+/// @param[in]  fd    The io_uring file descriptor.
+/// @param[in]  len   Length of the region.
+/// @param[in]  off   One of the IORING_OFF_* offsets.
+///
+/// @return     Pointer to the mapped region.
+///
+static void * ring_mmap(const int fd, const size_t len, const off_t off)
+{
+    void * const p =
+        mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, off);
+    ensure(p != MAP_FAILED, "cannot mmap io_uring (%s)", strerror(errno));
+    return p;
+}
+
+
+/// Set up io_uring @p u with @p entries submission queue entries, and a
+/// completion queue that is large enough to absorb bursts of multishot receive
+/// completions.
+///
+/// @param      u        The io_uring to initialize.
+/// @param[in]  entries  Number of submission queue entries.
+///
+void uring_init(struct uring * const u, const uint32_t entries)
+{
+    struct io_uring_params p = {.flags = IORING_SETUP_CQSIZE |
+                                         IORING_SETUP_SUBMIT_ALL |
+                                         IORING_SETUP_COOP_TASKRUN |
+                                         IORING_SETUP_TASKRUN_FLAG,
+                                .cq_entries = entries * 8};
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        // older kernel, try without the optional flags
+        p = (struct io_uring_params){.flags = IORING_SETUP_CQSIZE,
+                                     .cq_entries = entries * 8};
+        u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    }
+    ensure(u->fd >= 0, "cannot set up io_uring (%s)", strerror(errno));
+    ensure(p.features & IORING_FEAT_SINGLE_MMAP &&
+               p.features & IORING_FEAT_NODROP &&
+               p.features & IORING_FEAT_EXT_ARG,
+           "kernel io_uring lacks required features");
+
+    u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (u->cq_ring_len > u->sq_ring_len)
+        u->sq_ring_len = u->cq_ring_len;
+    u->cq_ring_len = u->sq_ring_len;
+    u->sq_ring = ring_mmap(u->fd, u->sq_ring_len, IORING_OFF_SQ_RING);
+    u->cq_ring = u->sq_ring; // IORING_FEAT_SINGLE_MMAP
+
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = ring_mmap(u->fd, u->sqes_len, IORING_OFF_SQES);
+
+    uint8_t * const sq = u->sq_ring;
+    u->sq_head = (uint32_t *)(void *)(sq + p.sq_off.head);
+    u->sq_tail = (uint32_t *)(void *)(sq + p.sq_off.tail);
+    u->sq_flags = (uint32_t *)(void *)(sq + p.sq_off.flags);
+    u->sq_array = (uint32_t *)(void *)(sq + p.sq_off.array);
+    u->sq_mask = *(uint32_t *)(void *)(sq + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sqe_tail = *u->sq_tail;
+
+    uint8_t * const cq = u->cq_ring;
+    u->cq_head = (uint32_t *)(void *)(cq + p.cq_off.head);
+    u->cq_tail = (uint32_t *)(void *)(cq + p.cq_off.tail);
+    u->cq_mask = *(uint32_t *)(void *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(void *)(cq + p.cq_off.cqes);
+}
+
+
+/// Tear down io_uring @p u.
+///
+/// @param      u     The io_uring.
+///
+void uring_cleanup(struct uring * const u)
+{
+    munmap(u->sqes, u->sqes_len);
+    munmap(u->sq_ring, u->sq_ring_len);
+    close(u->fd);
+    u->fd = -1;
+}
+
+
+/// Register a resource with io_uring @p u.
+///
+/// @param      u       The io_uring.
+/// @param[in]  opcode  One of the IORING_REGISTER_* opcodes.
+/// @param      arg     Opcode-specific argument.
+/// @param[in]  nr      Opcode-specific count.
+///
+/// @return     Zero on success, @p errno otherwise.
+///
+int uring_register(struct uring * const u,
+                   const unsigned int opcode,
+                   void * const arg,
+                   const unsigned int nr)
+{
+    return syscall(__NR_io_uring_register, u->fd, opcode, arg, nr) < 0 ? errno
+                                                                        : 0;
+}
+
+
+/// Submit all pending SQEs of io_uring @p u and, if @p wait is set and no
+/// completions are pending, wait for at least one completion. Also runs any
+/// deferred completion work the kernel has flagged.
+///
+/// @param      u     The io_uring.
+/// @param[in]  wait  Whether to wait for a completion.
+/// @param[in]  nsec  Timeout in nanoseconds for waiting. Pass -1 for infinite
+///                   wait.
+///
+/// @return     Number of SQEs submitted, or -1 with errno set.
+///
+int uring_enter(struct uring * const u, const bool wait, const int64_t nsec)
+{
+    const uint32_t submit = u->sqe_tail - *u->sq_tail;
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+
+    unsigned int flags = 0;
+    unsigned int min_complete = 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = {.sigmask_sz = _NSIG / 8};
+    if (wait && uring_peek_cqe(u) == 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+        min_complete = 1;
+        if (nsec >= 0) {
+            ts = (struct __kernel_timespec){.tv_sec = nsec / NS_PER_S,
+                                            .tv_nsec = nsec % NS_PER_S};
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    } else if (__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) &
+               IORING_SQ_TASKRUN)
+        // the kernel has completions waiting for us to enter
+        flags |= IORING_ENTER_GETEVENTS;
+
+    if (submit == 0 && flags == 0)
+        return 0;
+
+    flags |= IORING_ENTER_EXT_ARG;
+    const int ret = (int)syscall(__NR_io_uring_enter, u->fd, submit,
+                                 min_complete, flags, &arg, sizeof(arg));
+    if (unlikely(ret < 0 && errno != ETIME && errno != EINTR))
+        warn(ERR, "io_uring_enter returned %d (%s)", errno, strerror(errno));
+    return ret;
+}
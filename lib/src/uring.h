@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2014-2022, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <linux/io_uring.h>
+#include <warpcore/warpcore.h>
+
+
+/// A minimal io_uring instance, set up via the raw system calls.
+///
+struct uring {
+    struct io_uring_sqe * sqes; ///< Submission queue entries.
+    struct io_uring_cqe * cqes; ///< Completion queue entries.
+    uint32_t * sq_head;         ///< Kernel-owned submission queue head.
+    uint32_t * sq_tail;         ///< Submission queue tail.
+    uint32_t * sq_flags;        ///< Submission queue flags.
+    uint32_t * sq_array;        ///< Submission queue index array.
+    uint32_t * cq_head;         ///< Completion queue head.
+    uint32_t * cq_tail;         ///< Kernel-owned completion queue tail.
+    void * sq_ring;             ///< Mapped submission queue ring.
+    void * cq_ring;             ///< Mapped completion queue ring.
+    size_t sq_ring_len;         ///< Length of @p sq_ring.
+    size_t cq_ring_len;         ///< Length of @p cq_ring.
+    size_t sqes_len;            ///< Length of @p sqes.
+    uint32_t sq_mask;           ///< Submission queue index mask.
+    uint32_t sq_entries;        ///< Number of submission queue entries.
+    uint32_t cq_mask;           ///< Completion queue index mask.
+    uint32_t sqe_tail;          ///< Tail including not-yet-submitted SQEs.
+    int fd;                     ///< Ring file descriptor.
+    /// @cond
+    uint8_t _unused[4]; ///< @internal Padding.
+                        /// @endcond
+};
+
+
+extern void __attribute__((nonnull))
+uring_init(struct uring * const u, const uint32_t entries);
+
+extern void __attribute__((nonnull)) uring_cleanup(struct uring * const u);
+
+extern int __attribute__((nonnull(1)))
+uring_register(struct uring * const u,
+               const unsigned int opcode,
+               void * const arg,
+               const unsigned int nr);
+
+extern int __attribute__((nonnull))
+uring_enter(struct uring * const u, const bool wait, const int64_t nsec);
+
+
+/// Return a zeroed submission queue entry, or zero if the submission queue is
+/// full. The entry is submitted by the next call to uring_enter().
+///
+/// @param      u     The io_uring.
+///
+/// @return     Submission queue entry, or zero.
+///
+static inline struct io_uring_sqe * __attribute__((nonnull))
+uring_get_sqe(struct uring * const u)
+{
+    if (unlikely(u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+                 u->sq_entries))
+        return 0;
+    const uint32_t idx = u->sqe_tail++ & u->sq_mask;
+    u->sq_array[idx] = idx;
+    struct io_uring_sqe * const sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+
+/// Return the next completion queue entry, or zero if there is none. The
+/// entry must be released with uring_cqe_seen().
+///
+/// @param      u     The io_uring.
+///
+/// @return     Completion queue entry, or zero.
+///
+static inline struct io_uring_cqe * __attribute__((nonnull))
+uring_peek_cqe(const struct uring * const u)
+{
+    const uint32_t head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    return &u->cqes[head & u->cq_mask];
+}
+
+
+/// Release the completion queue entry returned by uring_peek_cqe().
+///
+/// @param      u     The io_uring.
+///
+static inline void __attribute__((nonnull)) uring_cqe_seen(struct uring * const u)
+{
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+/// Return whether there are SQEs that have not been submitted yet.
+///
+/// @param      u     The io_uring.
+///
+/// @return     True if uring_enter() has SQEs to submit.
+///
+static inline bool __attribute__((nonnull))
+uring_pending(const struct uring * const u)
+{
+    return u->sqe_tail != *u->sq_tail;
+}
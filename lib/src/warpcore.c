@@ -51,7 +51,9 @@
 #endif
 
 #include "backend.h"
+#include "flow.h"
 #include "ifaddr.h"
+#include "in_cksum.h"
 #include "ip6.h"
 #include "neighbor.h"
 
@@ -93,7 +95,9 @@ dump_bufs(const char * const label, const struct w_iov_sq * const q)
 
 
 /// Return a spare w_iov from the pool of the given warpcore engine. Needs to be
-/// returned to w->iov via sq_insert_head() or sq_concat().
+/// returned to w->iov via sq_insert_head() or sq_concat(). With
+/// w_engopt::small_bufs, a @p len that fits a small buffer gets one, if there
+/// are any left.
 ///
 /// @param      w     Backend engine.
 /// @param[in]  af    Address family to allocate packet buffers.
@@ -116,9 +120,17 @@ w_alloc_iov(struct w_engine * const w,
     warn(DBG, "w_alloc_iov len %u, off %u", len, off);
 #endif
     assure(af == AF_INET || af == AF_INET6, "unknown address family");
+    const uint16_t hdr_space = iov_off(w, af);
+#ifdef POOL_ELASTIC
+    struct w_iov * v = 0;
+    if (len && w->b->small_max && off + hdr_space + len <= SMALL_BUF_LEN)
+        v = pool_alloc(w, true);
+    if (likely(v == 0))
+        v = w_alloc_iov_base(w);
+#else
     struct w_iov * const v = w_alloc_iov_base(w);
+#endif
     if (likely(v)) {
-        const uint16_t hdr_space = iov_off(w, af);
         v->buf += off + hdr_space;
         v->len = len ? len : v->len - (off + hdr_space);
 #ifdef DEBUG_BUFFERS
@@ -159,9 +171,12 @@ void w_alloc_len(struct w_engine * const w,
     warn(DBG, "w_alloc_len qlen %" PRIu ", len %u, off %u", qlen, len, off);
     assure(sq_empty(q), "q not empty");
 #endif
+    const uint_t cap = len ? len : max_buf_len(w) - (off + iov_off(w, af));
     uint_t needed = qlen;
     while (likely(needed)) {
-        struct w_iov * const v = w_alloc_iov(w, af, len, off);
+        // ask for exactly what is left for the last w_iov, so it can be small
+        struct w_iov * const v =
+            w_alloc_iov(w, af, needed < cap ? (uint16_t)needed : len, off);
         if (unlikely(v == 0))
             return;
         if (likely(needed > v->len))
@@ -300,6 +315,7 @@ struct w_sock * w_bind(struct w_engine * const w,
     s->ws_scope = w->ifaddr[addr_idx].scope_id;
     s->w = w;
     sq_init(&s->iv);
+    sq_init(&s->__paced);
 
     if (unlikely(backend_bind(s, opt) != 0)) {
         warn(ERR, "w_bind failed on %s:%u (%s)", w_ntop(&s->ws_laddr, ip_tmp),
@@ -325,6 +341,12 @@ fail:
 ///
 void w_close(struct w_sock * const s)
 {
+    // drop any w_iovs held back for pacing
+    if (unlikely(!sq_empty(&s->__paced))) {
+        w_free(&s->__paced);
+        sl_remove(&s->w->b->paced, s, w_sock, __pnext);
+    }
+
     backend_close(s);
 
     // free the socket
@@ -341,6 +363,7 @@ void w_close(struct w_sock * const s)
 void w_cleanup(struct w_engine * const w)
 {
     warn(NTE, "warpcore shutting down");
+    w_free(&w->b->pace_sent);
     backend_cleanup(w);
 #if !defined(PARTICLE) && !defined(RIOT_VERSION)
     sl_remove(&engines, w, w_engine, next);
@@ -405,16 +428,40 @@ void ip6_config(struct w_ifaddr * const ia, const uint8_t * const mask)
 ///
 /// @return     Initialized warpcore engine.
 ///
-struct w_engine * w_init(const char * const ifname,
-                         const uint32_t rip __attribute__((unused)),
-                         const uint_t nbufs)
+struct w_engine *
+w_init(const char * const ifname, const uint32_t rip, const uint_t nbufs)
+{
+    return w_init_opt(ifname, rip, nbufs, 0);
+}
+
+
+/// Initialize a warpcore engine on the given interface, like w_init(), with
+/// the engine options @p opt.
+///
+/// @param[in]  ifname  The OS name of the interface (e.g., "eth0").
+/// @param[in]  rip     The default router to be used for non-local
+///                     destinations. Can be zero.
+/// @param[in]  nbufs   Number of extra packet buffers to allocate.
+/// @param[in]  opt     Engine options. Can be zero.
+///
+/// @return     Initialized warpcore engine.
+///
+struct w_engine * w_init_opt(const char * const ifname,
+                             const uint32_t rip __attribute__((unused)),
+                             const uint_t nbufs,
+                             const struct w_engopt * const opt)
 {
 #if !defined(PARTICLE) && !defined(RIOT_VERSION)
+    // sharded engines may share the interface, up to their agreed number
+    const uint32_t shards = opt && opt->shards > 1 ? opt->shards : 1;
+    uint32_t cnt = 0;
     struct w_engine * e;
     sl_foreach (e, &engines, next)
         if (strncmp(ifname, e->ifname, IFNAMSIZ) == 0 &&
-            e->is_loopback == false) {
-            warn(ERR, "can only have one warpcore engine active on %s", ifname);
+            e->is_loopback == false &&
+            (e->opt.shards != shards || ++cnt >= shards)) {
+            warn(ERR, "can only have %" PRIu32 " warpcore engine%s active on %s",
+                 shards, plural(shards), ifname);
             return 0;
         }
 #endif
@@ -441,10 +488,13 @@ struct w_engine * w_init(const char * const ifname,
         w->ifname[sizeof(w->ifname) - 1] = 0;
     }
     sq_init(&w->iov);
+    if (opt)
+        w->opt = *opt;
 
     // backend-specific init
     w->b = calloc(1, sizeof(*w->b));
     ensure(w->b, "cannot alloc backend");
+    sq_init(&w->b->pace_sent);
     ensure(nbufs <= UINT32_MAX, "too many nbufs %" PRIu, nbufs);
     backend_init(w, (uint32_t)nbufs);
 
@@ -464,16 +514,22 @@ struct w_engine * w_init(const char * const ifname,
     sl_insert_head(&engines, w, next);
 #endif
 
+#ifdef POOL_ELASTIC
+    const uint_t bufs = w->b->pool_max;
+#else
+    const uint_t bufs = w_iov_sq_cnt(&w->iov);
+#endif
     warn(INF, "%s/%s (%s) %s using %" PRIu " %u-byte bufs on %s", warpcore_name,
-         w->backend_name, w->backend_variant, warpcore_version,
-         w_iov_sq_cnt(&w->iov), w->mtu, w->ifname);
+         w->backend_name, w->backend_variant, warpcore_version, bufs, w->mtu,
+         w->ifname);
     return w;
 }
 
 
 /// Return the maximum IP payload a given w_iov may have for the given IP
 /// address family. Basically, subtracts the header space and any offset
-/// specified when allocating the w_iov from the MTU.
+/// specified when allocating the w_iov from the MTU. A w_iov in a small buffer
+/// is further limited by the length of that buffer.
 ///
 /// @param[in]  v     The w_iov in question.
 /// @param[in]  af    IP address family.
@@ -484,7 +540,33 @@ struct w_engine * w_init(const char * const ifname,
 uint16_t w_max_iov_len(const struct w_iov * const v, const uint16_t af)
 {
     const uint16_t offset = (const uint16_t)(v->buf - v->base);
-    return v->w->mtu - offset - ip_hdr_len(af);
+    const uint16_t mtu_len = v->w->mtu - offset - ip_hdr_len(af);
+    const uint16_t buf_len = iov_max_len(v) - offset;
+    return mtu_len < buf_len ? mtu_len : buf_len;
+}
+
+
+/// Copy @p len bytes of payload data from @p src into the buffer of w_iov @p v,
+/// and set w_iov::len accordingly. The partial one's-complement sum of the data
+/// is computed in the same pass, and the netmap backend uses it for the UDP
+/// checksum when @p v is transmitted, instead of reading the payload again.
+/// Changing the payload of @p v afterwards without calling this function again
+/// will hence result in an invalid UDP checksum.
+///
+/// @param      v     The w_iov to fill.
+/// @param[in]  src   The payload data.
+/// @param[in]  len   The length of @p src.
+///
+/// @return     Partial one's-complement sum of the payload.
+///
+uint16_t
+w_copy_cksum(struct w_iov * const v, const void * const src, const uint16_t len)
+{
+    ensure(v->buf + len <= v->base + iov_max_len(v),
+           "%u bytes exceed w_iov buffer", len);
+    v->len = len;
+    v->__csum = cksum_copy(v->buf, src, len);
+    return v->__csum;
 }
 
 
@@ -498,6 +580,36 @@ void w_free(struct w_iov_sq * const q)
     if (unlikely(sq_empty(q)))
         return;
     struct w_engine * const w = sq_first(q)->w;
+#if defined(HAVE_MSG_ZEROCOPY) && !defined(WITH_NETMAP)
+    if (unlikely(w->b->zc_held)) {
+        // hold back w_iovs that the kernel is still transmitting from
+        struct w_iov_sq keep = w_iov_sq_initializer(keep);
+        while (!sq_empty(q)) {
+            struct w_iov * const v = sq_first(q);
+            sq_remove_head(q, next);
+            sq_next(v, next) = 0;
+            if (zc_park(v) == false)
+                sq_insert_tail(&keep, v, next);
+        }
+        sq_concat(q, &keep);
+        if (unlikely(sq_empty(q)))
+            return;
+    }
+#endif
+#ifdef POOL_ELASTIC
+    // return each w_iov to the tail of the free list of its size class
+    while (!sq_empty(q)) {
+        struct w_iov * const v = sq_first(q);
+        sq_remove_head(q, next);
+        sq_next(v, next) = 0;
+#ifdef DEBUG_BUFFERS
+        warn(DBG, "w_free idx %" PRIu32, v->idx);
+#endif
+        ASAN_POISON_MEMORY_REGION(v->base, iov_max_len(v));
+        sq_insert_tail(pool_list(w, v->idx), v, next);
+        pool_put(w, v->idx);
+    }
+#else
 #ifndef NDEBUG
     struct w_iov * v;
     sq_foreach (v, q, next) {
@@ -508,6 +620,7 @@ void w_free(struct w_iov_sq * const q)
     }
 #endif
     sq_concat(&w->iov, q);
+#endif
     dump_bufs(__func__, &w->iov);
 }
 
@@ -525,13 +638,111 @@ void __attribute__((no_instrument_function)) w_free_iov(struct w_iov * const v)
     assure(sq_next(v, next) == 0,
            "idx %" PRIu32 " still linked to idx %" PRIu32, v->idx,
            sq_next(v, next)->idx);
+#if defined(HAVE_MSG_ZEROCOPY) && !defined(WITH_NETMAP)
+    if (unlikely(zc_park(v)))
+        return;
+#endif
     dump_bufs(__func__, &v->w->iov);
-    sq_insert_head(&v->w->iov, v, next);
-    ASAN_POISON_MEMORY_REGION(v->base, max_buf_len(v->w));
+    sq_insert_head(pool_list(v->w, v->idx), v, next);
+    ASAN_POISON_MEMORY_REGION(v->base, iov_max_len(v));
+    pool_put(v->w, v->idx);
     dump_bufs(__func__, &v->w->iov);
 }
 
 
+/// Push the w_iov chain starting at @p first onto the remote-free stack of its
+/// engine.
+///
+/// @param      first  First w_iov of the chain.
+/// @param      tail   Address of the next pointer of the last w_iov.
+///
+static void __attribute__((nonnull))
+remote_push(struct w_iov * const first, struct w_iov ** const tail)
+{
+    struct w_engine * const w = first->w;
+    struct w_iov * head = __atomic_load_n(&w->remote, __ATOMIC_RELAXED);
+    do
+        *tail = head;
+    while (!__atomic_compare_exchange_n(&w->remote, &head, first, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+/// Return a w_iov tail queue to warpcore from a thread other than the one that
+/// drives the engine of the w_iovs, which must all belong to the same engine.
+/// This is lock-free; the engine thread reclaims the w_iovs in bulk during the
+/// next w_nic_rx(), or when its pool runs empty.
+///
+/// @param      q     Tail queue of w_iov structs to return.
+///
+void w_free_remote(struct w_iov_sq * const q)
+{
+    if (unlikely(sq_empty(q)))
+        return;
+    remote_push(sq_first(q), q->stqh_last);
+    sq_init(q);
+}
+
+
+/// Return a single w_iov to warpcore from a thread other than the one that
+/// drives its engine. See w_free_remote().
+///
+/// @param      v     w_iov struct to return.
+///
+void w_free_iov_remote(struct w_iov * const v)
+{
+    assure(sq_next(v, next) == 0,
+           "idx %" PRIu32 " still linked to idx %" PRIu32, v->idx,
+           sq_next(v, next)->idx);
+    remote_push(v, &sq_next(v, next));
+}
+
+
+/// Return the w_iovs that other threads have freed via w_free_remote() to the
+/// pool of engine @p w. Must be called by the thread that drives @p w.
+///
+/// @param      w     Backend engine.
+///
+void pool_reclaim(struct w_engine * const w)
+{
+    if (likely(__atomic_load_n(&w->remote, __ATOMIC_RELAXED) == 0))
+        return;
+    struct w_iov * v = __atomic_exchange_n(&w->remote, 0, __ATOMIC_ACQUIRE);
+    struct w_iov_sq q = w_iov_sq_initializer(q);
+    while (v) {
+        struct w_iov * const n = sq_next(v, next);
+        sq_next(v, next) = 0;
+        sq_insert_tail(&q, v, next);
+        v = n;
+    }
+    w_free(&q);
+}
+
+
+/// Return whether the kernel may still be reading from w_iov @p v, because it
+/// was sent by w_tx() on a w_sock with w_sockopt::enable_zero_copy set. Such a
+/// w_iov must not be modified until this returns false. Completions are
+/// processed by w_nic_tx(). Freeing an in-flight w_iov is fine; it is returned
+/// to the pool once the kernel releases it.
+///
+/// @param[in]  v     A w_iov.
+///
+/// @return     True if @p v is still in flight.
+///
+bool w_iov_in_flight(const struct w_iov * const v
+#if !defined(HAVE_MSG_ZEROCOPY) || defined(WITH_NETMAP)
+                     __attribute__((unused))
+#endif
+)
+{
+#if defined(HAVE_MSG_ZEROCOPY) && !defined(WITH_NETMAP)
+    return (v->w->b->zc_state[v->idx] & ~ZC_PARKED) != 0;
+#else
+    return false;
+#endif
+}
+
+
 /// Calculate a uniformly distributed random number in [0, upper_bound)
 /// avoiding "modulo bias".
 ///
@@ -595,8 +806,10 @@ static void __attribute__((no_instrument_function, nonnull))
 reinit_iov(struct w_iov * const v)
 {
     v->buf = v->base;
-    v->len = max_buf_len(v->w);
+    v->len = iov_max_len(v);
     v->flags = v->ttl = 0;
+    v->ts = v->txtime = v->hwts = 0;
+    v->__csum = 0;
     sq_next(v, next) = 0;
 }
 
@@ -611,33 +824,134 @@ init_iov(struct w_engine * const w, struct w_iov * const v, const uint32_t idx)
 }
 
 
-struct w_iov * w_alloc_iov_base(struct w_engine * const w)
+/// Take a w_iov from the pool of engine @p w, growing the pool if needed.
+///
+/// @param      w      Backend engine.
+/// @param[in]  small  Whether to take a small buffer; see w_engopt::small_bufs.
+///
+/// @return     Spare w_iov, or zero if there is none left.
+///
+struct w_iov * pool_alloc(struct w_engine * const w,
+                          const bool small
+#ifndef POOL_ELASTIC
+                          __attribute__((unused))
+#endif
+)
 {
-    struct w_iov * const v = sq_first(&w->iov);
+#ifdef POOL_ELASTIC
+    struct w_iov_sq * const q = small ? &w->b->small : &w->iov;
+#else
+    struct w_iov_sq * const q = &w->iov;
+#endif
+    struct w_iov * v = sq_first(q);
+    if (unlikely(v == 0)) {
+        pool_reclaim(w);
+        v = sq_first(q);
+    }
+#ifdef POOL_ELASTIC
+    if (unlikely(v == 0) && pool_grow(w, small))
+        v = sq_first(q);
+#endif
     if (likely(v)) {
-        sq_remove_head(&w->iov, next);
+        sq_remove_head(q, next);
+        pool_get(w, v->idx);
         reinit_iov(v);
         ASAN_UNPOISON_MEMORY_REGION(v->base, v->len);
 #ifdef DEBUG_BUFFERS
-        warn(DBG, "w_alloc_iov_base idx %" PRIu32, v ? v->idx : UINT32_MAX);
+        warn(DBG, "pool_alloc idx %" PRIu32, v ? v->idx : UINT32_MAX);
 #endif
     }
     return v;
 }
 
 
-khint_t
-#if defined(__clang__)
-    __attribute__((no_sanitize("unsigned-integer-overflow")))
-#endif
-    w_socktuple_hash(const struct w_socktuple * const tup)
-{
-    return w_addr_hash(&tup->local.addr) +
-           fnv1a_32(&tup->local.port, sizeof(tup->local.port)) +
-           (tup->remote.addr.af
-                ? (w_addr_hash(&tup->remote.addr) +
-                   fnv1a_32(&tup->local.port, sizeof(tup->local.port)))
-                : 0);
+struct w_iov * w_alloc_iov_base(struct w_engine * const w)
+{
+    return pool_alloc(w, false);
+}
+
+
+/// Hold back the w_iov chain starting at @p v, which is not due for sending on
+/// w_sock @p s yet, until pace_flush() finds it due. The chain is copied, so
+/// the application keeps ownership of the original w_iovs. If the pool runs
+/// out of w_iovs for the copies, the rest of the chain is dropped, as if lost
+/// on the wire.
+///
+/// @param      s     The w_sock to send on.
+/// @param[in]  v     The first w_iov to hold back.
+///
+void pace_defer(struct w_sock * const s, const struct w_iov * v)
+{
+    const bool was_empty = sq_empty(&s->__paced);
+    for (; v; v = sq_next(v, next)) {
+        struct w_iov * const c = w_alloc_iov_base(s->w);
+        if (unlikely(c == 0)) {
+            warn(CRT, "no more bufs, dropping paced w_iovs");
+            break;
+        }
+        c->buf = c->base + (v->buf - v->base);
+        c->len = v->len;
+        memcpy(c->buf, v->buf, v->len);
+        c->saddr = v->saddr;
+        c->flags = v->flags;
+        c->ttl = v->ttl;
+        c->txtime = v->txtime;
+        c->user_data = v->user_data;
+        sq_insert_tail(&s->__paced, c, next);
+    }
+    if (was_empty && !sq_empty(&s->__paced))
+        sl_insert_head(&s->w->b->paced, s, __pnext);
+}
+
+
+/// Send the w_iovs that pace_defer() held back and that are now due, in order,
+/// for all w_socks of engine @p w. Called by the backends from w_nic_tx().
+///
+/// @param      w     Backend engine.
+///
+void pace_flush(struct w_engine * const w)
+{
+    struct w_backend * const b = w->b;
+
+    // the copies sent by the previous call have left by now
+    w_free(&b->pace_sent);
+    if (likely(sl_empty(&b->paced)))
+        return;
+
+    const uint64_t now = w_now(CLOCK_MONOTONIC);
+    struct w_sock_slist l = b->paced;
+    sl_init(&b->paced);
+    struct w_iov_sq sent = w_iov_sq_initializer(sent);
+    while (!sl_empty(&l)) {
+        struct w_sock * const s = sl_first(&l);
+        sl_remove_head(&l, __pnext);
+
+        struct w_iov_sq due = w_iov_sq_initializer(due);
+        while (!sq_empty(&s->__paced) &&
+               sq_first(&s->__paced)->txtime <= now) {
+            struct w_iov * const v = sq_first(&s->__paced);
+            sq_remove_head(&s->__paced, next);
+            sq_insert_tail(&due, v, next);
+        }
+        if (!sq_empty(&due)) {
+            // detach the w_iovs that are not due yet, or w_tx() would hold
+            // back the due ones behind them
+            struct w_iov_sq later = w_iov_sq_initializer(later);
+            sq_concat(&later, &s->__paced);
+            w_tx(s, &due);
+            sq_concat(&sent, &due);
+            sq_concat(&s->__paced, &later);
+        }
+        if (!sq_empty(&s->__paced))
+            sl_insert_head(&b->paced, s, __pnext);
+    }
+    sq_concat(&b->pace_sent, &sent);
+}
+
+
+khint_t w_socktuple_hash(const struct w_socktuple * const tup)
+{
+    return (khint_t)flow_hash(tup);
 }
 
 
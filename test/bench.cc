@@ -30,13 +30,30 @@
 
 extern "C" {
 #include "common.h"
-// #include "in_cksum.h"
+#include "flow.h"
+#include "in_cksum.h"
+#ifdef WITH_NETMAP
+// the internal headers are C; C++ only knows restrict as an extension
+#define restrict __restrict__
+#include "backend.h"
+#include "eth.h"
+#include "ip4.h"
+#include "ip6.h"
+#include "udp.h"
+#undef restrict
+#endif
 }
 
 
 static void BM_io(benchmark::State & state)
 {
     const auto len = static_cast<uint32_t>(state.range(0));
+    struct w_sockopt opt = *w_get_sockopt(s_clnt);
+    opt.enable_udp_gso = state.range(1) != 0;
+    w_set_sockopt(s_clnt, &opt);
+    opt = *w_get_sockopt(s_serv);
+    opt.enable_udp_gro = state.range(2) != 0;
+    w_set_sockopt(s_serv, &opt);
     for (auto _ : state)
         if (!io(len)) {
             state.SkipWithError("ran out of bufs or saw packet loss");
@@ -47,16 +64,227 @@ static void BM_io(benchmark::State & state)
 }
 
 
-// static void BM_ip_cksum(benchmark::State & state)
-// {
-//     const auto len = uint16_t(state.range(0));
-//     auto * buf = new char[len];
-//     memset(buf, 'x', len);
-//     for (auto _ : state)
-//         benchmark::DoNotOptimize(ip_cksum(buf, len));
-//     state.SetBytesProcessed(int64_t(state.iterations()) * len);
-//     delete[] buf;
-// }
+// push a burst of packets through the per-packet w_iov path, i.e., allocate,
+// fill, send and free them, which mostly exercises the w_iov metadata
+static void BM_burst(benchmark::State & state)
+{
+    const auto len = static_cast<uint16_t>(state.range(0));
+    const uint32_t burst = 64;
+    for (auto _ : state) {
+        struct w_iov_sq o = w_iov_sq_initializer(o);
+        w_alloc_cnt(w_clnt, s_clnt->ws_af, &o, burst, len, 0);
+        if (w_iov_sq_cnt(&o) != burst) {
+            state.SkipWithError("ran out of bufs");
+            return;
+        }
+        struct w_iov * v;
+        sq_foreach (v, &o, next)
+            memset(v->buf, 'x', v->len);
+        w_tx(s_clnt, &o);
+        w_nic_tx(w_clnt);
+        w_free(&o);
+
+        // drain the server, so its socket buffer does not fill up
+        struct w_iov_sq i = w_iov_sq_initializer(i);
+        w_nic_rx(w_serv, 0);
+        w_rx(s_serv, &i);
+        w_free(&i);
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * burst);
+}
+
+static void BM_ip_cksum(benchmark::State & state)
+{
+    const auto len = static_cast<uint16_t>(state.range(0));
+    if (!cksum_use(static_cast<enum cksum_impl>(state.range(1)))) {
+        state.SkipWithError("checksum implementation unsupported");
+        return;
+    }
+    auto * buf = new char[len];
+    memset(buf, 'x', len);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(ip_cksum(buf, len));
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * len);
+    delete[] buf;
+    cksum_init();
+}
+
+
+// bind a number of idle server sockets next to s_serv, and measure how long it
+// takes to find the one socket that actually has data via w_rx_ready()
+static void BM_rx_ready(benchmark::State & state)
+{
+    const auto idle = static_cast<uint32_t>(state.range(0));
+    auto * const s = new struct w_sock *[idle];
+    for (uint32_t n = 0; n < idle; n++)
+        s[n] = w_bind(w_serv, 0, 0, nullptr);
+
+    for (auto _ : state) {
+        struct w_iov_sq o = w_iov_sq_initializer(o);
+        w_alloc_cnt(w_clnt, s_clnt->ws_af, &o, 1, 64, 0);
+        w_tx(s_clnt, &o);
+        w_nic_tx(w_clnt);
+        w_free(&o);
+
+        struct w_sock_slist sl = w_sock_slist_initializer(sl);
+        for (uint32_t t = 0; t < 100 && sl_empty(&sl); t++) {
+            w_nic_rx(w_serv, NS_PER_MS);
+            w_rx_ready(w_serv, &sl);
+        }
+        if (sl_empty(&sl) || sl_first(&sl) != s_serv) {
+            state.SkipWithError("w_rx_ready did not return s_serv");
+            break;
+        }
+        struct w_iov_sq i = w_iov_sq_initializer(i);
+        w_rx(s_serv, &i);
+        w_free(&i);
+    }
+
+    for (uint32_t n = 0; n < idle; n++)
+        w_close(s[n]);
+    delete[] s;
+}
+
+
+// look up random flows among a given number of connected w_socks that share
+// the local address and port, as on a busy server
+static void BM_flow_find(benchmark::State & state)
+{
+    const auto flows = static_cast<uint32_t>(state.range(0));
+    struct w_flows f = {};
+    auto * const s =
+        static_cast<struct w_sock *>(calloc(flows, sizeof(struct w_sock)));
+    for (uint32_t n = 0; n < flows; n++) {
+        s[n].tup.local.addr.af = s[n].tup.remote.addr.af = AF_INET;
+        s[n].tup.local.addr.ip4 = 0x0100007f;
+        s[n].tup.local.port = bswap16(4433);
+        s[n].tup.remote.addr.ip4 = 0x0200000a + n;
+        s[n].tup.remote.port = bswap16(static_cast<uint16_t>(n));
+        flow_ins(&f, &s[n]);
+    }
+
+    uint32_t i = 0;
+    for (auto _ : state) {
+        // pseudo-random, so that the last-flow cache does not hit
+        const struct w_sock * const q = &s[(i++ * 2654435761U) % flows];
+        benchmark::DoNotOptimize(
+            flow_find(&f, &q->tup.local, &q->tup.remote));
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+    flow_free(&f);
+    free(s);
+}
+
+
+#ifdef WITH_NETMAP
+// write a UDP/IP frame for s_serv with a payload of len bytes into buf
+static uint16_t mk_frame(uint8_t * const buf, const uint16_t len)
+{
+    auto * const eth = reinterpret_cast<struct eth_hdr *>(buf);
+    eth->dst = w_serv->mac;
+    eth->src = w_clnt->mac;
+    uint8_t * const ip = eth_data(buf);
+    uint16_t ip_hdr_len;
+    if (s_serv->ws_af == AF_INET) {
+        eth->type = ETH_TYPE_IP4;
+        auto * const ip4 = reinterpret_cast<struct ip4_hdr *>(ip);
+        ip_hdr_len = sizeof(*ip4);
+        memset(ip4, 0, sizeof(*ip4));
+        ip4->vhl = (4 << 4) | (sizeof(*ip4) >> 2);
+        ip4->len = bswap16(sizeof(*ip4) + sizeof(struct udp_hdr) + len);
+        ip4->ttl = 64;
+        ip4->p = IP_P_UDP;
+        ip4->src = ip4->dst = s_serv->tup.local.addr.ip4;
+        ip4->cksum = ip_cksum(ip4, sizeof(*ip4));
+    } else {
+        eth->type = ETH_TYPE_IP6;
+        auto * const ip6 = reinterpret_cast<struct ip6_hdr *>(ip);
+        ip_hdr_len = sizeof(*ip6);
+        memset(ip6, 0, sizeof(*ip6));
+        ip6->vfc = 6 << 4;
+        ip6->len = bswap16(sizeof(struct udp_hdr) + len);
+        ip6->next_hdr = IP_P_UDP;
+        ip6->hlim = 64;
+        memcpy(ip6->src, s_serv->tup.local.addr.ip6, sizeof(ip6->src));
+        memcpy(ip6->dst, s_serv->tup.local.addr.ip6, sizeof(ip6->dst));
+    }
+    auto * const udp = reinterpret_cast<struct udp_hdr *>(ip + ip_hdr_len);
+    udp->sport = bswap16(4433);
+    udp->dport = s_serv->tup.local.port;
+    udp->len = bswap16(sizeof(*udp) + len);
+    udp->cksum = 0;
+    memset(udp + 1, 'x', len);
+    const auto ip_len = static_cast<uint16_t>(ip_hdr_len + sizeof(*udp) + len);
+    udp->cksum = payload_cksum(ip, ip_len);
+    return static_cast<uint16_t>(sizeof(*eth) + ip_len);
+}
+
+
+// feed bursts of UDP frames for s_serv through eth_rx_burst() from a mock RX
+// ring, like fuzz.c does, but with a ring that shares the buffers of w_serv so
+// that udp_deliver() can swap them for spare ones as it does on a NIC ring
+static void BM_rx_burst(benchmark::State & state)
+{
+    const auto n = static_cast<uint32_t>(state.range(0));
+    const auto len = static_cast<uint16_t>(state.range(1));
+    const struct netmap_ring * const nr = NETMAP_TXRING(w_serv->b->nif, 0);
+    auto * const r = static_cast<struct netmap_ring *>(
+        calloc(1, sizeof(struct netmap_ring) +
+                      (RX_BURST + 1) * sizeof(struct netmap_slot)));
+
+    // these are all const in netmap.h so force-overwrite, like fuzz.c
+    *const_cast<int64_t *>(&r->buf_ofs) =
+        reinterpret_cast<const char *>(nr) + nr->buf_ofs -
+        reinterpret_cast<char *>(r);
+    *const_cast<uint32_t *>(&r->num_slots) = RX_BURST + 1;
+    *const_cast<uint32_t *>(&r->nr_buf_size) = nr->nr_buf_size;
+
+    // the slots start out with buffers of w_serv; keep their w_iovs around so
+    // whatever buffers end up in the slots can be given back at the end
+    struct w_iov_sq q = w_iov_sq_initializer(q);
+    w_alloc_cnt(w_serv, s_serv->ws_af, &q, n, 0, 0);
+    if (w_iov_sq_cnt(&q) != n) {
+        state.SkipWithError("ran out of bufs");
+        w_free(&q);
+        free(r);
+        return;
+    }
+    uint32_t j = 0;
+    struct w_iov * v;
+    sq_foreach (v, &q, next)
+        r->slot[j++].buf_idx = v->idx;
+
+    for (auto _ : state) {
+        // udp_deliver() leaves fresh buffers in the slots, so refill them
+        for (j = 0; j < n; j++)
+            r->slot[j].len =
+                mk_frame(reinterpret_cast<uint8_t *>(
+                             NETMAP_BUF(r, r->slot[j].buf_idx)),
+                         len);
+        r->cur = r->head = 0;
+        r->tail = n;
+        eth_rx_burst(w_serv, r);
+
+        struct w_iov_sq i = w_iov_sq_initializer(i);
+        w_rx(s_serv, &i);
+        if (w_iov_sq_cnt(&i) != n) {
+            state.SkipWithError("eth_rx_burst() did not deliver the burst");
+            w_free(&i);
+            break;
+        }
+        w_free(&i);
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * n);
+
+    j = 0;
+    sq_foreach (v, &q, next) {
+        v->idx = r->slot[j++].buf_idx;
+        v->base = idx_to_buf(w_serv, v->idx);
+    }
+    w_free(&q);
+    free(r);
+}
+#endif
 
 
 // static void BM_arc4random(benchmark::State & state)
@@ -80,8 +308,25 @@ static void BM_io(benchmark::State & state)
 // }
 
 
-BENCHMARK(BM_io)->RangeMultiplier(2)->Range(1, 512);
-// BENCHMARK(BM_ip_cksum)->RangeMultiplier(2)->Range(64, 2048);
+BENCHMARK(BM_io)
+    ->ArgsProduct({benchmark::CreateRange(1, 512, 2), {0, 1}, {0, 1}})
+    ->ArgNames({"pkts", "gso", "gro"});
+BENCHMARK(BM_burst)->Arg(16)->Arg(1200)->ArgName("len");
+BENCHMARK(BM_ip_cksum)
+    ->ArgsProduct({{64, 256, 1500, 4096, 9000},
+                   benchmark::CreateDenseRange(CKSUM_SCALAR, CKSUM_IMPLS - 1,
+                                               1)})
+    ->ArgNames({"len", "impl"});
+BENCHMARK(BM_flow_find)
+    ->RangeMultiplier(16)
+    ->Range(1, 1 << 20)
+    ->ArgName("flows");
+BENCHMARK(BM_rx_ready)->RangeMultiplier(8)->Range(1, 4096)->ArgName("idle");
+#ifdef WITH_NETMAP
+BENCHMARK(BM_rx_burst)
+    ->ArgsProduct({{1, 8, RX_BURST}, {16, 1200}})
+    ->ArgNames({"pkts", "len"});
+#endif
 // BENCHMARK(BM_arc4random);
 // BENCHMARK(BM_random);
 // BENCHMARK(BM_w_rand);
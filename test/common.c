@@ -64,6 +64,10 @@ bool io(const uint_t len)
     }
     const uint_t olen = w_iov_sq_len(&o);
 
+    // netmap ring timestamps only have microsecond resolution
+    uint64_t before = w_now(CLOCK_REALTIME);
+    before -= before % NS_PER_US;
+
     // tx
     w_tx(s_clnt, &o);
     w_nic_tx(w_clnt);
@@ -80,8 +84,12 @@ bool io(const uint_t len)
             if (again) {
                 w_nic_rx(w_serv, 100 * NS_PER_MS);
                 again = false;
-            } else
+            } else {
+                // return the bufs, so a failure does not starve later tests
+                w_free(&o);
+                w_free(&i);
                 return false;
+            }
         }
     }
     ensure(w_iov_sq_cnt(&i) == w_iov_sq_cnt(&o),
@@ -90,6 +98,7 @@ bool io(const uint_t len)
     ensure(ilen == olen, "ilen %" PRIu " != olen %" PRIu, ilen, olen);
 
     // validate data (o was sent by client, i is received by server)
+    const uint64_t after = w_now(CLOCK_REALTIME);
     struct w_iov * iv = sq_first(&i);
     ov = sq_first(&o);
     while (ov && iv) {
@@ -101,6 +110,9 @@ bool io(const uint_t len)
         ensure(ov->flags == iv->flags, "TOS byte 0x%02x != 0x%02x", ov->flags,
                iv->flags);
         // warn(ERR, "TOS byte ov 0x%02x, iv 0x%02x", ov->flags, iv->flags);
+        ensure(iv->ts >= before && iv->ts <= after,
+               "RX timestamp %" PRIu64 " not in [%" PRIu64 ", %" PRIu64 "]",
+               iv->ts, before, after);
         ensure(iv->saddr.port == s_clnt->ws_lport,
                "port mismatch, in %u != out %u", bswap16(iv->saddr.port),
                bswap16(s_clnt->ws_lport));
@@ -120,6 +132,39 @@ bool io(const uint_t len)
 }
 
 
+// connect a new w_sock of w_clnt to port on the IPv6 loopback address, and
+// send one datagram of len bytes set to byte over it
+struct w_sock *
+send_to(const uint16_t port, const uint16_t len, const uint8_t byte)
+{
+    struct w_sock * const c = w_bind(w_clnt, 0, 0, 0);
+    ensure(c, "cannot bind client");
+    w_connect(c, (struct sockaddr *)&(struct sockaddr_in6){
+                     .sin6_family = AF_INET6,
+                     .sin6_addr = IN6ADDR_LOOPBACK_INIT,
+                     .sin6_port = bswap16(port)});
+    struct w_iov_sq o = w_iov_sq_initializer(o);
+    w_alloc_cnt(w_clnt, c->ws_af, &o, 1, len, 0);
+    memset(sq_first(&o)->buf, byte, len);
+    w_tx(c, &o);
+    w_nic_tx(w_clnt);
+    w_free(&o);
+    return c;
+}
+
+
+// poll engine w for up to 100ms, until w_sock s has received something
+void recv_from(struct w_engine * const w,
+               struct w_sock * const s,
+               struct w_iov_sq * const i)
+{
+    for (uint_t t = 0; t < 100 && sq_empty(i); t++) {
+        w_nic_rx(w, NS_PER_MS);
+        w_rx(s, i);
+    }
+}
+
+
 void init(const uint_t len)
 {
     char i[IFNAMSIZ] = "lo"
@@ -39,6 +39,11 @@ extern struct w_engine *w_serv, *w_clnt;
 extern struct w_sock *s_serv, *s_clnt;
 
 extern bool io(const uint_t len);
+extern struct w_sock *
+send_to(const uint16_t port, const uint16_t len, const uint8_t byte);
+extern void recv_from(struct w_engine * const w,
+                      struct w_sock * const s,
+                      struct w_iov_sq * const i);
 extern void init(const uint_t len);
 extern void cleanup(void);
 
@@ -108,6 +108,6 @@ int LLVMFuzzerTestOneInput(const uint8_t * data, const size_t size)
     s->len = (uint16_t)MIN(size, r->nr_buf_size);
     memcpy(buf, data, s->len);
 
-    eth_rx(&w, s, buf);
+    eth_rx_burst(&w, r);
     return 0;
 }
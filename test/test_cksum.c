@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2014-2022, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <warpcore/warpcore.h>
+
+#include "in_cksum.h"
+#include "ip4.h"
+#include "ip6.h"
+
+#define LEN 9000
+
+
+// sum (and copy) random buffers of all lengths and alignments with the scalar
+// checksum, and check that every other implementation the CPU supports agrees
+int main(void)
+{
+    static uint8_t buf[LEN + 128] __attribute__((aligned(8)));
+    static uint8_t cpy[LEN + 8] __attribute__((aligned(8)));
+    static uint16_t ref[4][LEN + 1];
+
+    // RFC 1071, section 3 example
+    static const uint8_t rfc[] = {0x00, 0x01, 0xf2, 0x03,
+                                  0xf4, 0xf5, 0xf6, 0xf7};
+    ensure(cksum_use(CKSUM_SCALAR), "no scalar checksum");
+    const uint16_t c = ip_cksum(rfc, sizeof(rfc));
+    ensure(memcmp(&c, (const uint8_t[]){0x22, 0x0d}, sizeof(c)) == 0,
+           "RFC 1071 checksum 0x%04x", bswap16(c));
+
+    w_init_rand();
+    for (uint32_t i = 0; i < sizeof(buf); i++)
+        buf[i] = (uint8_t)w_rand_uniform32(UINT8_MAX + 1);
+
+    // the plain buffer is deliberately not vector-aligned
+    struct ip4_hdr * const ip4 = (void *)buf;
+    struct ip6_hdr * const ip6 = (void *)(buf + 64);
+    uint8_t * const raw = buf + 126;
+    ip4->vhl = 0x45;
+    ip4->p = IP_P_UDP;
+    ip6->vfc = (6 << 4);
+    ip6->next_hdr = IP_P_UDP;
+
+    for (enum cksum_impl impl = CKSUM_SCALAR; impl < CKSUM_IMPLS; impl++) {
+        if (cksum_use(impl) == false) {
+            warn(NTE, "checksum implementation %u unsupported", impl);
+            continue;
+        }
+        for (uint16_t len = sizeof(*ip6); len <= LEN; len++) {
+            ip4->len = bswap16(len);
+            ip6->len = bswap16(len - sizeof(*ip6));
+            const uint16_t sum[4] = {ip_cksum(raw, len), payload_cksum(ip4, len),
+                                     payload_cksum(ip6, len),
+                                     cksum_copy(cpy + 2, raw, len)};
+            ensure(memcmp(cpy + 2, raw, len) == 0,
+                   "impl %u copy len %u mismatch", impl, len);
+            for (uint32_t k = 0; k < 4; k++) {
+                if (impl == CKSUM_SCALAR)
+                    ref[k][len] = sum[k];
+                else
+                    ensure(sum[k] == ref[k][len],
+                           "impl %u sum %u len %u: 0x%04x != 0x%04x", impl, k,
+                           len, sum[k], ref[k][len]);
+            }
+        }
+        warn(INF, "checksum implementation %u ok", impl);
+    }
+}
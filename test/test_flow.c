@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2014-2022, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <warpcore/warpcore.h>
+
+#include "flow.h"
+
+#define SOCKS 20000
+
+
+static void __attribute__((nonnull))
+mk_tup(struct w_socktuple * const tup, const uint32_t n, const bool bound)
+{
+    // few local addresses and ports, many remote ones
+    *tup = (struct w_socktuple){
+        .local = {.addr = {.af = n & 1 ? AF_INET6 : AF_INET},
+                  .port = bswap16((uint16_t)(4433 + n % 3))}};
+    if (tup->local.addr.af == AF_INET)
+        tup->local.addr.ip4 = 0x0100007f;
+    else
+        tup->local.addr.ip6[15] = 1;
+    if (bound)
+        return;
+    tup->remote = (struct w_sockaddr){.addr = {.af = tup->local.addr.af},
+                                      .port = bswap16((uint16_t)n)};
+    if (tup->remote.addr.af == AF_INET)
+        tup->remote.addr.ip4 = n / UINT16_MAX;
+    else
+        memcpy(tup->remote.addr.ip6, &n, sizeof(n));
+}
+
+
+// insert and remove random tuples, and check that the flow table always agrees
+// with which w_socks are supposedly in it
+int main(void)
+{
+    struct w_flows f = {0};
+    struct w_sock * const s = calloc(SOCKS, sizeof(*s));
+    bool * const in = calloc(SOCKS, sizeof(*in));
+    ensure(s && in, "calloc");
+    for (uint32_t n = 0; n < SOCKS; n++)
+        mk_tup(&s[n].tup, n, n < 6);
+
+    w_init_rand();
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < 20 * SOCKS; i++) {
+        const uint32_t n = w_rand_uniform32(SOCKS);
+        if (in[n]) {
+            ensure(flow_rem(&f, &s[n]), "remove %u", n);
+            ensure(flow_rem(&f, &s[n]) == false, "remove %u twice", n);
+            used--;
+        } else {
+            ensure(flow_ins(&f, &s[n]), "insert %u", n);
+            ensure(flow_ins(&f, &s[n]) == false, "insert %u twice", n);
+            used++;
+        }
+        in[n] = !in[n];
+        ensure(f.used == used, "used %u != %u", f.used, used);
+
+        // check a few random w_socks, going via the bound-only fallback
+        for (uint32_t k = 0; k < 4; k++) {
+            const uint32_t m = w_rand_uniform32(SOCKS);
+            ensure(flow_get(&f, &s[m].tup) == (in[m] ? &s[m] : 0),
+                   "get %u in %u", m, in[m]);
+            const struct w_sock * const r =
+                flow_find(&f, &s[m].tup.local, &s[m].tup.remote);
+            const uint32_t b = m < 6 ? m : m % 6;
+            const struct w_sock * const want =
+                in[m] ? &s[m] : (in[b] ? &s[b] : 0);
+            ensure(r == want, "find %u", m);
+            // again, from the cache
+            ensure(flow_find(&f, &s[m].tup.local, &s[m].tup.remote) == r,
+                   "cached find %u", m);
+        }
+    }
+
+    warn(INF, "flow table with %u socks in %u slots ok", f.used,
+         f.grps * FLOW_GRP);
+    flow_free(&f);
+    free(in);
+    free(s);
+}
@@ -129,5 +129,24 @@ int main(void)
         w_free(&q);
     }
 
+#ifdef POOL_ELASTIC
+    // a w_iov in a small buffer must not claim room beyond that buffer
+    const struct w_engopt eopt = {.small_bufs = true};
+    struct w_engine * const ws = w_init_opt(w->ifname, 0, 1024, &eopt);
+    v = w_alloc_iov(ws, s_serv->ws_af, 64, off / 10);
+    ensure(v->idx >= ws->b->small_idx, "no small buf");
+    ensure(w_max_iov_len(v, s_serv->ws_af) == SMALL_BUF_LEN - off / 10,
+           "max len %u != %u", w_max_iov_len(v, s_serv->ws_af),
+           SMALL_BUF_LEN - off / 10);
+    w_free_iov(v);
+    v = w_alloc_iov(ws, s_serv->ws_af, 0, off);
+    struct w_iov * const f = w_alloc_iov(w, s_serv->ws_af, 0, off);
+    ensure(w_max_iov_len(v, s_serv->ws_af) == w_max_iov_len(f, s_serv->ws_af),
+           "max len of full buf changed");
+    w_free_iov(f);
+    w_free_iov(v);
+    w_cleanup(ws);
+#endif
+
     cleanup();
 }
@@ -40,11 +40,13 @@ int main(void)
 
     // util_dlevel = WRN;
 
+    struct w_sock_slist sl = w_sock_slist_initializer(sl);
     int n = 0;
     while (1) {
         struct w_sock * const s = w_bind(w_clnt, 0, 0, 0);
         if (s == 0)
             break;
+        sl_insert_head(&sl, s, next);
         w_connect(s, (struct sockaddr *)&(struct sockaddr_in6){
                          .sin6_family = AF_INET6,
                          .sin6_addr = IN6ADDR_LOOPBACK_INIT,
@@ -58,5 +60,11 @@ int main(void)
 
     warn(WRN, "Was able to open %d connections", n);
 
+    while (!sl_empty(&sl)) {
+        struct w_sock * const s = sl_first(&sl);
+        sl_remove_head(&sl, next);
+        w_close(s);
+    }
+
     cleanup();
 }
@@ -132,6 +132,9 @@ static void con(void)
 {
     const int n1 = r(N);
     const int n2 = r(N);
+    if (n1 == n2)
+        // concatenating a list with itself would orphan its elements
+        return;
     sq_concat(&sq[n1], &sq[n2]);
 
     len[n1] += len[n2];
@@ -197,4 +200,11 @@ int main(void)
             ini();
         }
     }
+
+    for (int i = 0; i < N; i++) {
+        struct elem * e;
+        struct elem * t;
+        sq_foreach_safe (e, &sq[i], next, t)
+            free(e);
+    }
 }
@@ -25,23 +25,426 @@
 // ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 // POSSIBILITY OF SUCH DAMAGE.
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <unistd.h>
 
 #include <warpcore/warpcore.h>
 
+#include "backend.h"
 #include "common.h"
 
 
+// send a paced flight and check that it all arrives
+static void paced(const uint_t len, const uint64_t delay)
+{
+    struct w_sockopt opt = *w_get_sockopt(s_clnt);
+    opt.enable_txtime = true;
+    w_set_sockopt(s_clnt, &opt);
+
+    struct w_iov_sq o = w_iov_sq_initializer(o);
+    w_alloc_cnt(w_clnt, s_clnt->ws_af, &o, len, 512, 0);
+    const uint64_t txtime = w_now(CLOCK_MONOTONIC) + delay;
+    struct w_iov * v;
+    sq_foreach (v, &o, next)
+        v->txtime = txtime;
+    w_tx(s_clnt, &o);
+    w_free(&o);
+
+    struct w_iov_sq i = w_iov_sq_initializer(i);
+    for (uint_t n = 0; n < 1000 && w_iov_sq_cnt(&i) < len; n++) {
+        w_nic_tx(w_clnt);
+        w_nic_rx(w_serv, NS_PER_MS);
+        w_rx(s_serv, &i);
+    }
+    ensure(w_iov_sq_cnt(&i) == len, "paced %" PRIu " != %" PRIu,
+           w_iov_sq_cnt(&i), len);
+    w_free(&i);
+
+    opt.enable_txtime = false;
+    w_set_sockopt(s_clnt, &opt);
+}
+
+
+// send a burst with both UDP GSO and zero-copy, which needs more fragments
+// than the kernel can pin for a single zero-copy send, and check it arrives;
+// then check that the kernel releases a zero-copy w_iov after w_nic_tx()
+static void gso_zc(const uint_t len)
+{
+    const struct w_sockopt old = *w_get_sockopt(s_clnt);
+    struct w_sockopt opt = old;
+    opt.enable_udp_gso = opt.enable_zero_copy = true;
+    w_set_sockopt(s_clnt, &opt);
+    ensure(io(len), "gso + zc burst of %" PRIu " lost", len);
+
+    struct w_iov_sq o = w_iov_sq_initializer(o);
+    w_alloc_cnt(w_clnt, s_clnt->ws_af, &o, 1, 512, 0);
+    const struct w_iov * const v = sq_first(&o);
+    w_tx(s_clnt, &o);
+    w_nic_tx(w_clnt);
+    for (uint_t n = 0; w_iov_in_flight(v) && n < 100; n++) {
+        w_nic_rx(w_clnt, NS_PER_MS);
+        w_nic_tx(w_clnt);
+    }
+    ensure(w_iov_in_flight(v) == false, "zc w_iov still in flight");
+    w_free(&o);
+
+    struct w_iov_sq i = w_iov_sq_initializer(i);
+    recv_from(w_serv, s_serv, &i);
+    ensure(w_iov_sq_cnt(&i) == 1, "zc w_iov lost");
+    w_free(&i);
+    w_set_sockopt(s_clnt, &old);
+}
+
+
+// free w_iovs from several threads at once, and check that the engine thread
+// gets all of them back on its next w_nic_rx()
+#define FREERS 4
+#define FREER_BUFS 64
+
+static void * freer(void * const arg)
+{
+    struct w_iov_sq * const q = arg;
+    // return half the w_iovs one by one, and the rest as a queue
+    for (uint_t n = 0; n < FREER_BUFS / 2; n++) {
+        struct w_iov * const v = sq_first(q);
+        sq_remove_head(q, next);
+        sq_next(v, next) = 0;
+        w_free_iov_remote(v);
+    }
+    w_free_remote(q);
+    return 0;
+}
+
+
+static void remote_freed(void)
+{
+    struct w_iov_sq q[FREERS];
+    for (uint_t t = 0; t < FREERS; t++) {
+        sq_init(&q[t]);
+        w_alloc_cnt(w_serv, s_serv->ws_af, &q[t], FREER_BUFS, 0, 0);
+        ensure(w_iov_sq_cnt(&q[t]) == FREER_BUFS, "cannot alloc bufs");
+    }
+    const uint_t avail = w_iov_sq_cnt(&w_serv->iov);
+
+    pthread_t tid[FREERS];
+    for (uint_t t = 0; t < FREERS; t++)
+        ensure(pthread_create(&tid[t], 0, freer, &q[t]) == 0,
+               "pthread_create");
+    for (uint_t t = 0; t < FREERS; t++)
+        ensure(pthread_join(tid[t], 0) == 0, "pthread_join");
+    ensure(w_iov_sq_cnt(&w_serv->iov) == avail, "reclaimed too early");
+
+    w_nic_rx(w_serv, 0);
+    ensure(w_iov_sq_cnt(&w_serv->iov) == avail + FREERS * FREER_BUFS,
+           "reclaimed %" PRIu " of %u bufs", w_iov_sq_cnt(&w_serv->iov) - avail,
+           FREERS * FREER_BUFS);
+}
+
+
+// emulate pacing, and check that w_iovs that are due right away do not
+// overtake earlier ones that are still held back
+static void paced_order(void)
+{
+    const bool pace = s_clnt->__pace;
+    s_clnt->__pace = true;
+
+    struct w_iov_sq o = w_iov_sq_initializer(o);
+    w_alloc_cnt(w_clnt, s_clnt->ws_af, &o, 2, 64, 0);
+    struct w_iov * v;
+    sq_foreach (v, &o, next) {
+        memset(v->buf, 0xa1, v->len);
+        v->txtime = w_now(CLOCK_MONOTONIC) + 10 * NS_PER_MS;
+    }
+    w_tx(s_clnt, &o);
+    w_free(&o);
+    w_alloc_cnt(w_clnt, s_clnt->ws_af, &o, 2, 64, 0);
+    sq_foreach (v, &o, next)
+        memset(v->buf, 0xb2, v->len);
+    w_tx(s_clnt, &o);
+    w_free(&o);
+
+    struct w_iov_sq i = w_iov_sq_initializer(i);
+    for (uint_t n = 0; n < 1000 && w_iov_sq_cnt(&i) < 4; n++) {
+        w_nic_tx(w_clnt);
+        w_nic_rx(w_serv, NS_PER_MS);
+        w_rx(s_serv, &i);
+    }
+    ensure(w_iov_sq_cnt(&i) == 4, "paced %" PRIu " != 4", w_iov_sq_cnt(&i));
+    uint_t n = 0;
+    sq_foreach (v, &i, next)
+        ensure(v->buf[0] == (n++ < 2 ? 0xa1 : 0xb2), "paced w_iov %" PRIu
+               " reordered", n - 1);
+    w_free(&i);
+    s_clnt->__pace = pace;
+}
+
+
+// bind the same port in two sharded engines and check that flows from
+// several client sockets all arrive at one of them
+static void sharded(const uint_t flows)
+{
+    const struct w_engopt eopt = {.shards = 2};
+    struct w_engine * const w[2] = {w_init_opt(w_serv->ifname, 0, 1024, &eopt),
+                                    w_init_opt(w_serv->ifname, 0, 1024, &eopt)};
+    struct w_sock * const s[2] = {w_bind(w[0], 0, bswap16(55556), 0),
+                                  w[1] ? w_bind(w[1], 0, bswap16(55556), 0)
+                                       : 0};
+    ensure(s[0] && s[1], "cannot bind sharded port");
+
+    for (uint_t f = 0; f < flows; f++)
+        w_close(send_to(55556, 512, 0xaa));
+
+    struct w_iov_sq i[2] = {w_iov_sq_initializer(i[0]),
+                            w_iov_sq_initializer(i[1])};
+    for (uint_t n = 0;
+         n < 100 && w_iov_sq_cnt(&i[0]) + w_iov_sq_cnt(&i[1]) < flows; n++)
+        for (uint_t e = 0; e < 2; e++) {
+            w_nic_rx(w[e], NS_PER_MS);
+            w_rx(s[e], &i[e]);
+        }
+    warn(INF, "sharded %" PRIu " + %" PRIu " of %" PRIu " flows",
+         w_iov_sq_cnt(&i[0]), w_iov_sq_cnt(&i[1]), flows);
+    ensure(w_iov_sq_cnt(&i[0]) + w_iov_sq_cnt(&i[1]) == flows,
+           "sharded flows lost");
+
+    for (uint_t e = 0; e < 2; e++) {
+        w_free(&i[e]);
+        w_close(s[e]);
+        w_cleanup(w[e]);
+    }
+}
+
+
+// receive into the buffers of an engine that has them on (locked) huge pages,
+// or on regular pages if the system has none to spare
+static void hugepaged(void)
+{
+    const struct w_engopt eopt = {.hugepages = true, .mlock = true};
+    struct w_engine * const w = w_init_opt(w_serv->ifname, 0, 1024, &eopt);
+    struct w_sock * const s = w_bind(w, 0, bswap16(55558), 0);
+    ensure(s, "cannot bind hugepage port");
+
+    w_close(send_to(55558, 512, 0xaa));
+
+    struct w_iov_sq i = w_iov_sq_initializer(i);
+    recv_from(w, s, &i);
+    ensure(w_iov_sq_cnt(&i) == 1 && sq_first(&i)->len == 512 &&
+               sq_first(&i)->buf[511] == 0xaa,
+           "no datagram on hugepages");
+    w_free(&i);
+    w_close(s);
+    w_cleanup(w);
+}
+
+
+// use all buffers of an engine, so its pool grows to its full size, and check
+// that freeing them returns the memory of the idle chunks
+#ifdef POOL_ELASTIC
+static void elastic(void)
+{
+    const uint_t nbufs = 3 * POOL_CHUNK + 5;
+    const struct w_engopt eopt = {.pool_hiwat = POOL_CHUNK};
+    struct w_engine * const w = w_init_opt(w_serv->ifname, 0, nbufs, &eopt);
+    ensure(w->b->pool_len < nbufs, "pool preallocated");
+
+    struct w_iov_sq q = w_iov_sq_initializer(q);
+    w_alloc_cnt(w, AF_INET6, &q, nbufs + 1, 0, 0);
+    const uint_t got = w_iov_sq_cnt(&q);
+    ensure(got <= nbufs && w->b->pool_len == nbufs,
+           "pool has %" PRIu " of %" PRIu " bufs", got, nbufs);
+    struct w_iov * v;
+    sq_foreach (v, &q, next)
+        memset(v->buf, 0xaa, v->len);
+    w_free(&q);
+
+#ifdef __linux__
+    // the last full chunk went idle after more than pool_hiwat bufs were free
+    const size_t len = POOL_CHUNK * buf_stride(w);
+    const size_t pg = (size_t)getpagesize();
+    const uintptr_t beg = roundup((uintptr_t)w->mem + 2 * len, pg);
+    unsigned char vec[64];
+    ensure(mincore((void *)beg, sizeof(vec) * pg, vec) == 0, "mincore");
+    for (size_t p = 0; p < sizeof(vec); p++)
+        ensure((vec[p] & 1) == 0, "idle page %zu still resident", p);
+#endif
+
+    w_alloc_cnt(w, AF_INET6, &q, got, 0, 0);
+    ensure(w_iov_sq_cnt(&q) == got, "pool shrank");
+    w_free(&q);
+    w_cleanup(w);
+}
+
+
+// allocate short payloads from the small buffer class, and check that a short
+// datagram is moved into a small buffer on receive
+static void classes(void)
+{
+    const struct w_engopt eopt = {.small_bufs = true, .rx_compact = true};
+    struct w_engine * const w = w_init_opt(w_serv->ifname, 0, 1024, &eopt);
+    struct w_iov * v = w_alloc_iov(w, AF_INET6, 64, 0);
+    ensure(v && v->idx >= w->b->small_idx && v->len == 64, "no small buf");
+    w_free_iov(v);
+    v = w_alloc_iov(w, AF_INET6, 0, 0);
+    ensure(v && v->idx < w->b->small_idx, "small buf for full payload");
+    const uint16_t mtu = v->len;
+    w_free_iov(v);
+
+    struct w_iov_sq q = w_iov_sq_initializer(q);
+    w_alloc_len(w, AF_INET6, &q, mtu + 50U, 0, 0);
+    ensure(w_iov_sq_cnt(&q) == 2 && sq_first(&q)->len == mtu &&
+               sq_last(&q, w_iov, next)->idx >= w->b->small_idx &&
+               sq_last(&q, w_iov, next)->len == 50,
+           "no small buf for tail");
+    w_free(&q);
+
+    struct w_sock * const s = w_bind(w, 0, bswap16(55559), 0);
+    ensure(s, "cannot bind classes port");
+    w_close(send_to(55559, 100, 0xbb));
+
+    recv_from(w, s, &q);
+    v = sq_first(&q);
+    ensure(w_iov_sq_cnt(&q) == 1 && v->idx >= w->b->small_idx &&
+               v->len == 100 && v->buf[0] == 0xbb && v->buf[99] == 0xbb,
+           "datagram not compacted");
+    w_free(&q);
+    w_close(s);
+    w_cleanup(w);
+}
+#endif
+
+
+// connect several w_socks to one port of a demultiplexing engine, and check
+// that each receives from its own peer, and the unconnected one from others;
+// also check that enabling ECN on one w_sock leaves its siblings alone
+#if !defined(HAVE_IO_URING) && (defined(HAVE_EPOLL) || defined(HAVE_KQUEUE))
+#define CONNS 16
+
+static void demuxed(void)
+{
+    const uint_t conns = CONNS;
+    const struct w_engopt eopt = {.demux = true};
+    struct w_engine * const w = w_init_opt(w_serv->ifname, 0, 1024, &eopt);
+    struct w_sock * const l = w_bind(w, 0, bswap16(55557), 0);
+    ensure(l, "cannot bind demux port");
+
+    struct w_sock * s[CONNS + 1];
+    struct w_sock * c[CONNS + 1];
+    // each client sends its index, each w_sock echoes it back
+    for (uint_t n = 0; n <= conns; n++) {
+        c[n] = send_to(55557, 1, (uint8_t)n);
+        if (n == conns)
+            // leave the last client to the unconnected w_sock
+            break;
+        s[n] = w_bind(w, 0, bswap16(55557), 0);
+        ensure(s[n] && s[n]->fd == l->fd, "demux bind");
+        w_connect(s[n], (struct sockaddr *)&(struct sockaddr_in6){
+                            .sin6_family = AF_INET6,
+                            .sin6_addr = IN6ADDR_LOOPBACK_INIT,
+                            .sin6_port = c[n]->ws_lport});
+        ensure(w_connected(s[n]), "demux connect");
+    }
+    s[conns] = l;
+
+    struct w_sockopt opt = *w_get_sockopt(s[0]);
+    opt.enable_ecn = true;
+    w_set_sockopt(s[0], &opt);
+    ensure(w_get_sockopt(s[1])->enable_ecn == false, "sibling got ECN");
+
+    uint_t got = 0;
+    for (uint_t t = 0; t < 100 && got <= conns; t++) {
+        w_nic_rx(w, NS_PER_MS);
+        struct w_sock_slist sl = w_sock_slist_initializer(sl);
+        w_rx_ready(w, &sl);
+        while (!sl_empty(&sl)) {
+            struct w_sock * const r = sl_first(&sl);
+            sl_remove_head(&sl, next);
+            struct w_iov_sq i = w_iov_sq_initializer(i);
+            w_rx(r, &i);
+            struct w_iov * v;
+            sq_foreach (v, &i, next) {
+                const uint_t n = v->buf[0];
+                ensure(n <= conns && r == s[n], "demuxed %" PRIu " wrongly",
+                       n);
+                got++;
+            }
+            if (r != l)
+                w_tx(r, &i);
+            w_free(&i);
+        }
+        w_nic_tx(w);
+    }
+    ensure(got == conns + 1, "demuxed %" PRIu " != %" PRIu, got, conns + 1);
+
+    for (uint_t n = 0; n < conns; n++) {
+        struct w_iov_sq i = w_iov_sq_initializer(i);
+        recv_from(w_clnt, c[n], &i);
+        ensure(w_iov_sq_cnt(&i) == 1, "no echo on %" PRIu, n);
+        ensure((sq_first(&i)->flags & ECN_MASK) ==
+                   (n == 0 ? ECN_ECT0 : ECN_NOT),
+               "echo on %" PRIu " has ECN 0x%02x", n,
+               sq_first(&i)->flags & ECN_MASK);
+        w_free(&i);
+        w_close(s[n]);
+    }
+    for (uint_t n = 0; n <= conns; n++)
+        w_close(c[n]);
+    w_close(l);
+    w_cleanup(w);
+}
+#endif
+
+
+// Burst length that every mode must deliver.
+#define MIN_BURST 32
+
 int main(void)
 {
     init(64 * 1024);
-    for (uint32_t i = 1; i <= 512; i <<= 1) {
-        if (io(i) == false) {
-            warn(INF, "test len %u failed", i);
-            break;
+    paced(16, 10 * NS_PER_MS);
+    paced_order();
+    remote_freed();
+    gso_zc(32);
+#ifndef WITH_NETMAP
+    sharded(16);
+    hugepaged();
+#ifdef POOL_ELASTIC
+    elastic();
+    classes();
+#endif
+#if !defined(HAVE_IO_URING) && (defined(HAVE_EPOLL) || defined(HAVE_KQUEUE))
+    demuxed();
+#endif
+#endif
+    struct w_sockopt copt = *w_get_sockopt(s_clnt);
+    struct w_sockopt sopt = *w_get_sockopt(s_serv);
+    for (uint32_t mode = 0; mode < 8; mode++) {
+        const uint32_t gso = mode & 1;
+        const uint32_t gro = (mode >> 1) & 1;
+        const uint32_t zc = mode >> 2;
+        copt.enable_udp_gso = gso;
+        copt.enable_zero_copy = zc;
+        w_set_sockopt(s_clnt, &copt);
+        sopt.enable_udp_gro = gro;
+        w_set_sockopt(s_serv, &sopt);
+        for (uint32_t i = 1; i <= 512; i <<= 1) {
+            if (io(i) == false) {
+                // longer bursts can overflow the default socket receive buffer
+                // of the loopback interface, esp. with zero-copy
+                ensure(i > MIN_BURST,
+                       "test len %u (gso %u, gro %u, zc %u) failed", i, gso,
+                       gro, zc);
+                warn(INF, "test len %u (gso %u, gro %u, zc %u) failed", i, gso,
+                     gro, zc);
+                break;
+            }
+            warn(INF, "test len %u (gso %u, gro %u, zc %u) ok", i, gso, gro,
+                 zc);
         }
-        warn(INF, "test len %u ok", i);
     }
     cleanup();
 }